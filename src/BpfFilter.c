@@ -0,0 +1,493 @@
+#include "pch.h"
+#include "BpfFilter.h"
+
+//..............................................................................
+
+static
+inline
+dm_BpfInsn*
+BpfFilter_p_getInsnArray(BpfFilter* self)
+{
+	return (dm_BpfInsn*)(self + 1);
+}
+
+// returns the number of context bytes required by a load; -1 if the
+// load is indexed (or not a context load at all)
+
+static
+size_t
+BpfFilter_p_getLoadEnd(const dm_BpfInsn* insn)
+{
+	switch (insn->m_code)
+	{
+	case BPF_LD | BPF_W | BPF_ABS:
+		return (int32_t)insn->m_k < 0 ? 0 : (size_t)insn->m_k + 4; // ancillary loads don't need context
+
+	case BPF_LD | BPF_H | BPF_ABS:
+		return (size_t)insn->m_k + 2;
+
+	case BPF_LD | BPF_B | BPF_ABS:
+	case BPF_LDX | BPF_B | BPF_MSH:
+		return (size_t)insn->m_k + 1;
+
+	case BPF_LD | BPF_W | BPF_IND:
+	case BPF_LD | BPF_H | BPF_IND:
+	case BPF_LD | BPF_B | BPF_IND:
+		return (size_t)-1;
+
+	default:
+		return 0;
+	}
+}
+
+static
+int
+BpfFilter_p_check(
+	const dm_BpfInsn* insnArray,
+	size_t insnCount
+	)
+{
+	const dm_BpfInsn* insn;
+	size_t leftover;
+	size_t i;
+
+	if (!insnCount || insnCount > dm_BpfInsnCountLimit)
+		return -EINVAL;
+
+	for (i = 0; i < insnCount; i++)
+	{
+		insn = &insnArray[i];
+		leftover = insnCount - i - 1; // jumps are relative to the next instruction
+
+		switch (insn->m_code)
+		{
+		case BPF_LD | BPF_W | BPF_ABS:
+		case BPF_LD | BPF_H | BPF_ABS:
+		case BPF_LD | BPF_B | BPF_ABS:
+		case BPF_LD | BPF_W | BPF_IND:
+		case BPF_LD | BPF_H | BPF_IND:
+		case BPF_LD | BPF_B | BPF_IND:
+		case BPF_LD | BPF_W | BPF_LEN:
+		case BPF_LD | BPF_IMM:
+		case BPF_LDX | BPF_W | BPF_IMM:
+		case BPF_LDX | BPF_W | BPF_LEN:
+		case BPF_LDX | BPF_B | BPF_MSH:
+		case BPF_ALU | BPF_ADD | BPF_K:
+		case BPF_ALU | BPF_ADD | BPF_X:
+		case BPF_ALU | BPF_SUB | BPF_K:
+		case BPF_ALU | BPF_SUB | BPF_X:
+		case BPF_ALU | BPF_MUL | BPF_K:
+		case BPF_ALU | BPF_MUL | BPF_X:
+		case BPF_ALU | BPF_DIV | BPF_X:
+		case BPF_ALU | BPF_MOD | BPF_X:
+		case BPF_ALU | BPF_AND | BPF_K:
+		case BPF_ALU | BPF_AND | BPF_X:
+		case BPF_ALU | BPF_OR | BPF_K:
+		case BPF_ALU | BPF_OR | BPF_X:
+		case BPF_ALU | BPF_XOR | BPF_K:
+		case BPF_ALU | BPF_XOR | BPF_X:
+		case BPF_ALU | BPF_LSH | BPF_X:
+		case BPF_ALU | BPF_RSH | BPF_X:
+		case BPF_ALU | BPF_NEG:
+		case BPF_RET | BPF_K:
+		case BPF_RET | BPF_A:
+		case BPF_MISC | BPF_TAX:
+		case BPF_MISC | BPF_TXA:
+			break;
+
+		case BPF_LD | BPF_MEM:
+		case BPF_LDX | BPF_W | BPF_MEM:
+		case BPF_ST:
+		case BPF_STX:
+			if (insn->m_k >= BPF_MEMWORDS)
+				return -EINVAL;
+			break;
+
+		case BPF_ALU | BPF_DIV | BPF_K:
+		case BPF_ALU | BPF_MOD | BPF_K:
+			if (!insn->m_k)
+				return -EINVAL;
+			break;
+
+		case BPF_ALU | BPF_LSH | BPF_K:
+		case BPF_ALU | BPF_RSH | BPF_K:
+			if (insn->m_k >= 32)
+				return -EINVAL;
+			break;
+
+		case BPF_JMP | BPF_JA:
+			if (insn->m_k >= leftover)
+				return -EINVAL;
+			break;
+
+		case BPF_JMP | BPF_JEQ | BPF_K:
+		case BPF_JMP | BPF_JEQ | BPF_X:
+		case BPF_JMP | BPF_JGT | BPF_K:
+		case BPF_JMP | BPF_JGT | BPF_X:
+		case BPF_JMP | BPF_JGE | BPF_K:
+		case BPF_JMP | BPF_JGE | BPF_X:
+		case BPF_JMP | BPF_JSET | BPF_K:
+		case BPF_JMP | BPF_JSET | BPF_X:
+			if (insn->m_jt >= leftover || insn->m_jf >= leftover)
+				return -EINVAL;
+			break;
+
+		default:
+			return -EINVAL;
+		}
+	}
+
+	// jumps are forward-only and in-bounds, so ending with a ret guarantees termination
+
+	return BPF_CLASS(insnArray[insnCount - 1].m_code) == BPF_RET ? 0 : -EINVAL;
+}
+
+static
+inline
+bool
+BpfFilter_p_load(
+	const char* context,
+	size_t contextSize,
+	uint64_t offset,
+	size_t size,
+	uint32_t* value
+	)
+{
+	if (offset > contextSize || size > contextSize - offset)
+		return false;
+
+	context += offset;
+
+	switch (size)
+	{
+	case 4:
+		*value = get_unaligned((const uint32_t*)context);
+		break;
+
+	case 2:
+		*value = get_unaligned((const uint16_t*)context);
+		break;
+
+	default:
+		*value = *(const uint8_t*)context;
+	}
+
+	return true;
+}
+
+static
+bool
+BpfFilter_p_loadAncillary(
+	uint32_t k,
+	uint32_t* value
+	)
+{
+	switch ((int32_t)k)
+	{
+	case dm_BpfAncillary_Uid:
+		*value = from_kuid_munged(current_user_ns(), current_uid());
+		return true;
+
+	case dm_BpfAncillary_Gid:
+		*value = from_kgid_munged(current_user_ns(), current_gid());
+		return true;
+
+	default:
+		return false;
+	}
+}
+
+// . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . .
+
+int
+BpfFilter_create(
+	BpfFilter** resultFilter,
+	const dm_BpfInsn* insnArray,
+	size_t insnCount
+	)
+{
+	BpfFilter* filter;
+	size_t contextSize;
+	size_t loadEnd;
+	size_t i;
+	int result;
+
+	result = BpfFilter_p_check(insnArray, insnCount);
+	if (result != 0)
+		return result;
+
+	filter = kmalloc(sizeof(BpfFilter) + insnCount * sizeof(dm_BpfInsn), GFP_KERNEL);
+	if (!filter)
+		return -ENOMEM;
+
+	contextSize = sizeof(dm_NotifyHdr);
+	for (i = 0; i < insnCount; i++)
+	{
+		loadEnd = BpfFilter_p_getLoadEnd(&insnArray[i]);
+		if (loadEnd > contextSize)
+			contextSize = loadEnd;
+	}
+
+	filter->m_insnCount = insnCount;
+	filter->m_contextSize = contextSize < dm_BpfContextSizeLimit ? contextSize : dm_BpfContextSizeLimit;
+	memcpy(BpfFilter_p_getInsnArray(filter), insnArray, insnCount * sizeof(dm_BpfInsn));
+
+	*resultFilter = filter;
+	return 0;
+}
+
+// loads are in host byte order (unlike socket filters, the context is not a
+// network packet); out-of-bounds loads drop the notification
+
+uint32_t
+BpfFilter_run(
+	BpfFilter* self,
+	const void* context,
+	size_t contextSize,
+	size_t notifySize
+	)
+{
+	const dm_BpfInsn* insnArray = BpfFilter_p_getInsnArray(self);
+	const dm_BpfInsn* insn;
+	uint32_t mem[BPF_MEMWORDS];
+	uint32_t a = 0;
+	uint32_t x = 0;
+	uint32_t value;
+	size_t pc;
+
+	memset(mem, 0, sizeof(mem));
+
+	for (pc = 0; pc < self->m_insnCount; pc++)
+	{
+		insn = &insnArray[pc];
+
+		switch (insn->m_code)
+		{
+		case BPF_LD | BPF_W | BPF_ABS:
+			if ((int32_t)insn->m_k < 0)
+			{
+				if (!BpfFilter_p_loadAncillary(insn->m_k, &a))
+					return 0;
+			}
+			else if (!BpfFilter_p_load(context, contextSize, insn->m_k, 4, &a))
+			{
+				return 0;
+			}
+
+			break;
+
+		case BPF_LD | BPF_H | BPF_ABS:
+			if (!BpfFilter_p_load(context, contextSize, insn->m_k, 2, &a))
+				return 0;
+			break;
+
+		case BPF_LD | BPF_B | BPF_ABS:
+			if (!BpfFilter_p_load(context, contextSize, insn->m_k, 1, &a))
+				return 0;
+			break;
+
+		case BPF_LD | BPF_W | BPF_IND:
+			if (!BpfFilter_p_load(context, contextSize, (uint64_t)insn->m_k + x, 4, &a))
+				return 0;
+			break;
+
+		case BPF_LD | BPF_H | BPF_IND:
+			if (!BpfFilter_p_load(context, contextSize, (uint64_t)insn->m_k + x, 2, &a))
+				return 0;
+			break;
+
+		case BPF_LD | BPF_B | BPF_IND:
+			if (!BpfFilter_p_load(context, contextSize, (uint64_t)insn->m_k + x, 1, &a))
+				return 0;
+			break;
+
+		case BPF_LD | BPF_W | BPF_LEN:
+			a = (uint32_t)notifySize;
+			break;
+
+		case BPF_LD | BPF_IMM:
+			a = insn->m_k;
+			break;
+
+		case BPF_LD | BPF_MEM:
+			a = mem[insn->m_k];
+			break;
+
+		case BPF_LDX | BPF_W | BPF_IMM:
+			x = insn->m_k;
+			break;
+
+		case BPF_LDX | BPF_W | BPF_LEN:
+			x = (uint32_t)notifySize;
+			break;
+
+		case BPF_LDX | BPF_W | BPF_MEM:
+			x = mem[insn->m_k];
+			break;
+
+		case BPF_LDX | BPF_B | BPF_MSH:
+			if (!BpfFilter_p_load(context, contextSize, insn->m_k, 1, &value))
+				return 0;
+
+			x = (value & 0xf) << 2;
+			break;
+
+		case BPF_ST:
+			mem[insn->m_k] = a;
+			break;
+
+		case BPF_STX:
+			mem[insn->m_k] = x;
+			break;
+
+		case BPF_ALU | BPF_ADD | BPF_K:
+			a += insn->m_k;
+			break;
+
+		case BPF_ALU | BPF_ADD | BPF_X:
+			a += x;
+			break;
+
+		case BPF_ALU | BPF_SUB | BPF_K:
+			a -= insn->m_k;
+			break;
+
+		case BPF_ALU | BPF_SUB | BPF_X:
+			a -= x;
+			break;
+
+		case BPF_ALU | BPF_MUL | BPF_K:
+			a *= insn->m_k;
+			break;
+
+		case BPF_ALU | BPF_MUL | BPF_X:
+			a *= x;
+			break;
+
+		case BPF_ALU | BPF_DIV | BPF_K:
+			a /= insn->m_k;
+			break;
+
+		case BPF_ALU | BPF_DIV | BPF_X:
+			if (!x)
+				return 0;
+
+			a /= x;
+			break;
+
+		case BPF_ALU | BPF_MOD | BPF_K:
+			a %= insn->m_k;
+			break;
+
+		case BPF_ALU | BPF_MOD | BPF_X:
+			if (!x)
+				return 0;
+
+			a %= x;
+			break;
+
+		case BPF_ALU | BPF_AND | BPF_K:
+			a &= insn->m_k;
+			break;
+
+		case BPF_ALU | BPF_AND | BPF_X:
+			a &= x;
+			break;
+
+		case BPF_ALU | BPF_OR | BPF_K:
+			a |= insn->m_k;
+			break;
+
+		case BPF_ALU | BPF_OR | BPF_X:
+			a |= x;
+			break;
+
+		case BPF_ALU | BPF_XOR | BPF_K:
+			a ^= insn->m_k;
+			break;
+
+		case BPF_ALU | BPF_XOR | BPF_X:
+			a ^= x;
+			break;
+
+		case BPF_ALU | BPF_LSH | BPF_K:
+			a <<= insn->m_k;
+			break;
+
+		case BPF_ALU | BPF_LSH | BPF_X:
+			a = x < 32 ? a << x : 0;
+			break;
+
+		case BPF_ALU | BPF_RSH | BPF_K:
+			a >>= insn->m_k;
+			break;
+
+		case BPF_ALU | BPF_RSH | BPF_X:
+			a = x < 32 ? a >> x : 0;
+			break;
+
+		case BPF_ALU | BPF_NEG:
+			a = -a;
+			break;
+
+		case BPF_JMP | BPF_JA:
+			pc += insn->m_k;
+			break;
+
+		case BPF_JMP | BPF_JEQ | BPF_K:
+			pc += a == insn->m_k ? insn->m_jt : insn->m_jf;
+			break;
+
+		case BPF_JMP | BPF_JEQ | BPF_X:
+			pc += a == x ? insn->m_jt : insn->m_jf;
+			break;
+
+		case BPF_JMP | BPF_JGT | BPF_K:
+			pc += a > insn->m_k ? insn->m_jt : insn->m_jf;
+			break;
+
+		case BPF_JMP | BPF_JGT | BPF_X:
+			pc += a > x ? insn->m_jt : insn->m_jf;
+			break;
+
+		case BPF_JMP | BPF_JGE | BPF_K:
+			pc += a >= insn->m_k ? insn->m_jt : insn->m_jf;
+			break;
+
+		case BPF_JMP | BPF_JGE | BPF_X:
+			pc += a >= x ? insn->m_jt : insn->m_jf;
+			break;
+
+		case BPF_JMP | BPF_JSET | BPF_K:
+			pc += (a & insn->m_k) ? insn->m_jt : insn->m_jf;
+			break;
+
+		case BPF_JMP | BPF_JSET | BPF_X:
+			pc += (a & x) ? insn->m_jt : insn->m_jf;
+			break;
+
+		case BPF_RET | BPF_K:
+			return insn->m_k;
+
+		case BPF_RET | BPF_A:
+			return a;
+
+		case BPF_MISC | BPF_TAX:
+			x = a;
+			break;
+
+		case BPF_MISC | BPF_TXA:
+			a = x;
+			break;
+
+		default:
+			ASSERT(false); // should have been checked
+			return 0;
+		}
+	}
+
+	ASSERT(false); // should have been checked (the last instruction is always a ret)
+	return 0;
+}
+
+//..............................................................................
@@ -0,0 +1,49 @@
+#pragma once
+
+#include "dm_lnx_Protocol.h"
+
+typedef struct BpfFilter BpfFilter;
+
+//..............................................................................
+
+// a classic BPF program run over the notification as it would be delivered
+// (dm_NotifyHdr, params, payload); validated once on attach, so the
+// interpreter only has to bounds-check loads. published via RCU and replaced
+// as a whole (just like the other connection filters)
+
+struct BpfFilter
+{
+	size_t m_insnCount;
+	size_t m_contextSize; // how many leading bytes of the notification the program may look at
+
+	// followed by dm_BpfInsn [m_insnCount]
+};
+
+// . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . .
+
+int
+BpfFilter_create(
+	BpfFilter** filter,
+	const dm_BpfInsn* insnArray,
+	size_t insnCount
+	);
+
+static
+inline
+void
+BpfFilter_delete(BpfFilter* self)
+{
+	kfree(self);
+}
+
+// returns 0 to drop the notification, otherwise the number of bytes to keep
+
+uint32_t
+BpfFilter_run(
+	BpfFilter* self,
+	const void* context,
+	size_t contextSize,
+	size_t notifySize
+	);
+
+//..............................................................................
@@ -0,0 +1,200 @@
+#include "pch.h"
+#include "CompactEncoder.h"
+
+//..............................................................................
+
+static
+inline
+uint8_t*
+putVarint(
+	uint8_t* p,
+	uint64_t value
+	)
+{
+	while (value >= 0x80)
+	{
+		*p++ = (uint8_t)value | 0x80;
+		value >>= 7;
+	}
+
+	*p++ = (uint8_t)value;
+	return p;
+}
+
+static
+inline
+uint32_t
+zigzag32(int32_t value)
+{
+	return ((uint32_t)value << 1) ^ (uint32_t)(value >> 31);
+}
+
+// . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . .
+
+static
+uint32_t
+CompactEncoder_p_getFileId(
+	CompactEncoder* self,
+	uint64_t filp,
+	uint16_t code,
+	int result
+	)
+{
+	HashTableEntry* entry;
+	uint32_t fileId;
+
+	if (code == dm_NotifyCode_Open && result != 0)
+		return 0;
+
+	entry = code == dm_NotifyCode_Close ?
+		HashTable_find(&self->m_fileIdMap, (void*)(uintptr_t)filp) :
+		HashTable_visit(&self->m_fileIdMap, (void*)(uintptr_t)filp);
+
+	if (entry && entry->m_value && code != dm_NotifyCode_Open) // open always starts over (filp may be reused)
+	{
+		fileId = (uint32_t)(uintptr_t)entry->m_value;
+
+		if (code == dm_NotifyCode_Close)
+			HashTable_remove(&self->m_fileIdMap, entry);
+
+		return fileId;
+	}
+
+	fileId = self->m_nextFileId++;
+	if (!self->m_nextFileId) // 0 is reserved
+		self->m_nextFileId = 1;
+
+	if (entry) // otherwise, out of memory or close -- still unique, just not remembered
+		entry->m_value = (void*)(uintptr_t)fileId;
+
+	return fileId;
+}
+
+// . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . .
+
+void
+CompactEncoder_construct(CompactEncoder* self)
+{
+	HashTable_construct(&self->m_fileIdMap, HashTableKeyType_Pointer, GFP_KERNEL);
+	CompactEncoder_reset(self);
+}
+
+void
+CompactEncoder_reset(CompactEncoder* self)
+{
+	HashTable_clear(&self->m_fileIdMap);
+	self->m_nextFileId = 1;
+	self->m_lastTimestamp = 0;
+	self->m_lastPid = 0;
+	self->m_lastTid = 0;
+	self->m_isSyncPending = true;
+}
+
+size_t
+CompactEncoder_encodeHdr(
+	CompactEncoder* self,
+	void* buffer,
+	uint16_t code,
+	uint16_t flags,
+	int result,
+	uint32_t pid,
+	uint32_t tid,
+	uint64_t timestamp,
+	uint32_t sampleWeight,
+	const void* params,
+	size_t payloadSize
+	)
+{
+	uint8_t fieldBuffer[CompactEncoderConst_MaxHdrSize];
+	uint8_t* p = fieldBuffer;
+	uint8_t* hdr = buffer;
+	size_t fieldSize;
+	uint8_t lead;
+	dm_NotifyParamsPtr paramsPtr;
+
+	lead = code & dm_CompactHdrFlag_CodeMask;
+
+	if (self->m_isSyncPending)
+	{
+		lead |= dm_CompactHdrFlag_Sync | dm_CompactHdrFlag_Pid;
+		p = putVarint(p, timestamp);
+		self->m_isSyncPending = false;
+	}
+	else
+	{
+		p = putVarint(p, timestamp - self->m_lastTimestamp); // mod 2^64 (the wall clock may go back)
+
+		if (pid != self->m_lastPid || tid != self->m_lastTid)
+			lead |= dm_CompactHdrFlag_Pid;
+	}
+
+	if (flags)
+	{
+		lead |= dm_CompactHdrFlag_Flags;
+		p = putVarint(p, flags);
+	}
+
+	if (lead & dm_CompactHdrFlag_Pid)
+	{
+		p = putVarint(p, pid);
+		p = putVarint(p, tid);
+	}
+
+	if (result)
+	{
+		lead |= dm_CompactHdrFlag_Result;
+		p = putVarint(p, zigzag32(result));
+	}
+
+	if (flags & dm_NotifyFlag_Sampled)
+		p = putVarint(p, sampleWeight);
+
+	paramsPtr.m_params = (void*)params;
+
+	switch (params ? code : dm_NotifyCode_Undefined)
+	{
+	case dm_NotifyCode_Open:
+		p = putVarint(p, CompactEncoder_p_getFileId(self, paramsPtr.m_openParams->m_fileId, code, result));
+		p = putVarint(p, paramsPtr.m_openParams->m_flags);
+		p = putVarint(p, paramsPtr.m_openParams->m_mode);
+		break;
+
+	case dm_NotifyCode_Close:
+		p = putVarint(p, CompactEncoder_p_getFileId(self, paramsPtr.m_closeParams->m_fileId, code, result));
+		break;
+
+	case dm_NotifyCode_Read:
+	case dm_NotifyCode_Write:
+	case dm_NotifyCode_ReadIter:
+	case dm_NotifyCode_WriteIter:
+		p = putVarint(p, CompactEncoder_p_getFileId(self, paramsPtr.m_readWriteParams->m_fileId, code, result));
+		p = putVarint(p, paramsPtr.m_readWriteParams->m_offset);
+		p = putVarint(p, paramsPtr.m_readWriteParams->m_bufferSize);
+		p = putVarint(p, paramsPtr.m_readWriteParams->m_dataSize);
+		break;
+
+	case dm_NotifyCode_UnlockedIoctl:
+	case dm_NotifyCode_CompatIoctl:
+		p = putVarint(p, CompactEncoder_p_getFileId(self, paramsPtr.m_ioctlParams->m_fileId, code, result));
+		p = putVarint(p, paramsPtr.m_ioctlParams->m_code);
+		p = putVarint(p, paramsPtr.m_ioctlParams->m_argSize);
+		p = putVarint(p, paramsPtr.m_ioctlParams->m_arg);
+		break;
+	}
+
+	fieldSize = p - fieldBuffer;
+
+	*hdr = lead;
+	p = putVarint(hdr + 1, fieldSize + payloadSize);
+	memcpy(p, fieldBuffer, fieldSize);
+	p += fieldSize;
+
+	ASSERT(p - hdr <= CompactEncoderConst_MaxHdrSize);
+
+	self->m_lastTimestamp = timestamp;
+	self->m_lastPid = pid;
+	self->m_lastTid = tid;
+	return p - hdr;
+}
+
+//..............................................................................
@@ -0,0 +1,74 @@
+#pragma once
+
+#include "dm_lnx_Protocol.h"
+#include "HashTable.h"
+
+typedef struct CompactEncoder CompactEncoder;
+
+//..............................................................................
+
+enum CompactEncoderConst
+{
+	CompactEncoderConst_MaxHdrSize = 96, // the lead byte, the record size and all the varints
+};
+
+// . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . .
+
+// dm_NotifyFormat_Compact record encoder; records must be encoded in the very
+// order they are queued (i.e. under m_lock of the connection)
+
+struct CompactEncoder
+{
+	HashTable m_fileIdMap; // filp -> file id
+	uint32_t m_nextFileId;
+	uint64_t m_lastTimestamp;
+	uint32_t m_lastPid;
+	uint32_t m_lastTid;
+	bool m_isSyncPending;
+};
+
+// . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . .
+
+void
+CompactEncoder_construct(CompactEncoder* self);
+
+static
+inline
+void
+CompactEncoder_destruct(CompactEncoder* self)
+{
+	HashTable_destruct(&self->m_fileIdMap);
+}
+
+void
+CompactEncoder_reset(CompactEncoder* self);
+
+// the next record will be a sync one (e.g. previous records were lost)
+
+static
+inline
+void
+CompactEncoder_requestSync(CompactEncoder* self)
+{
+	self->m_isSyncPending = true;
+}
+
+// encodes everything but the payload (payloadSize bytes, it goes right after
+// the header); buffer must be at least CompactEncoderConst_MaxHdrSize bytes
+
+size_t
+CompactEncoder_encodeHdr(
+	CompactEncoder* self,
+	void* buffer,
+	uint16_t code,
+	uint16_t flags,
+	int result,
+	uint32_t pid,
+	uint32_t tid,
+	uint64_t timestamp,
+	uint32_t sampleWeight,
+	const void* params, // dm_NotifyParams or NULL (dm_NotifyCode_DataDropped)
+	size_t payloadSize
+	);
+
+//..............................................................................
@@ -0,0 +1,100 @@
+#include "pch.h"
+#include "Compressor.h"
+#include "ScatterGather.h"
+
+//..............................................................................
+
+#if IS_ENABLED(CONFIG_LZ4_COMPRESS)
+
+#	if (LINUX_VERSION_CODE >= KERNEL_VERSION(4, 11, 0))
+#		define COMPRESSOR_DST_BUFFER_SIZE LZ4_COMPRESSBOUND(CompressorConst_MaxSize)
+#	else
+#		define COMPRESSOR_DST_BUFFER_SIZE lz4_compressbound(CompressorConst_MaxSize)
+#	endif
+
+int
+Compressor_create(Compressor* self)
+{
+	ASSERT(!self->m_workMem);
+
+	self->m_workMem = vmalloc(LZ4_MEM_COMPRESS);
+	self->m_srcBuffer = vmalloc(CompressorConst_MaxSize);
+	self->m_dstBuffer = vmalloc(COMPRESSOR_DST_BUFFER_SIZE);
+
+	if (!self->m_workMem || !self->m_srcBuffer || !self->m_dstBuffer)
+	{
+		Compressor_destroy(self);
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+const void*
+Compressor_compress(
+	Compressor* self,
+	const MemBlock* blockArray,
+	size_t blockCount,
+	size_t size,
+	size_t maxSize,
+	size_t* compressedSize
+	)
+{
+	ssize_t copySize;
+	int result;
+
+	if (size < CompressorConst_MinSize || size > CompressorConst_MaxSize)
+		return NULL;
+
+	copySize = copyScatterGatherHead(self->m_srcBuffer, size, blockArray, blockCount);
+	if (copySize != size)
+		return NULL;
+
+#	if (LINUX_VERSION_CODE >= KERNEL_VERSION(4, 11, 0))
+	result = LZ4_compress_default(self->m_srcBuffer, self->m_dstBuffer, size, maxSize, self->m_workMem);
+	if (result <= 0) // doesn't fit into maxSize
+		return NULL;
+
+	*compressedSize = result;
+#	else
+	result = lz4_compress(self->m_srcBuffer, size, self->m_dstBuffer, compressedSize, self->m_workMem);
+	if (result != 0 || *compressedSize > maxSize)
+		return NULL;
+#	endif
+
+	return self->m_dstBuffer;
+}
+
+#else // CONFIG_LZ4_COMPRESS
+
+int
+Compressor_create(Compressor* self)
+{
+	return -EOPNOTSUPP;
+}
+
+const void*
+Compressor_compress(
+	Compressor* self,
+	const MemBlock* blockArray,
+	size_t blockCount,
+	size_t size,
+	size_t maxSize,
+	size_t* compressedSize
+	)
+{
+	return NULL;
+}
+
+#endif // CONFIG_LZ4_COMPRESS
+
+void
+Compressor_destroy(Compressor* self)
+{
+	vfree(self->m_workMem); // vfree (NULL) is fine
+	vfree(self->m_srcBuffer);
+	vfree(self->m_dstBuffer);
+	Compressor_construct(self);
+}
+
+//..............................................................................
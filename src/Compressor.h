@@ -0,0 +1,68 @@
+#pragma once
+
+#include "typedefs.h"
+
+typedef struct Compressor Compressor;
+
+//..............................................................................
+
+enum CompressorConst
+{
+	CompressorConst_MinSize = 64,        // not worth it for anything smaller
+	CompressorConst_MaxSize = 64 * 1024, // bigger payloads are left as is
+};
+
+// . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . .
+
+// LZ4 payload compressor; the buffers are shared by all notifications of the
+// connection, so it's used under m_lock of the connection (which is held while
+// copying the payload anyway)
+
+struct Compressor
+{
+	void* m_workMem;
+	char* m_srcBuffer; // CompressorConst_MaxSize
+	char* m_dstBuffer; // compress bound of CompressorConst_MaxSize
+};
+
+// . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . .
+
+static
+inline
+void
+Compressor_construct(Compressor* self)
+{
+	self->m_workMem = NULL;
+	self->m_srcBuffer = NULL;
+	self->m_dstBuffer = NULL;
+}
+
+static
+inline
+bool
+Compressor_isCreated(Compressor* self)
+{
+	return self->m_workMem != NULL;
+}
+
+int
+Compressor_create(Compressor* self);
+
+void
+Compressor_destroy(Compressor* self);
+
+// returns the compressed data (in m_dstBuffer) or NULL if the payload is too
+// small/big, can't be copied or doesn't compress to less than maxSize;
+// the blocks (including iov_iter-s) are left intact
+
+const void*
+Compressor_compress(
+	Compressor* self,
+	const MemBlock* blockArray,
+	size_t blockCount,
+	size_t size,
+	size_t maxSize,
+	size_t* compressedSize
+	);
+
+//..............................................................................
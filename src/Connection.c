@@ -2,6 +2,7 @@
 #include "Connection.h"
 #include "Hook.h"
 #include "ScatterGather.h"
+#include "MemCache.h"
 
 //..............................................................................
 
@@ -32,19 +33,43 @@ Connection_create(
 	INIT_LIST_HEAD(&connection->m_pendingReadList);
 	INIT_LIST_HEAD(&connection->m_pendingNotifyList);
 	init_waitqueue_head(&connection->m_notificationWaitQueue);
-	HashTable_construct(&connection->m_ioctlDescMap, HashTableKeyType_Pointer, GFP_KERNEL);
+	PtrMap_construct(&connection->m_ioctlDescMap, GFP_KERNEL);
 	connection->m_hook = hook;
-	connection->m_fileNameFilter = NULL;
+	connection->m_hookSlot = 0; // assigned by Hook_addConnection
+	RCU_INIT_POINTER(connection->m_fileNameFilter, NULL);
+	RCU_INIT_POINTER(connection->m_pidFilter, NULL);
+	RCU_INIT_POINTER(connection->m_bpfFilter, NULL);
 	connection->m_ioctlDescTable = NULL;
 	connection->m_originalFilp = filp;
 	connection->m_inode = filp->f_inode;
 	connection->m_path = path;
 	connection->m_fileFlags = fileFlags;
 	connection->m_readMode = dm_ReadMode_Stream;
+	connection->m_captureMode = dm_CaptureMode_Queue;
+	connection->m_notifyFormat = dm_NotifyFormat_Default;
+	connection->m_compression = dm_Compression_None;
+	connection->m_pathMode = dm_PathMode_Immediate;
+	connection->m_ioctlArgMode = dm_IoctlArgMode_Table;
 	connection->m_pendingReadCount = 0;
 	connection->m_pendingNotifyCount = 0;
 	connection->m_pendingNotifySize = 0;
 	connection->m_pendingNotifySizeLimit = dm_DefPendingNotifySizeLimit;
+	connection->m_readCancelCount = 0;
+	connection->m_readBuffer = NULL;
+	connection->m_snapHeadSize = 0;
+	connection->m_snapTailSize = 0;
+	connection->m_notifyCodeMask = dm_NotifyCodeMask_All;
+	spin_lock_init(&connection->m_ringLock);
+	RCU_INIT_POINTER(connection->m_ringSet, NULL);
+	connection->m_ringSize = 0;
+	connection->m_ringFlags = 0;
+	connection->m_readRing = NULL;
+	connection->m_readRingPos = 0;
+	spin_lock_init(&connection->m_counterLock);
+	CounterMap_construct(&connection->m_counterMap);
+	Sampler_construct(&connection->m_sampler);
+	CompactEncoder_construct(&connection->m_compactEncoder);
+	Compressor_construct(&connection->m_compressor);
 
 	connection->m_refCount = 1;
 	connection->m_enableCount = 0; // initially disabled
@@ -75,11 +100,26 @@ Connection_release(Connection* self)
 	ASSERT(list_empty(&self->m_pendingReadList));
 	ASSERT(list_empty(&self->m_pendingNotifyList));
 
-	if (self->m_fileNameFilter)
-		FileNameFilter_delete(self->m_fileNameFilter);
+	if (rcu_access_pointer(self->m_fileNameFilter)) // no more readers at this point
+		FileNameFilter_delete(rcu_dereference_protected(self->m_fileNameFilter, true));
+
+	if (rcu_access_pointer(self->m_pidFilter))
+		PidFilter_delete(rcu_dereference_protected(self->m_pidFilter, true));
+
+	if (rcu_access_pointer(self->m_bpfFilter))
+		BpfFilter_delete(rcu_dereference_protected(self->m_bpfFilter, true));
+
+	if (rcu_access_pointer(self->m_ringSet)) // no more producers at this point (user mappings may still be there)
+		NotifyRingSet_release(rcu_dereference_protected(self->m_ringSet, true));
+
+	if (self->m_readBuffer)
+		PinnedBuffer_release(self->m_readBuffer);
 
 	mutex_destroy(&self->m_lock);
-	HashTable_destruct(&self->m_ioctlDescMap);
+	PtrMap_destruct(&self->m_ioctlDescMap);
+	CounterMap_destruct(&self->m_counterMap);
+	CompactEncoder_destruct(&self->m_compactEncoder);
+	Compressor_destroy(&self->m_compressor);
 	kfree(self->m_ioctlDescTable);
 	kfree(self->m_path);
 	kfree(self);
@@ -101,6 +141,10 @@ Connection_detachFromHook(Connection* self)
 	mutex_lock(&self->m_lock);
 	hook = self->m_hook;
 	self->m_hook = NULL;
+
+	if (hook && self->m_enableCount > 0)
+		Hook_disableNotifyCodes(hook, self->m_notifyCodeMask);
+
 	mutex_unlock(&self->m_lock);
 
 	if (hook)
@@ -123,6 +167,10 @@ Connection_enable(Connection* self)
 {
 	mutex_lock(&self->m_lock);
 	self->m_enableCount++;
+
+	if (self->m_enableCount == 1 && self->m_hook)
+		Hook_enableNotifyCodes(self->m_hook, self->m_notifyCodeMask);
+
 	mutex_unlock(&self->m_lock);
 }
 
@@ -132,6 +180,10 @@ Connection_disable(Connection* self)
 	struct list_head* link;
 	PendingRead* read;
 	PendingNotify* notify;
+	NotifyRingSet* ringSet;
+	NotifyRing** ringArray;
+	Hook* hook;
+	size_t i;
 
 	mutex_lock(&self->m_lock);
 	self->m_enableCount--;
@@ -142,14 +194,17 @@ Connection_disable(Connection* self)
 		return;
 	}
 
+	if (self->m_enableCount == 0 && self->m_hook)
+		Hook_disableNotifyCodes(self->m_hook, self->m_notifyCodeMask);
+
 	while (!list_empty(&self->m_pendingReadList))
 	{
 		link = self->m_pendingReadList.next;
 		list_del(link);
 		read = container_of(link, PendingRead, m_link);
+		read->m_isQueued = false;
 		read->m_result = -ECANCELED;
-		read->m_isCompleted = true;
-		wake_up_interruptible(&read->m_waitQueue);
+		smp_store_release(&read->m_isCompleted, true);
 	}
 
 	while (!list_empty(&self->m_pendingNotifyList))
@@ -157,17 +212,42 @@ Connection_disable(Connection* self)
 		link = self->m_pendingNotifyList.next;
 		list_del(link);
 		notify = container_of(link, PendingNotify, m_link);
-		kfree(notify);
+		MemCache_freeNotify(notify, notify->m_sizeClass);
 	}
 
 	self->m_pendingReadCount = 0;
 	self->m_pendingNotifyCount = 0;
 	self->m_pendingNotifySize = 0;
 
-	if (self->m_fileNameFilter)
-		HashTable_clear(&self->m_fileNameFilter->m_fileSet);
+	ringSet = rcu_dereference_protected(self->m_ringSet, lockdep_is_held(&self->m_lock));
+	if (ringSet)
+	{
+		ringArray = NotifyRingSet_getRingArray(ringSet);
+		for (i = 0; i < ringSet->m_ringCount; i++)
+			NotifyRing_drain(ringArray[i]);
+	}
+
+	self->m_readRing = NULL;
+	self->m_readRingPos = 0;
+	self->m_readCancelCount++;
+	wake_up(&self->m_notificationWaitQueue); // wake up blocked and ring readers
+
+	hook = self->m_hook;
+	if (hook)
+		Hook_addRef(hook);
 
+	CompactEncoder_reset(&self->m_compactEncoder); // the next enable starts a new stream
 	mutex_unlock(&self->m_lock);
+
+	if (hook)
+	{
+		// an open already past Connection_checkOpenFile may still set our bit;
+		// can't wait for it under m_lock -- notify takes it inside the SRCU section
+
+		synchronize_srcu(&hook->m_connectionListSrcu);
+		Hook_clearConnectionFiles(hook, self);
+		Hook_release(hook);
+	}
 }
 
 int
@@ -193,6 +273,11 @@ Connection_setReadMode(
 	dm_ReadMode mode
 	)
 {
+	if (mode != dm_ReadMode_Stream &&
+		mode != dm_ReadMode_Message &&
+		mode != dm_ReadMode_Batch)
+		return -EINVAL;
+
 	mutex_lock(&self->m_lock);
 	if (self->m_enableCount)
 	{
@@ -200,249 +285,1182 @@ Connection_setReadMode(
 		return -EBUSY;
 	}
 
+	if (self->m_notifyFormat == dm_NotifyFormat_Compact && mode != dm_ReadMode_Stream)
+	{
+		mutex_unlock(&self->m_lock);
+		return -EINVAL;
+	}
+
 	self->m_readMode = mode;
 	mutex_unlock(&self->m_lock);
 	return 0;
 }
 
 int
-Connection_getFileNameFilter(
+Connection_getCaptureMode(
 	Connection* self,
-	dm_String __user* filter_u
+	int __user* mode_u
 	)
 {
 	int result;
+	int mode;
 
 	mutex_lock(&self->m_lock);
-	if (self->m_enableCount)
-	{
-		mutex_unlock(&self->m_lock);
-		return -EBUSY;
-	}
-
-	result = self->m_fileNameFilter ? copyStringToUser(filter_u, self->m_fileNameFilter->m_fileNameWildcard) : 0;
-
+	mode = self->m_captureMode;
 	mutex_unlock(&self->m_lock);
-	return result;
+
+	result = copy_to_user(mode_u, &mode, sizeof(int));
+	return result == 0 ? 0 : -EFAULT;
 }
 
 int
-Connection_setFileNameFilter(
+Connection_setCaptureMode(
 	Connection* self,
-	const dm_String __user* filter_u
+	dm_CaptureMode mode
 	)
 {
+	NotifyRingSet* ringSet = NULL;
+	NotifyRingSet* prevRingSet;
 	int result;
-	const char* wildcard;
 
-	wildcard = copyStringFromUser(filter_u);
-	if (IS_ERR(wildcard))
-		return PTR_ERR(wildcard);
+	if (mode != dm_CaptureMode_Queue &&
+		mode != dm_CaptureMode_PerCpuRing &&
+		mode != dm_CaptureMode_Counters)
+		return -EINVAL;
 
 	mutex_lock(&self->m_lock);
 	if (self->m_enableCount)
 	{
 		mutex_unlock(&self->m_lock);
-		kfree(wildcard);
 		return -EBUSY;
 	}
 
-	if (self->m_fileNameFilter)
+	if (mode == self->m_captureMode)
+	{
+		mutex_unlock(&self->m_lock);
+		return 0;
+	}
+
+	if ((self->m_notifyFormat != dm_NotifyFormat_Default || self->m_compression != dm_Compression_None) &&
+		mode != dm_CaptureMode_Queue)
 	{
-		FileNameFilter_delete(self->m_fileNameFilter);
-		self->m_fileNameFilter = NULL;
+		mutex_unlock(&self->m_lock);
+		return -EINVAL;
 	}
 
-	result = *wildcard ? FileNameFilter_create(&self->m_fileNameFilter, wildcard, GFP_KERNEL) : 0;
+	if (mode == dm_CaptureMode_PerCpuRing)
+	{
+		ringSet = NotifyRingSet_create(Connection_p_getRingSize(self), self->m_ringFlags);
+		if (!ringSet)
+		{
+			mutex_unlock(&self->m_lock);
+			return -ENOMEM;
+		}
+	}
 
-	kfree(wildcard);
+	result = Connection_p_replaceRingSet(self, ringSet, &prevRingSet);
+	if (result != 0)
+	{
+		mutex_unlock(&self->m_lock);
+
+		if (ringSet)
+			NotifyRingSet_release(ringSet);
+
+		return result;
+	}
+
+	self->m_captureMode = mode;
+	spin_lock(&self->m_counterLock);
+	CounterMap_clear(&self->m_counterMap);
+	spin_unlock(&self->m_counterLock);
 	mutex_unlock(&self->m_lock);
-	return result;
+
+	if (prevRingSet)
+	{
+		synchronize_sched(); // wait for producers which are still writing to the old rings
+		NotifyRingSet_release(prevRingSet);
+	}
+
+	return 0;
 }
 
 int
-Connection_getIoctlDescTable(
+Connection_getNotifyFormat(
 	Connection* self,
-	dm_List __user* table_u
+	int __user* format_u
 	)
 {
 	int result;
-	dm_List table;
-	size_t bufferSize;
+	int format;
 
-	result = copy_from_user(&table, table_u, sizeof(dm_List));
-	if (result != 0)
-		return -EFAULT;
+	mutex_lock(&self->m_lock);
+	format = self->m_notifyFormat;
+	mutex_unlock(&self->m_lock);
 
-	if (table.m_bufferSize < sizeof(dm_List))
+	result = copy_to_user(format_u, &format, sizeof(int));
+	return result == 0 ? 0 : -EFAULT;
+}
+
+int
+Connection_setNotifyFormat(
+	Connection* self,
+	dm_NotifyFormat format
+	)
+{
+	if (format != dm_NotifyFormat_Default &&
+		format != dm_NotifyFormat_Compact)
 		return -EINVAL;
 
 	mutex_lock(&self->m_lock);
-	table.m_elementCount = (uint32_t)self->m_ioctlDescMap.m_entryCount;
-	table.m_dataSize = (uint32_t)self->m_ioctlDescMap.m_entryCount * sizeof(dm_IoctlDesc);
-
-	bufferSize = sizeof(dm_List) + table.m_dataSize;
+	if (self->m_enableCount) // also, the queue is empty while disabled
+	{
+		mutex_unlock(&self->m_lock);
+		return -EBUSY;
+	}
 
-	if (table.m_bufferSize < bufferSize)
+	if (format == dm_NotifyFormat_Compact &&
+		(self->m_captureMode != dm_CaptureMode_Queue ||
+		self->m_readMode != dm_ReadMode_Stream ||
+		self->m_compression != dm_Compression_None))
 	{
 		mutex_unlock(&self->m_lock);
-		table.m_bufferSize = bufferSize;
-		result = copy_to_user(table_u, &table, sizeof(dm_List));
-		return result == 0 ? -ENOBUFS : -EFAULT;
+		return -EINVAL;
 	}
 
-	result = copy_to_user(table_u, &table, sizeof(dm_List));
+	self->m_notifyFormat = format;
+	CompactEncoder_reset(&self->m_compactEncoder);
+	mutex_unlock(&self->m_lock);
+	return 0;
+}
 
-	if (result == 0)
-		result = copy_to_user(table_u + 1, self->m_ioctlDescTable, table.m_dataSize);
+int
+Connection_getCompression(
+	Connection* self,
+	int __user* compression_u
+	)
+{
+	int result;
+	int compression;
 
+	mutex_lock(&self->m_lock);
+	compression = self->m_compression;
 	mutex_unlock(&self->m_lock);
+
+	result = copy_to_user(compression_u, &compression, sizeof(int));
 	return result == 0 ? 0 : -EFAULT;
 }
 
 int
-Connection_setIoctlDescTable(
+Connection_setCompression(
 	Connection* self,
-	const dm_List __user* table_u
+	dm_Compression compression
 	)
 {
 	int result;
-	dm_List table;
-	const dm_IoctlDesc* ioctlDesc_u;
 
-	result = copy_from_user(&table, table_u, sizeof(dm_List));
-	if (result != 0)
-		return -EFAULT;
+	if (compression != dm_Compression_None &&
+		compression != dm_Compression_Lz4)
+		return -EINVAL;
 
 	mutex_lock(&self->m_lock);
-	if (self->m_enableCount)
+	if (self->m_enableCount) // notify reads it without m_lock
 	{
 		mutex_unlock(&self->m_lock);
 		return -EBUSY;
 	}
 
-	ioctlDesc_u = (const dm_IoctlDesc*) (table_u + 1);
-	result = Connection_p_setIoctlDescTableImpl(self, ioctlDesc_u, table.m_elementCount, false);
+	if (compression == self->m_compression)
+	{
+		mutex_unlock(&self->m_lock);
+		return 0;
+	}
+
+	if (compression == dm_Compression_None)
+	{
+		Compressor_destroy(&self->m_compressor);
+	}
+	else
+	{
+		if (self->m_captureMode != dm_CaptureMode_Queue ||
+			self->m_notifyFormat != dm_NotifyFormat_Default)
+		{
+			mutex_unlock(&self->m_lock);
+			return -EINVAL;
+		}
+
+		result = Compressor_create(&self->m_compressor);
+		if (result != 0)
+		{
+			mutex_unlock(&self->m_lock);
+			return result;
+		}
+	}
 
+	self->m_compression = compression;
 	mutex_unlock(&self->m_lock);
-	return result;
+	return 0;
 }
 
 int
-Connection_setIoctlDescTable_v0302xx(
+Connection_getPathMode(
 	Connection* self,
-	const dm_IoctlDesc_v0302xx __user* ioctlDesc_u,
-	size_t count
+	int __user* mode_u
 	)
 {
 	int result;
+	int mode;
 
 	mutex_lock(&self->m_lock);
-	if (self->m_enableCount)
+	mode = self->m_pathMode;
+	mutex_unlock(&self->m_lock);
+
+	result = copy_to_user(mode_u, &mode, sizeof(int));
+	return result == 0 ? 0 : -EFAULT;
+}
+
+int
+Connection_setPathMode(
+	Connection* self,
+	dm_PathMode mode
+	)
+{
+	if (mode != dm_PathMode_Immediate &&
+		mode != dm_PathMode_Deferred)
+		return -EINVAL;
+
+	mutex_lock(&self->m_lock);
+	if (self->m_enableCount) // notify reads it without m_lock
 	{
 		mutex_unlock(&self->m_lock);
 		return -EBUSY;
 	}
 
-	result = Connection_p_setIoctlDescTableImpl(self, (const dm_IoctlDesc*) ioctlDesc_u, count, true);
-
+	self->m_pathMode = mode;
 	mutex_unlock(&self->m_lock);
-	return result;
+	return 0;
 }
 
 int
-Connection_getPendingNotifySizeLimit(
+Connection_getIoctlArgMode(
 	Connection* self,
-	uint32_t __user* limit_u
+	int __user* mode_u
 	)
 {
 	int result;
-	size_t limit;
+	int mode;
 
 	mutex_lock(&self->m_lock);
-	limit = self->m_pendingNotifySizeLimit;
+	mode = self->m_ioctlArgMode;
 	mutex_unlock(&self->m_lock);
 
-	result = copy_to_user(limit_u, &limit, sizeof(uint32_t));
+	result = copy_to_user(mode_u, &mode, sizeof(int));
 	return result == 0 ? 0 : -EFAULT;
 }
 
-void
-Connection_setPendingNotifySizeLimit(
+int
+Connection_setIoctlArgMode(
 	Connection* self,
-	uint32_t limit
+	dm_IoctlArgMode mode
 	)
 {
+	if (mode != dm_IoctlArgMode_Table &&
+		mode != dm_IoctlArgMode_Auto)
+		return -EINVAL;
+
 	mutex_lock(&self->m_lock);
-	self->m_pendingNotifySizeLimit = limit;
+	if (self->m_enableCount) // notify reads it without m_lock
+	{
+		mutex_unlock(&self->m_lock);
+		return -EBUSY;
+	}
+
+	self->m_ioctlArgMode = mode;
 	mutex_unlock(&self->m_lock);
+	return 0;
 }
 
-bool
-Connection_checkFile(
+int
+Connection_getFilePath(
 	Connection* self,
-	FileNameFilterReq filterReq,
-	struct file* filp,
-	const char* fileName
+	dm_FilePath __user* filePath_u
 	)
 {
-	bool result;
+	int result;
+	uint64_t fileId;
+	struct file* filp;
+	struct path path;
+	const char* pathString;
+	bool isOpen;
 
-	mutex_lock(&self->m_lock);
-	if (self->m_enableCount <= 0)
-	{
-		mutex_unlock(&self->m_lock);
-		return false;
-	}
+	result = copy_from_user(&fileId, &filePath_u->m_fileId, sizeof(fileId));
+	if (result != 0)
+		return -EFAULT;
 
-	if (!self->m_fileNameFilter)
-	{
-		mutex_unlock(&self->m_lock);
-		return self->m_inode == filp->f_inode;
-	}
+	filp = (struct file*)(uintptr_t)fileId;
 
-	result = FileNameFilter_checkFile(self->m_fileNameFilter, filterReq, filp, fileName);
+	mutex_lock(&self->m_lock);
+	isOpen = self->m_hook && Hook_getConnectionFilePath(self->m_hook, self, filp, &path);
 	mutex_unlock(&self->m_lock);
+
+	if (!isOpen)
+		return -ENOENT;
+
+	pathString = createPathString(&path);
+	path_put(&path);
+
+	if (IS_ERR(pathString))
+		return PTR_ERR(pathString);
+
+	result = copyStringToUser(&filePath_u->m_path, pathString);
+	kfree(pathString);
 	return result;
 }
 
 int
-Connection_getIncomingDataSize(
+Connection_getRingParams(
 	Connection* self,
-	int __user* size_u
+	dm_RingParams __user* params_u
 	)
 {
 	int result;
-	size_t size;
+	dm_RingParams params;
+	NotifyRingSet* ringSet;
 
 	mutex_lock(&self->m_lock);
-	size = self->m_pendingNotifySize;
+	ringSet = rcu_dereference_protected(self->m_ringSet, lockdep_is_held(&self->m_lock));
+	params.m_ringSize = ringSet ? ringSet->m_ringSize : Connection_p_getRingSize(self);
+	params.m_flags = self->m_ringFlags;
 	mutex_unlock(&self->m_lock);
 
-	result = copy_to_user(size_u, &size, sizeof(int));
+	params.m_ringCount = nr_cpu_ids;
+	params.m_ringStride = PAGE_SIZE + params.m_ringSize;
+
+	result = copy_to_user(params_u, &params, sizeof(dm_RingParams));
 	return result == 0 ? 0 : -EFAULT;
 }
 
-ssize_t
-Connection_read(
+int
+Connection_setRingParams(
 	Connection* self,
-	void __user* buffer_u,
-	size_t size
+	const dm_RingParams __user* params_u
 	)
 {
+	int result;
+	dm_RingParams params;
+	NotifyRingSet* ringSet = NULL;
+	NotifyRingSet* prevRingSet = NULL;
+	size_t prevRingSize;
+	uint prevRingFlags;
+
+	result = copy_from_user(&params, params_u, sizeof(dm_RingParams));
+	if (result != 0)
+		return -EFAULT;
+
+	if (params.m_ringSize &&
+		(!is_power_of_2(params.m_ringSize) ||
+		params.m_ringSize < NotifyRingConst_MinSize ||
+		params.m_ringSize > NotifyRingConst_MaxSize) ||
+		(params.m_flags & ~dm_RingFlag_HugePages))
+		return -EINVAL;
+
 	mutex_lock(&self->m_lock);
+	if (self->m_enableCount)
+	{
+		mutex_unlock(&self->m_lock);
+		return -EBUSY;
+	}
 
-	if (list_empty(&self->m_pendingNotifyList))
-		return Connection_p_addPendingRead_l(self, buffer_u, size);
+	prevRingSize = self->m_ringSize;
+	prevRingFlags = self->m_ringFlags;
+	self->m_ringSize = params.m_ringSize;
+	self->m_ringFlags = params.m_flags;
 
-	ASSERT(list_empty(&self->m_pendingReadList));
+	if (self->m_captureMode == dm_CaptureMode_PerCpuRing) // re-create rings right away
+	{
+		ringSet = NotifyRingSet_create(Connection_p_getRingSize(self), self->m_ringFlags);
+		result = ringSet ? Connection_p_replaceRingSet(self, ringSet, &prevRingSet) : -ENOMEM;
+		if (result != 0)
+		{
+			self->m_ringSize = prevRingSize;
+			self->m_ringFlags = prevRingFlags;
+			mutex_unlock(&self->m_lock);
+
+			if (ringSet)
+				NotifyRingSet_release(ringSet);
+
+			return result;
+		}
+	}
+
+	mutex_unlock(&self->m_lock);
+
+	if (prevRingSet)
+	{
+		synchronize_sched();
+		NotifyRingSet_release(prevRingSet);
+	}
 
-	return self->m_readMode == dm_ReadMode_Message ?
-		Connection_p_readMessage_l(self, buffer_u, size) :
-		Connection_p_readStream_l(self, buffer_u, size);
+	return 0;
 }
 
-void
+int
+Connection_mmap(
+	Connection* self,
+	struct vm_area_struct* vma
+	)
+{
+	int result;
+	NotifyRingSet* ringSet;
+
+	// mmap_lock is held here, and m_lock is held while copying to user mode
+	// (which may fault and take mmap_lock) -- so we must not touch m_lock
+
+	spin_lock(&self->m_ringLock);
+	ringSet = rcu_dereference_protected(self->m_ringSet, lockdep_is_held(&self->m_ringLock));
+	if (ringSet)
+		NotifyRingSet_addRef(ringSet);
+
+	spin_unlock(&self->m_ringLock);
+
+	if (!ringSet) // not in dm_CaptureMode_PerCpuRing
+		return -EINVAL;
+
+	result = NotifyRingSet_mmap(ringSet, vma);
+	if (result != 0)
+		NotifyRingSet_release(ringSet);
+
+	return result;
+}
+
+int
+Connection_setReadBuffer(
+	Connection* self,
+	const dm_ReadBuffer __user* buffer_u
+	)
+{
+	int result;
+	dm_ReadBuffer params;
+	PinnedBuffer* buffer = NULL;
+	PinnedBuffer* prevBuffer;
+
+	result = copy_from_user(&params, buffer_u, sizeof(dm_ReadBuffer));
+	if (result != 0)
+		return -EFAULT;
+
+	if (params.m_size)
+	{
+		if (params.m_size < sizeof(dm_NotifyHdr) ||
+			params.m_size > dm_ReadBufferSizeLimit ||
+			params.m_address != (ulong)params.m_address)
+			return -EINVAL;
+
+		// pin outside of m_lock -- it takes mmap_lock
+
+		result = PinnedBuffer_create(&buffer, (ulong)params.m_address, (size_t)params.m_size);
+		if (result != 0)
+			return result;
+	}
+
+	// reads in progress hold their own references, so the previous buffer
+	// can be replaced at any time
+
+	mutex_lock(&self->m_lock);
+	prevBuffer = self->m_readBuffer;
+	self->m_readBuffer = buffer;
+	mutex_unlock(&self->m_lock);
+
+	if (prevBuffer)
+		PinnedBuffer_release(prevBuffer);
+
+	return 0;
+}
+
+int
+Connection_getSnapLength(
+	Connection* self,
+	dm_SnapLength __user* snapLength_u
+	)
+{
+	int result;
+	dm_SnapLength snapLength;
+
+	mutex_lock(&self->m_lock);
+	snapLength.m_headSize = self->m_snapHeadSize;
+	snapLength.m_tailSize = self->m_snapTailSize;
+	mutex_unlock(&self->m_lock);
+
+	result = copy_to_user(snapLength_u, &snapLength, sizeof(dm_SnapLength));
+	return result == 0 ? 0 : -EFAULT;
+}
+
+int
+Connection_setSnapLength(
+	Connection* self,
+	const dm_SnapLength __user* snapLength_u
+	)
+{
+	int result;
+	dm_SnapLength snapLength;
+
+	result = copy_from_user(&snapLength, snapLength_u, sizeof(dm_SnapLength));
+	if (result != 0)
+		return -EFAULT;
+
+	if ((uint64_t)snapLength.m_headSize + snapLength.m_tailSize > UINT_MAX)
+		return -EINVAL;
+
+	mutex_lock(&self->m_lock);
+	if (self->m_enableCount) // notify reads these without m_lock
+	{
+		mutex_unlock(&self->m_lock);
+		return -EBUSY;
+	}
+
+	self->m_snapHeadSize = snapLength.m_headSize;
+	self->m_snapTailSize = snapLength.m_tailSize;
+	mutex_unlock(&self->m_lock);
+	return 0;
+}
+
+int
+Connection_getNotifyCodeMask(
+	Connection* self,
+	uint32_t __user* mask_u
+	)
+{
+	int result;
+	uint32_t mask;
+
+	mutex_lock(&self->m_lock);
+	mask = self->m_notifyCodeMask;
+	mutex_unlock(&self->m_lock);
+
+	result = copy_to_user(mask_u, &mask, sizeof(uint32_t));
+	return result == 0 ? 0 : -EFAULT;
+}
+
+int
+Connection_setNotifyCodeMask(
+	Connection* self,
+	uint32_t mask
+	)
+{
+	if (mask & ~dm_NotifyCodeMask_All)
+		return -EINVAL;
+
+	mutex_lock(&self->m_lock);
+	if (self->m_enableCount) // hook counters reflect the mask of enabled connections
+	{
+		mutex_unlock(&self->m_lock);
+		return -EBUSY;
+	}
+
+	self->m_notifyCodeMask = mask;
+	mutex_unlock(&self->m_lock);
+	return 0;
+}
+
+int
+Connection_getSamplingParams(
+	Connection* self,
+	dm_SamplingParams __user* params_u
+	)
+{
+	int result;
+	dm_SamplingParams params;
+
+	mutex_lock(&self->m_lock);
+	params.m_mode = self->m_sampler.m_mode;
+	params.m_rate = self->m_sampler.m_rate;
+	mutex_unlock(&self->m_lock);
+
+	result = copy_to_user(params_u, &params, sizeof(dm_SamplingParams));
+	return result == 0 ? 0 : -EFAULT;
+}
+
+int
+Connection_setSamplingParams(
+	Connection* self,
+	const dm_SamplingParams __user* params_u
+	)
+{
+	int result;
+	dm_SamplingParams params;
+
+	result = copy_from_user(&params, params_u, sizeof(dm_SamplingParams));
+	if (result != 0)
+		return -EFAULT;
+
+	mutex_lock(&self->m_lock);
+	if (self->m_enableCount) // notify reads the mode and the rate without m_lock
+	{
+		mutex_unlock(&self->m_lock);
+		return -EBUSY;
+	}
+
+	result = Sampler_setParams(&self->m_sampler, &params);
+	mutex_unlock(&self->m_lock);
+	return result;
+}
+
+int
+Connection_getCounters(
+	Connection* self,
+	dm_List __user* list_u
+	)
+{
+	int result;
+	dm_List list;
+	dm_Counters* counterArray;
+	size_t bufferSize;
+	size_t count;
+	bool isComplete;
+
+	result = copy_from_user(&list, list_u, sizeof(dm_List));
+	if (result != 0)
+		return -EFAULT;
+
+	if (list.m_bufferSize < sizeof(dm_List))
+		return -EINVAL;
+
+	mutex_lock(&self->m_lock); // one snapshot at a time
+	count = READ_ONCE(self->m_counterMap.m_entryCount);
+	bufferSize = sizeof(dm_List) + count * sizeof(dm_Counters);
+
+	if (list.m_bufferSize < bufferSize)
+	{
+		mutex_unlock(&self->m_lock);
+		list.m_bufferSize = bufferSize;
+		list.m_elementCount = count;
+		list.m_dataSize = count * sizeof(dm_Counters);
+		result = copy_to_user(list_u, &list, sizeof(dm_List));
+		return result == 0 ? -ENOBUFS : -EFAULT;
+	}
+
+	counterArray = count ? vmalloc(count * sizeof(dm_Counters)) : NULL; // can't copy_to_user under m_lock
+	if (count && !counterArray)
+	{
+		mutex_unlock(&self->m_lock);
+		return -ENOMEM;
+	}
+
+	// entries may have been added since we looked; closed ones which didn't
+	// fit stay until the next snapshot
+
+	spin_lock(&self->m_counterLock);
+	isComplete = self->m_counterMap.m_entryCount <= count;
+	count = CounterMap_snapshot(&self->m_counterMap, counterArray, count);
+	if (isComplete)
+		CounterMap_removeClosed(&self->m_counterMap);
+
+	spin_unlock(&self->m_counterLock);
+	mutex_unlock(&self->m_lock);
+
+	list.m_elementCount = count;
+	list.m_dataSize = count * sizeof(dm_Counters);
+
+	result = copy_to_user(list_u, &list, sizeof(dm_List));
+
+	if (result == 0 && count)
+		result = copy_to_user(list_u + 1, counterArray, list.m_dataSize);
+
+	vfree(counterArray);
+	return result == 0 ? 0 : -EFAULT;
+}
+
+int
+Connection_getFileNameFilter(
+	Connection* self,
+	dm_String __user* filter_u
+	)
+{
+	int result;
+	FileNameFilter* filter;
+
+	mutex_lock(&self->m_lock);
+	if (self->m_enableCount)
+	{
+		mutex_unlock(&self->m_lock);
+		return -EBUSY;
+	}
+
+	filter = rcu_dereference_protected(self->m_fileNameFilter, lockdep_is_held(&self->m_lock));
+	result = filter ? copyStringToUser(filter_u, filter->m_fileNameWildcard) : 0;
+
+	mutex_unlock(&self->m_lock);
+	return result;
+}
+
+int
+Connection_setFileNameFilter(
+	Connection* self,
+	const dm_String __user* filter_u
+	)
+{
+	int result;
+	const char* wildcard;
+	FileNameFilter* filter = NULL;
+	FileNameFilter* prevFilter;
+
+	wildcard = copyStringFromUser(filter_u);
+	if (IS_ERR(wildcard))
+		return PTR_ERR(wildcard);
+
+	result = *wildcard ? FileNameFilter_create(&filter, wildcard, GFP_KERNEL) : 0;
+	kfree(wildcard);
+
+	if (result != 0)
+		return result;
+
+	mutex_lock(&self->m_lock);
+	if (self->m_enableCount)
+	{
+		mutex_unlock(&self->m_lock);
+
+		if (filter)
+			FileNameFilter_delete(filter);
+
+		return -EBUSY;
+	}
+
+	prevFilter = rcu_dereference_protected(self->m_fileNameFilter, lockdep_is_held(&self->m_lock));
+	rcu_assign_pointer(self->m_fileNameFilter, filter);
+	mutex_unlock(&self->m_lock);
+
+	if (prevFilter)
+	{
+		synchronize_rcu(); // wait for Connection_checkFile-s still using it
+		FileNameFilter_delete(prevFilter);
+	}
+
+	return 0;
+}
+
+int
+Connection_setPidFilter(
+	Connection* self,
+	const dm_PidFilter __user* filter_u
+	)
+{
+	int result;
+	dm_PidFilter params;
+	uint32_t* tgidArray;
+	PidFilter* filter = NULL;
+	PidFilter* prevFilter;
+
+	result = copy_from_user(&params, filter_u, sizeof(dm_PidFilter));
+	if (result != 0)
+		return -EFAULT;
+
+	if (params.m_count > dm_PidFilterCountLimit ||
+		(params.m_flags & ~(dm_PidFilterFlag_Exclude | dm_PidFilterFlag_FollowChildren)))
+		return -EINVAL;
+
+	if (params.m_count)
+	{
+		tgidArray = kmalloc(params.m_count * sizeof(uint32_t), GFP_KERNEL);
+		if (!tgidArray)
+			return -ENOMEM;
+
+		result = copy_from_user(tgidArray, filter_u + 1, params.m_count * sizeof(uint32_t));
+		if (result == 0)
+			result = PidFilter_create(&filter, params.m_flags, tgidArray, params.m_count);
+		else
+			result = -EFAULT;
+
+		kfree(tgidArray);
+
+		if (result != 0)
+			return result;
+	}
+
+	mutex_lock(&self->m_lock);
+	if (self->m_enableCount)
+	{
+		mutex_unlock(&self->m_lock);
+
+		if (filter)
+			PidFilter_delete(filter);
+
+		return -EBUSY;
+	}
+
+	prevFilter = rcu_dereference_protected(self->m_pidFilter, lockdep_is_held(&self->m_lock));
+	rcu_assign_pointer(self->m_pidFilter, filter);
+	mutex_unlock(&self->m_lock);
+
+	if (prevFilter)
+	{
+		synchronize_rcu(); // wait for Connection_checkProcess-es still using it
+		PidFilter_delete(prevFilter);
+	}
+
+	return 0;
+}
+
+int
+Connection_setBpfFilter(
+	Connection* self,
+	const dm_BpfProgram __user* program_u
+	)
+{
+	int result;
+	dm_BpfProgram program;
+	dm_BpfInsn* insnArray;
+	BpfFilter* filter = NULL;
+	BpfFilter* prevFilter;
+
+	result = copy_from_user(&program, program_u, sizeof(dm_BpfProgram));
+	if (result != 0)
+		return -EFAULT;
+
+	if (program.m_insnCount > dm_BpfInsnCountLimit)
+		return -EINVAL;
+
+	if (program.m_insnCount)
+	{
+		insnArray = kmalloc(program.m_insnCount * sizeof(dm_BpfInsn), GFP_KERNEL);
+		if (!insnArray)
+			return -ENOMEM;
+
+		result = copy_from_user(insnArray, program_u + 1, program.m_insnCount * sizeof(dm_BpfInsn));
+		if (result == 0)
+			result = BpfFilter_create(&filter, insnArray, program.m_insnCount);
+		else
+			result = -EFAULT;
+
+		kfree(insnArray);
+
+		if (result != 0)
+			return result;
+	}
+
+	mutex_lock(&self->m_lock);
+	if (self->m_enableCount)
+	{
+		mutex_unlock(&self->m_lock);
+
+		if (filter)
+			BpfFilter_delete(filter);
+
+		return -EBUSY;
+	}
+
+	prevFilter = rcu_dereference_protected(self->m_bpfFilter, lockdep_is_held(&self->m_lock));
+	rcu_assign_pointer(self->m_bpfFilter, filter);
+	mutex_unlock(&self->m_lock);
+
+	if (prevFilter)
+	{
+		synchronize_rcu(); // wait for Connection_p_runBpfFilter-s still using it
+		BpfFilter_delete(prevFilter);
+	}
+
+	return 0;
+}
+
+int
+Connection_getIoctlDescTable(
+	Connection* self,
+	dm_List __user* table_u
+	)
+{
+	int result;
+	dm_List table;
+	size_t bufferSize;
+
+	result = copy_from_user(&table, table_u, sizeof(dm_List));
+	if (result != 0)
+		return -EFAULT;
+
+	if (table.m_bufferSize < sizeof(dm_List))
+		return -EINVAL;
+
+	mutex_lock(&self->m_lock);
+	table.m_elementCount = (uint32_t)PtrMap_getCount(&self->m_ioctlDescMap);
+	table.m_dataSize = table.m_elementCount * sizeof(dm_IoctlDesc);
+
+	bufferSize = sizeof(dm_List) + table.m_dataSize;
+
+	if (table.m_bufferSize < bufferSize)
+	{
+		mutex_unlock(&self->m_lock);
+		table.m_bufferSize = bufferSize;
+		result = copy_to_user(table_u, &table, sizeof(dm_List));
+		return result == 0 ? -ENOBUFS : -EFAULT;
+	}
+
+	result = copy_to_user(table_u, &table, sizeof(dm_List));
+
+	if (result == 0)
+		result = copy_to_user(table_u + 1, self->m_ioctlDescTable, table.m_dataSize);
+
+	mutex_unlock(&self->m_lock);
+	return result == 0 ? 0 : -EFAULT;
+}
+
+int
+Connection_setIoctlDescTable(
+	Connection* self,
+	const dm_List __user* table_u
+	)
+{
+	int result;
+	dm_List table;
+	const dm_IoctlDesc* ioctlDesc_u;
+
+	result = copy_from_user(&table, table_u, sizeof(dm_List));
+	if (result != 0)
+		return -EFAULT;
+
+	mutex_lock(&self->m_lock);
+	if (self->m_enableCount)
+	{
+		mutex_unlock(&self->m_lock);
+		return -EBUSY;
+	}
+
+	ioctlDesc_u = (const dm_IoctlDesc*) (table_u + 1);
+	result = Connection_p_setIoctlDescTableImpl(self, ioctlDesc_u, table.m_elementCount, false);
+
+	mutex_unlock(&self->m_lock);
+	return result;
+}
+
+int
+Connection_setIoctlDescTable_v0302xx(
+	Connection* self,
+	const dm_IoctlDesc_v0302xx __user* ioctlDesc_u,
+	size_t count
+	)
+{
+	int result;
+
+	mutex_lock(&self->m_lock);
+	if (self->m_enableCount)
+	{
+		mutex_unlock(&self->m_lock);
+		return -EBUSY;
+	}
+
+	result = Connection_p_setIoctlDescTableImpl(self, (const dm_IoctlDesc*) ioctlDesc_u, count, true);
+
+	mutex_unlock(&self->m_lock);
+	return result;
+}
+
+int
+Connection_getPendingNotifySizeLimit(
+	Connection* self,
+	uint32_t __user* limit_u
+	)
+{
+	int result;
+	size_t limit;
+
+	mutex_lock(&self->m_lock);
+	limit = self->m_pendingNotifySizeLimit;
+	mutex_unlock(&self->m_lock);
+
+	result = copy_to_user(limit_u, &limit, sizeof(uint32_t));
+	return result == 0 ? 0 : -EFAULT;
+}
+
+void
+Connection_setPendingNotifySizeLimit(
+	Connection* self,
+	uint32_t limit
+	)
+{
+	mutex_lock(&self->m_lock);
+	self->m_pendingNotifySizeLimit = limit;
+	mutex_unlock(&self->m_lock);
+}
+
+bool
+Connection_checkOpenFile(
+	Connection* self,
+	struct file* filp,
+	const char* fileName
+	)
+{
+	bool result;
+	FileNameFilter* filter;
+
+	// no m_lock here -- it may be held by a reader copying to user mode
+
+	if (self->m_enableCount <= 0)
+		return false;
+
+	rcu_read_lock();
+	filter = rcu_dereference(self->m_fileNameFilter);
+	result = filter ?
+		FileNameFilter_matchFileName(filter, fileName) :
+		self->m_inode == filp->f_inode;
+
+	rcu_read_unlock();
+	return result;
+}
+
+bool
+Connection_checkProcess(Connection* self)
+{
+	bool result;
+	PidFilter* filter;
+
+	if (!rcu_access_pointer(self->m_pidFilter))
+		return true;
+
+	rcu_read_lock();
+	filter = rcu_dereference(self->m_pidFilter);
+	result = !filter || PidFilter_checkProcess(filter, current);
+	rcu_read_unlock();
+	return result;
+}
+
+bool
+Connection_checkSample(
+	Connection* self,
+	uint16_t code,
+	uint64_t timestamp,
+	uint32_t* sampleWeight
+	)
+{
+	if (self->m_sampler.m_mode == dm_SamplingMode_None ||
+		code == dm_NotifyCode_Open ||
+		code == dm_NotifyCode_Close || // consumers track open files, can't skip these
+		READ_ONCE(self->m_captureMode) == dm_CaptureMode_Counters) // counters see everything anyway
+	{
+		*sampleWeight = 0;
+		return true;
+	}
+
+	*sampleWeight = Sampler_sample(&self->m_sampler, timestamp);
+	return *sampleWeight != 0;
+}
+
+int
+Connection_getNextNotifySize(
+	Connection* self,
+	uint32_t __user* size_u
+	)
+{
+	int result;
+	uint32_t size = 0;
+	PendingNotify* notify;
+	const dm_NotifyHdr* notifyHdr;
+	NotifyRing* ring;
+	size_t notifySize;
+
+	mutex_lock(&self->m_lock);
+
+	if (self->m_captureMode == dm_CaptureMode_PerCpuRing)
+	{
+		if (self->m_readRing) // a partially read notification (dm_ReadMode_Stream)
+		{
+			notifyHdr = NotifyRing_peek(self->m_readRing, &notifySize);
+			if (notifyHdr && self->m_readRingPos < notifySize)
+				size = (uint32_t)(notifySize - self->m_readRingPos);
+		}
+		else
+		{
+			notifyHdr = Connection_p_findOldestRing(self, &ring, &notifySize);
+			if (notifyHdr)
+				size = (uint32_t)notifySize;
+		}
+	}
+	else if (!list_empty(&self->m_pendingNotifyList))
+	{
+		notify = container_of(self->m_pendingNotifyList.next, PendingNotify, m_link);
+		size = (uint32_t)(notify->m_size - notify->m_streamPos);
+	}
+
+	mutex_unlock(&self->m_lock);
+
+	result = copy_to_user(size_u, &size, sizeof(uint32_t));
+	return result == 0 ? 0 : -EFAULT;
+}
+
+int
+Connection_getIncomingDataSize(
+	Connection* self,
+	int __user* size_u
+	)
+{
+	int result;
+	size_t size;
+
+	NotifyRingSet* ringSet;
+	NotifyRing** ringArray;
+	size_t i;
+
+	mutex_lock(&self->m_lock);
+	size = self->m_pendingNotifySize;
+
+	ringSet = rcu_dereference_protected(self->m_ringSet, lockdep_is_held(&self->m_lock));
+	if (ringSet)
+	{
+		ringArray = NotifyRingSet_getRingArray(ringSet);
+		for (i = 0; i < ringSet->m_ringCount; i++)
+			size += NotifyRing_getDataSize(ringArray[i]);
+	}
+
+	size = size > self->m_readRingPos ? size - self->m_readRingPos : 0;
+	mutex_unlock(&self->m_lock);
+
+	result = copy_to_user(size_u, &size, sizeof(int));
+	return result == 0 ? 0 : -EFAULT;
+}
+
+bool
+Connection_hasIncomingData(Connection* self)
+{
+	bool result;
+
+	mutex_lock(&self->m_lock);
+	result = self->m_pendingNotifyCount || Connection_p_hasRingData(self);
+	mutex_unlock(&self->m_lock);
+
+	return result;
+}
+
+ssize_t
+Connection_read(
+	Connection* self,
+	void __user* buffer_u,
+	size_t size
+	)
+{
+	mutex_lock(&self->m_lock);
+
+	if (self->m_captureMode == dm_CaptureMode_PerCpuRing)
+		return Connection_p_readRing_l(self, buffer_u, size);
+
+	if (self->m_captureMode == dm_CaptureMode_Counters) // there is nothing to read, use DM_IOCTL_GET_COUNTERS
+	{
+		mutex_unlock(&self->m_lock);
+		return -EINVAL;
+	}
+
+	if (list_empty(&self->m_pendingNotifyList))
+		return Connection_p_addPendingRead_l(self, buffer_u, size);
+
+	ASSERT(list_empty(&self->m_pendingReadList));
+
+	switch (self->m_readMode)
+	{
+	case dm_ReadMode_Message:
+		return Connection_p_readMessage_l(self, buffer_u, size);
+
+	case dm_ReadMode_Batch:
+		return Connection_p_readBatch_l(self, buffer_u, size);
+
+	default:
+		return Connection_p_readStream_l(self, buffer_u, size);
+	}
+}
+
+void
 Connection_notify(
 	Connection* self,
 	struct file* filp,
@@ -451,12 +1469,62 @@ Connection_notify(
 	uint32_t pid,
 	uint32_t tid,
 	uint64_t timestamp,
+	uint32_t sampleWeight,
 	MemBlock* paramBlockArray,
 	size_t paramBlockCount
 	)
 {
 	size_t paramSize;
 	bool hasArgData;
+	MemBlock blockArray[4]; // [0] is for dm_SampleInfo
+	MemBlock openBlockArray[2];
+	struct iov_iter iterArray[2];
+	dm_OpenNotifyParams openParams;
+	dm_SampleInfo sampleInfo;
+	dm_CompressedHdr compressedHdr;
+	uint16_t flags = 0;
+	bool isAccepted;
+
+	if (filp == READ_ONCE(self->m_originalFilp)) // don't dispatch close notification for the filp used to create this connection
+	{
+		if (code == dm_NotifyCode_Close)
+			WRITE_ONCE(self->m_originalFilp, NULL);
+		else
+			printk(KERN_WARNING "tdevmon: unexpected notification on the original filp; code: %d\n", code); // flush? anyway, not a big deal
+
+		return;
+	}
+
+	if (code == dm_NotifyCode_Open) // the hook passes [params, file name, file key]
+	{
+		ASSERT(paramBlockCount == 3);
+
+		if (self->m_pathMode != dm_PathMode_Deferred)
+		{
+			memcpy(openBlockArray, paramBlockArray, 2 * sizeof(MemBlock));
+		}
+		else
+		{
+			openParams = *(const dm_OpenNotifyParams*)paramBlockArray[0].m_p;
+			openParams.m_fileNameLength = 0;
+			openBlockArray[0].m_p = &openParams;
+			openBlockArray[0].m_size = sizeof(openParams);
+			openBlockArray[0].m_flags = 0;
+			openBlockArray[1] = paramBlockArray[2];
+			flags = dm_NotifyFlag_DeferredPath;
+		}
+
+		paramBlockArray = openBlockArray; // the array is shared by all connections, don't touch it
+		paramBlockCount = 2;
+	}
+
+	if (READ_ONCE(self->m_captureMode) == dm_CaptureMode_Counters) // nothing to copy or queue
+	{
+		spin_lock(&self->m_counterLock);
+		CounterMap_update(&self->m_counterMap, filp, pid, code, result, timestamp, paramBlockArray);
+		spin_unlock(&self->m_counterLock);
+		return;
+	}
 
 	if (code == dm_NotifyCode_UnlockedIoctl || code == dm_NotifyCode_CompatIoctl)
 	{
@@ -465,26 +1533,108 @@ Connection_notify(
 			paramBlockCount++;
 	}
 
+	paramBlockCount = Connection_p_prepareParamBlocks(
+		self,
+		code,
+		blockArray + 1,
+		iterArray,
+		paramBlockArray,
+		paramBlockCount
+		);
+
+	paramBlockArray = blockArray + 1;
 	paramSize = getScatterGatherSize(paramBlockArray, paramBlockCount);
 
-	mutex_lock(&self->m_lock);
-	if (filp == self->m_originalFilp) // don't dispatch close notification for the filp used to create this connection
+	if (rcu_access_pointer(self->m_bpfFilter))
 	{
-		if (code == dm_NotifyCode_Close)
-			self->m_originalFilp = NULL;
-		else
-			printk(KERN_WARNING "tdevmon: unexpected notification on the original filp; code: %d\n", code); // flush? anyway, not a big deal
+		isAccepted = Connection_p_runBpfFilter(
+			self,
+			code,
+			result,
+			pid,
+			tid,
+			timestamp,
+			paramBlockArray,
+			&paramBlockCount,
+			&paramSize
+			);
+
+		if (!isAccepted)
+			return;
+	}
+
+	if (self->m_notifyFormat == dm_NotifyFormat_Compact) // can't change while enabled
+	{
+		mutex_lock(&self->m_lock);
+
+		Connection_p_notifyCompact_l(
+			self,
+			code,
+			flags,
+			result,
+			pid,
+			tid,
+			timestamp,
+			sampleWeight,
+			paramBlockArray,
+			paramBlockCount,
+			paramSize
+			);
+
+		return;
+	}
+
+	if (sampleWeight) // the filter above sees the params as they are, without dm_SampleInfo
+	{
+		sampleInfo.m_weight = sampleWeight;
+		sampleInfo._m_padding = 0;
+		blockArray[0].m_p = &sampleInfo;
+		blockArray[0].m_size = sizeof(dm_SampleInfo);
+		blockArray[0].m_flags = 0;
+		paramBlockArray = blockArray;
+		paramBlockCount++;
+		paramSize += sizeof(dm_SampleInfo);
+		flags |= dm_NotifyFlag_Sampled;
+	}
+
+	if (READ_ONCE(self->m_captureMode) == dm_CaptureMode_PerCpuRing)
+	{
+		Connection_p_notifyRing(
+			self,
+			code,
+			flags,
+			result,
+			pid,
+			tid,
+			timestamp,
+			paramBlockArray,
+			paramBlockCount,
+			paramSize
+			);
 
-		mutex_unlock(&self->m_lock);
 		return;
 	}
 
+	mutex_lock(&self->m_lock);
+
+	if (self->m_compression != dm_Compression_None) // the compressor is guarded by m_lock
+		paramBlockCount = Connection_p_compressPayload_l(
+			self,
+			paramBlockArray,
+			paramBlockCount,
+			sampleWeight ? 2 : 1, // skip dm_SampleInfo and params
+			&compressedHdr,
+			&paramSize,
+			&flags
+			);
+
 	if (list_empty(&self->m_pendingReadList))
 	{
 		Connection_p_addPendingNotification_l(
 			self,
 			true,
 			code,
+			flags,
 			result,
 			pid,
 			tid,
@@ -499,10 +1649,11 @@ Connection_notify(
 
 	ASSERT(list_empty(&self->m_pendingNotifyList));
 
-	if (self->m_readMode == dm_ReadMode_Message)
+	if (self->m_readMode != dm_ReadMode_Stream) // a blocked batch read completes with a single notification
 		Connection_p_notifyMessage_l(
 			self,
 			code,
+			flags,
 			result,
 			pid,
 			tid,
@@ -515,6 +1666,7 @@ Connection_notify(
 		Connection_p_notifyStream_l(
 			self,
 			code,
+			flags,
 			result,
 			pid,
 			tid,
@@ -525,166 +1677,442 @@ Connection_notify(
 			);
 }
 
-// . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . .
+// . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . .
+
+ssize_t
+Connection_p_addPendingRead_l(
+	Connection* self,
+	void __user* buffer_u,
+	size_t size
+	)
+{
+	int result;
+	PendingRead read;
+
+	if (self->m_fileFlags & O_NONBLOCK)
+	{
+		mutex_unlock(&self->m_lock);
+		return -EWOULDBLOCK;
+	}
+
+	if (self->m_readBuffer && PinnedBuffer_contains(self->m_readBuffer, buffer_u, size))
+	{
+		// notifications will be written straight into the registered buffer
+
+		read.m_pinnedBuffer = self->m_readBuffer;
+		read.m_buffer = PinnedBuffer_getKernelPtr(read.m_pinnedBuffer, buffer_u);
+		PinnedBuffer_addRef(read.m_pinnedBuffer);
+	}
+	else
+	{
+		read.m_pinnedBuffer = NULL;
+		read.m_buffer = kmalloc(size, GFP_KERNEL);
+		if (!read.m_buffer)
+		{
+			mutex_unlock(&self->m_lock);
+			return -ENOMEM;
+		}
+	}
+
+	read.m_size = size;
+	read.m_isQueued = true;
+	read.m_isCompleted = false;
+
+	list_add_tail(&read.m_link, &self->m_pendingReadList);
+	self->m_pendingReadCount++;
+	mutex_unlock(&self->m_lock);
+
+	result = wait_event_interruptible(self->m_notificationWaitQueue, smp_load_acquire(&read.m_isCompleted));
+	if (result != 0)
+	{
+		mutex_lock(&self->m_lock);
+		if (read.m_isQueued)
+		{
+			list_del(&read.m_link);
+			self->m_pendingReadCount--;
+			mutex_unlock(&self->m_lock);
+			Connection_p_freePendingRead(&read);
+			return result;
+		}
+
+		mutex_unlock(&self->m_lock);
+
+		// a notifier has already taken this read and is about to complete it;
+		// wait (it won't take long) so the notification doesn't get lost
+
+		wait_event(self->m_notificationWaitQueue, smp_load_acquire(&read.m_isCompleted));
+	}
+
+	if (read.m_result > 0)
+	{
+		if (read.m_pinnedBuffer)
+		{
+			flush_kernel_vmap_range(read.m_buffer, read.m_result); // for aliasing caches
+		}
+		else
+		{
+			result = copy_to_user(buffer_u, read.m_buffer, read.m_result);
+			if (result != 0)
+			{
+				Connection_p_freePendingRead(&read);
+				return -EFAULT;
+			}
+		}
+	}
+
+	Connection_p_freePendingRead(&read);
+	return read.m_result;
+}
+
+ssize_t
+Connection_p_readMessage_l(
+	Connection* self,
+	void __user* buffer_u,
+	size_t size
+	)
+{
+	int result;
+	PendingNotify* notify;
+	dm_NotifyHdr notifyHdr;
+	size_t notifySize;
+
+	ASSERT(size >= sizeof(dm_NotifyHdr)); // should have been checked
+	ASSERT(!list_empty(&self->m_pendingNotifyList));
+
+	notify = container_of(self->m_pendingNotifyList.next, PendingNotify, m_link);
+	ASSERT(notify->m_hasNotifyHdr);
+
+	if (size < notify->m_size)
+	{
+		notifyHdr = *(const dm_NotifyHdr*) (notify + 1);
+		mutex_unlock(&self->m_lock);
+
+		notifyHdr.m_flags |= dm_NotifyFlag_InsufficientBuffer;
+
+		result = copy_to_user(buffer_u, &notifyHdr, sizeof(dm_NotifyHdr));
+		return result == 0 ? sizeof(dm_NotifyHdr) : -EFAULT;
+	}
+
+	notifySize = notify->m_size;
+	result = copy_to_user(buffer_u, notify + 1, notifySize);
+	if (result != 0)
+	{
+		mutex_unlock(&self->m_lock);
+		return -EFAULT;
+	}
+
+	list_del(&notify->m_link);
+	self->m_pendingNotifySize -= notifySize;
+	self->m_pendingNotifyCount--;
+	mutex_unlock(&self->m_lock);
+
+	MemCache_freeNotify(notify, notify->m_sizeClass);
+	return notifySize;
+}
+
+ssize_t
+Connection_p_readStream_l(
+	Connection* self,
+	void __user* buffer_u,
+	size_t size
+	)
+{
+	int result;
+	PendingNotify* notify;
+	char* p;
+	size_t copySize;
+	size_t totalSize;
+
+	ASSERT(!list_empty(&self->m_pendingNotifyList));
+
+	totalSize = 0;
+
+	do
+	{
+		notify = container_of(self->m_pendingNotifyList.next, PendingNotify, m_link);
+		ASSERT(notify->m_streamPos < notify->m_size);
+
+		p = (char*)(notify + 1) + notify->m_streamPos;
+		copySize = notify->m_size - notify->m_streamPos;
+
+		if (size < copySize)
+		{
+			result = copy_to_user(buffer_u, p, size);
+			if (result != 0)
+			{
+				mutex_unlock(&self->m_lock);
+				return -EFAULT;
+			}
+
+			notify->m_streamPos += size;
+			totalSize += size;
+			break;
+		}
+
+		result = copy_to_user(buffer_u, p, copySize);
+		if (result != 0)
+		{
+			mutex_unlock(&self->m_lock);
+			return -EFAULT;
+		}
+
+		list_del(&notify->m_link);
+		self->m_pendingNotifySize -= notify->m_size;
+		self->m_pendingNotifyCount--;
+		MemCache_freeNotify(notify, notify->m_sizeClass);
+
+		buffer_u = (char*)buffer_u + copySize;
+		size -= copySize;
+		totalSize += copySize;
+	}
+	while (!list_empty(&self->m_pendingNotifyList));
+
+	mutex_unlock(&self->m_lock);
+	return totalSize;
+}
+
+// never splits notifications; if even the first one doesn't fit, falls back
+// to dm_ReadMode_Message behavior (a header with dm_NotifyFlag_InsufficientBuffer)
+
+ssize_t
+Connection_p_readBatch_l(
+	Connection* self,
+	void __user* buffer_u,
+	size_t size
+	)
+{
+	int result;
+	PendingNotify* notify;
+	size_t totalSize;
+
+	ASSERT(!list_empty(&self->m_pendingNotifyList));
+
+	notify = container_of(self->m_pendingNotifyList.next, PendingNotify, m_link);
+	if (size < notify->m_size)
+		return Connection_p_readMessage_l(self, buffer_u, size);
+
+	totalSize = 0;
+
+	do
+	{
+		notify = container_of(self->m_pendingNotifyList.next, PendingNotify, m_link);
+		ASSERT(notify->m_hasNotifyHdr);
+
+		if (size < notify->m_size)
+			break;
+
+		result = copy_to_user(buffer_u, notify + 1, notify->m_size);
+		if (result != 0)
+		{
+			mutex_unlock(&self->m_lock);
+			return totalSize ? totalSize : -EFAULT; // what's been copied so far is already dequeued
+		}
+
+		buffer_u = (char*)buffer_u + notify->m_size;
+		size -= notify->m_size;
+		totalSize += notify->m_size;
+
+		list_del(&notify->m_link);
+		self->m_pendingNotifySize -= notify->m_size;
+		self->m_pendingNotifyCount--;
+		MemCache_freeNotify(notify, notify->m_sizeClass);
+	}
+	while (!list_empty(&self->m_pendingNotifyList));
+
+	mutex_unlock(&self->m_lock);
+	return totalSize;
+}
 
 ssize_t
-Connection_p_addPendingRead_l(
+Connection_p_readRing_l(
 	Connection* self,
 	void __user* buffer_u,
 	size_t size
 	)
 {
-	int result;
-	PendingRead read;
+	ssize_t result;
+	size_t readCancelCount;
 
-	if (self->m_fileFlags & O_NONBLOCK)
+	for (;;)
 	{
-		mutex_unlock(&self->m_lock);
-		return -EWOULDBLOCK;
-	}
+		switch (self->m_readMode)
+		{
+		case dm_ReadMode_Message:
+			result = Connection_p_readRingMessage(self, buffer_u, size);
+			break;
 
-	// TODO: use memory locking instead of double-buffering (user buffers may be HUGE!)
+		case dm_ReadMode_Batch:
+			result = Connection_p_readRingBatch(self, buffer_u, size);
+			break;
 
-	read.m_buffer = kmalloc(size, GFP_KERNEL);
-	if (!read.m_buffer)
-	{
-		mutex_unlock(&self->m_lock);
-		return -ENOMEM;
-	}
+		default:
+			result = Connection_p_readRingStream(self, buffer_u, size);
+		}
 
-	init_waitqueue_head(&read.m_waitQueue);
-	read.m_size = size;
-	read.m_isCompleted = false;
+		if (result != 0)
+			break;
 
-	list_add_tail(&read.m_link, &self->m_pendingReadList);
-	self->m_pendingReadCount++;
-	mutex_unlock(&self->m_lock);
+		if (self->m_fileFlags & O_NONBLOCK)
+		{
+			result = -EWOULDBLOCK;
+			break;
+		}
 
-	result = wait_event_interruptible(read.m_waitQueue, read.m_isCompleted);
-	if (result != 0)
-	{
-		kfree(read.m_buffer);
-		return result;
-	}
+		readCancelCount = self->m_readCancelCount;
+		mutex_unlock(&self->m_lock);
+
+		result = wait_event_interruptible(
+			self->m_notificationWaitQueue,
+			Connection_p_hasRingData(self) || READ_ONCE(self->m_readCancelCount) != readCancelCount
+			);
 
-	if (read.m_result > 0)
-	{
-		result = copy_to_user(buffer_u, read.m_buffer, read.m_result);
 		if (result != 0)
+			return result;
+
+		mutex_lock(&self->m_lock);
+
+		if (self->m_readCancelCount != readCancelCount)
 		{
-			kfree(read.m_buffer);
-			return -EFAULT;
+			result = -ECANCELED;
+			break;
 		}
 	}
 
-	kfree(read.m_buffer);
-	return read.m_result;
+	mutex_unlock(&self->m_lock);
+	return result;
 }
 
 ssize_t
-Connection_p_readMessage_l(
+Connection_p_readRingMessage(
 	Connection* self,
 	void __user* buffer_u,
 	size_t size
 	)
 {
 	int result;
-	PendingNotify* notify;
-	dm_NotifyHdr notifyHdr;
+	const dm_NotifyHdr* notifyHdr;
+	dm_NotifyHdr insufficientBufferHdr;
+	NotifyRing* ring;
 	size_t notifySize;
 
 	ASSERT(size >= sizeof(dm_NotifyHdr)); // should have been checked
-	ASSERT(!list_empty(&self->m_pendingNotifyList));
 
-	notify = container_of(self->m_pendingNotifyList.next, PendingNotify, m_link);
-	ASSERT(notify->m_hasNotifyHdr);
+	notifyHdr = Connection_p_findOldestRing(self, &ring, &notifySize);
+	if (!notifyHdr)
+		return 0;
 
-	if (size < notify->m_size)
+	if (size < notifySize)
 	{
-		notifyHdr = *(const dm_NotifyHdr*) (notify + 1);
-		mutex_unlock(&self->m_lock);
-
-		notifyHdr.m_flags |= dm_NotifyFlag_InsufficientBuffer;
+		insufficientBufferHdr = *notifyHdr;
+		insufficientBufferHdr.m_flags |= dm_NotifyFlag_InsufficientBuffer;
 
-		result = copy_to_user(buffer_u, &notifyHdr, sizeof(dm_NotifyHdr));
+		result = copy_to_user(buffer_u, &insufficientBufferHdr, sizeof(dm_NotifyHdr));
 		return result == 0 ? sizeof(dm_NotifyHdr) : -EFAULT;
 	}
 
-	notifySize = notify->m_size;
-	result = copy_to_user(buffer_u, notify + 1, notifySize);
+	result = copy_to_user(buffer_u, notifyHdr, notifySize);
 	if (result != 0)
-	{
-		mutex_unlock(&self->m_lock);
 		return -EFAULT;
-	}
-
-	list_del(&notify->m_link);
-	self->m_pendingNotifySize -= notifySize;
-	self->m_pendingNotifyCount--;
-	mutex_unlock(&self->m_lock);
 
-	kfree(notify);
+	NotifyRing_pop(ring, notifySize);
 	return notifySize;
 }
 
 ssize_t
-Connection_p_readStream_l(
+Connection_p_readRingStream(
 	Connection* self,
 	void __user* buffer_u,
 	size_t size
 	)
 {
 	int result;
-	PendingNotify* notify;
-	char* p;
+	const dm_NotifyHdr* notifyHdr;
+	size_t notifySize;
 	size_t copySize;
-	size_t totalSize;
-
-	ASSERT(!list_empty(&self->m_pendingNotifyList));
-
-	totalSize = 0;
+	size_t totalSize = 0;
 
-	do
+	while (size)
 	{
-		notify = container_of(self->m_pendingNotifyList.next, PendingNotify, m_link);
-		ASSERT(notify->m_streamPos < notify->m_size);
+		if (self->m_readRing) // finish the partially read notification first
+		{
+			notifyHdr = NotifyRing_peek(self->m_readRing, &notifySize);
+			if (!notifyHdr || self->m_readRingPos >= notifySize) // ring was tampered with via mmap
+			{
+				self->m_readRing = NULL;
+				self->m_readRingPos = 0;
+				continue;
+			}
+		}
+		else
+		{
+			notifyHdr = Connection_p_findOldestRing(self, &self->m_readRing, &notifySize);
+			if (!notifyHdr)
+				break;
 
-		p = (char*)(notify + 1) + notify->m_streamPos;
-		copySize = notify->m_size - notify->m_streamPos;
+			self->m_readRingPos = 0;
+		}
+
+		copySize = notifySize - self->m_readRingPos;
 
 		if (size < copySize)
 		{
-			result = copy_to_user(buffer_u, p, size);
+			result = copy_to_user(buffer_u, (char*)notifyHdr + self->m_readRingPos, size);
 			if (result != 0)
-			{
-				mutex_unlock(&self->m_lock);
 				return -EFAULT;
-			}
 
-			notify->m_streamPos += size;
+			self->m_readRingPos += size;
 			totalSize += size;
 			break;
 		}
 
-		result = copy_to_user(buffer_u, p, copySize);
+		result = copy_to_user(buffer_u, (char*)notifyHdr + self->m_readRingPos, copySize);
 		if (result != 0)
-		{
-			mutex_unlock(&self->m_lock);
 			return -EFAULT;
-		}
 
-		list_del(&notify->m_link);
-		self->m_pendingNotifySize -= notify->m_size;
-		self->m_pendingNotifyCount--;
-		kfree(notify);
+		NotifyRing_pop(self->m_readRing, notifySize);
+		self->m_readRing = NULL;
+		self->m_readRingPos = 0;
 
 		buffer_u = (char*)buffer_u + copySize;
 		size -= copySize;
 		totalSize += copySize;
 	}
-	while (!list_empty(&self->m_pendingNotifyList));
 
-	mutex_unlock(&self->m_lock);
+	return totalSize;
+}
+
+ssize_t
+Connection_p_readRingBatch(
+	Connection* self,
+	void __user* buffer_u,
+	size_t size
+	)
+{
+	int result;
+	const dm_NotifyHdr* notifyHdr;
+	NotifyRing* ring;
+	size_t notifySize;
+	size_t totalSize = 0;
+
+	for (;;)
+	{
+		notifyHdr = Connection_p_findOldestRing(self, &ring, &notifySize);
+		if (!notifyHdr || size < notifySize)
+			break;
+
+		result = copy_to_user(buffer_u, notifyHdr, notifySize);
+		if (result != 0)
+			return totalSize ? totalSize : -EFAULT;
+
+		NotifyRing_pop(ring, notifySize);
+		buffer_u = (char*)buffer_u + notifySize;
+		size -= notifySize;
+		totalSize += notifySize;
+	}
+
+	if (notifyHdr && !totalSize) // the oldest notification doesn't fit
+		return Connection_p_readRingMessage(self, buffer_u, size);
+
 	return totalSize;
 }
 
@@ -693,6 +2121,7 @@ Connection_p_addPendingNotification_l(
 	Connection* self,
 	bool hasNotifyHdr,
 	uint16_t code,
+	uint16_t flags,
 	int result,
 	uint32_t pid,
 	uint32_t tid,
@@ -702,9 +2131,11 @@ Connection_p_addPendingNotification_l(
 	size_t paramSize
 	)
 {
+	struct list_head readCompletionList;
 	PendingNotify* notify;
 	dm_NotifyHdr* notifyHdr;
 	size_t notifySize;
+	uint8_t sizeClass;
 
 	if (self->m_pendingNotifySize >= self->m_pendingNotifySizeLimit)
 	{
@@ -720,7 +2151,7 @@ Connection_p_addPendingNotification_l(
 
 	notifySize = hasNotifyHdr ?	sizeof(dm_NotifyHdr) + paramSize : paramSize;
 
-	notify = kmalloc(sizeof(PendingNotify) + notifySize, GFP_KERNEL);
+	notify = MemCache_allocNotify(sizeof(PendingNotify) + notifySize, GFP_KERNEL, &sizeClass);
 	if (!notify)
 	{
 		printk(
@@ -735,6 +2166,7 @@ Connection_p_addPendingNotification_l(
 	notify->m_size = notifySize;
 	notify->m_streamPos = 0;
 	notify->m_hasNotifyHdr = hasNotifyHdr;
+	notify->m_sizeClass = sizeClass;
 
 	if (!hasNotifyHdr)
 	{
@@ -745,7 +2177,7 @@ Connection_p_addPendingNotification_l(
 		notifyHdr = (dm_NotifyHdr*)(notify + 1);
 		notifyHdr->m_signature = dm_NotifyHdrSignature;
 		notifyHdr->m_code = code;
-		notifyHdr->m_flags = 0;
+		notifyHdr->m_flags = flags;
 		notifyHdr->m_result = result;
 		notifyHdr->m_pid = pid;
 		notifyHdr->m_tid = tid;
@@ -758,9 +2190,22 @@ Connection_p_addPendingNotification_l(
 	list_add_tail(&notify->m_link, &self->m_pendingNotifyList);
 	self->m_pendingNotifyCount++;
 	self->m_pendingNotifySize += notify->m_size;
-	wake_up_interruptible(&self->m_notificationWaitQueue);
+
+	if (list_empty(&self->m_pendingReadList))
+	{
+		wake_up_interruptible(&self->m_notificationWaitQueue);
+		mutex_unlock(&self->m_lock);
+		return true;
+	}
+
+	// only with dm_NotifyFormat_Compact -- otherwise, blocked reads are completed
+	// directly and nothing is queued while there are any
+
+	INIT_LIST_HEAD(&readCompletionList);
+	Connection_p_transferPendingNotifyList(self, &readCompletionList);
 	mutex_unlock(&self->m_lock);
 
+	Connection_p_completePendingReadList(self, &readCompletionList);
 	return true;
 }
 
@@ -768,6 +2213,7 @@ void
 Connection_p_notifyMessage_l(
 	Connection* self,
 	uint16_t code,
+	uint16_t flags,
 	int result,
 	uint32_t pid,
 	uint32_t tid,
@@ -793,6 +2239,7 @@ Connection_p_notifyMessage_l(
 		link = self->m_pendingReadList.next;
 		list_del(link);
 		read = container_of(link, PendingRead, m_link);
+		read->m_isQueued = false;
 		self->m_pendingReadCount--;
 
 		ASSERT(read->m_size >= sizeof(dm_NotifyHdr)); // should have been checked
@@ -800,7 +2247,7 @@ Connection_p_notifyMessage_l(
 		notifyHdr = read->m_buffer;
 		notifyHdr->m_signature = dm_NotifyHdrSignature;
 		notifyHdr->m_code = code;
-		notifyHdr->m_flags = 0;
+		notifyHdr->m_flags = flags;
 		notifyHdr->m_result = result;
 		notifyHdr->m_pid = pid;
 		notifyHdr->m_tid = tid;
@@ -823,7 +2270,7 @@ Connection_p_notifyMessage_l(
 		if (read->m_result == notifySize)
 		{
 			mutex_unlock(&self->m_lock);
-			Connection_p_completePendingReadList(&readCompletionList);
+			Connection_p_completePendingReadList(self, &readCompletionList);
 			return;
 		}
 	}
@@ -833,6 +2280,7 @@ Connection_p_notifyMessage_l(
 		self,
 		true,
 		code,
+		flags,
 		result,
 		pid,
 		tid,
@@ -842,13 +2290,14 @@ Connection_p_notifyMessage_l(
 		paramSize
 		);
 
-	Connection_p_completePendingReadList(&readCompletionList);
+	Connection_p_completePendingReadList(self, &readCompletionList);
 }
 
 void
 Connection_p_notifyStream_l(
 	Connection* self,
 	uint16_t code,
+	uint16_t flags,
 	int result,
 	uint32_t pid,
 	uint32_t tid,
@@ -879,6 +2328,7 @@ Connection_p_notifyStream_l(
 		link = self->m_pendingReadList.next;
 		list_del(link);
 		read = container_of(link, PendingRead, m_link);
+		read->m_isQueued = false;
 		self->m_pendingReadCount--;
 
 		if (notifyPos > 0)
@@ -900,7 +2350,7 @@ Connection_p_notifyStream_l(
 			notifyHdr = read->m_buffer;
 			notifyHdr->m_signature = dm_NotifyHdrSignature;
 			notifyHdr->m_code = code;
-			notifyHdr->m_flags = 0;
+			notifyHdr->m_flags = flags;
 			notifyHdr->m_result = result;
 			notifyHdr->m_pid = pid;
 			notifyHdr->m_tid = tid;
@@ -921,49 +2371,259 @@ Connection_p_notifyStream_l(
 		if (partialBlockIdx != paramBlockCount)
 			printk(KERN_WARNING  "tdevmon: partial scatter-gather: copied %zu of %zu\n", partialBlockIdx, paramBlockCount);
 
-		list_add_tail(&read->m_link, &readCompletionList);
-		notifyPos += read->m_result;
+		list_add_tail(&read->m_link, &readCompletionList);
+		notifyPos += read->m_result;
+
+		if (notifyPos == notifySize)
+		{
+			mutex_unlock(&self->m_lock);
+			Connection_p_completePendingReadList(self, &readCompletionList);
+			return;
+		}
+
+		ASSERT(partialBlockIdx <= paramBlockCount && copySize <= paramSize);
+
+		paramBlockArray += partialBlockIdx;
+		paramBlockCount -= partialBlockIdx;
+		paramSize -= copySize;
+	} while (!list_empty(&self->m_pendingReadList));
+
+	ASSERT(notifyPos >= sizeof(dm_NotifyHdr));
+
+	printk(KERN_WARNING "adding partial pending notification: size: %zu\n", paramSize);
+
+	isPendingNotificationAdded = Connection_p_addPendingNotification_l(
+		self,
+		false,
+		code,
+		flags,
+		result,
+		pid,
+		tid,
+		timestamp,
+		paramBlockArray,
+		paramBlockCount,
+		paramSize
+		);
+
+	if (!isPendingNotificationAdded)
+		Connection_p_resetPendingReadListOnDataDropped(
+			&readCompletionList,
+			pid,
+			tid,
+			timestamp
+			);
+
+	Connection_p_completePendingReadList(self, &readCompletionList);
+}
+
+// the compressed data stays in the compressor buffer, so it must be copied
+// before m_lock is released
+
+size_t
+Connection_p_compressPayload_l(
+	Connection* self,
+	MemBlock* blockArray, // room for payloadIdx + 2 blocks
+	size_t blockCount,
+	size_t payloadIdx,
+	dm_CompressedHdr* compressedHdr,
+	size_t* paramSize,
+	uint16_t* flags
+	)
+{
+	const void* p;
+	size_t payloadSize;
+	size_t compressedSize;
+
+	if (blockCount <= payloadIdx)
+		return blockCount;
+
+	payloadSize = getScatterGatherSize(blockArray + payloadIdx, blockCount - payloadIdx);
+	if (payloadSize <= sizeof(dm_CompressedHdr))
+		return blockCount;
+
+	p = Compressor_compress(
+		&self->m_compressor,
+		blockArray + payloadIdx,
+		blockCount - payloadIdx,
+		payloadSize,
+		payloadSize - sizeof(dm_CompressedHdr) - 1, // must be smaller than the original
+		&compressedSize
+		);
+
+	if (!p)
+		return blockCount;
+
+	compressedHdr->m_size = (uint32_t)payloadSize;
+	compressedHdr->m_compressedSize = (uint32_t)compressedSize;
+
+	blockArray[payloadIdx].m_p = compressedHdr;
+	blockArray[payloadIdx].m_size = sizeof(dm_CompressedHdr);
+	blockArray[payloadIdx].m_flags = 0;
+	blockArray[payloadIdx + 1].m_p = p;
+	blockArray[payloadIdx + 1].m_size = compressedSize;
+	blockArray[payloadIdx + 1].m_flags = 0;
+
+	*paramSize = *paramSize - payloadSize + sizeof(dm_CompressedHdr) + compressedSize;
+	*flags |= dm_NotifyFlag_Compressed;
+	return payloadIdx + 2;
+}
+
+// compact records are stateful, so they are always encoded and queued under
+// m_lock (and then handed over to blocked reads, if any)
+
+void
+Connection_p_notifyCompact_l(
+	Connection* self,
+	uint16_t code,
+	uint16_t flags,
+	int result,
+	uint32_t pid,
+	uint32_t tid,
+	uint64_t timestamp,
+	uint32_t sampleWeight,
+	MemBlock* paramBlockArray,
+	size_t paramBlockCount,
+	size_t paramSize
+	)
+{
+	uint8_t hdr[CompactEncoderConst_MaxHdrSize];
+	MemBlock blockArray[3];
+	size_t payloadSize;
+	size_t hdrSize;
+
+	ASSERT(paramBlockCount >= 1 && paramBlockCount <= 3);
+
+	payloadSize = paramSize - paramBlockArray[0].m_size;
+
+	hdrSize = CompactEncoder_encodeHdr(
+		&self->m_compactEncoder,
+		hdr,
+		code,
+		flags | (sampleWeight ? dm_NotifyFlag_Sampled : 0),
+		result,
+		pid,
+		tid,
+		timestamp,
+		sampleWeight,
+		paramBlockArray[0].m_p,
+		payloadSize
+		);
+
+	// replace the params block with the encoded header
+
+	blockArray[0].m_p = hdr;
+	blockArray[0].m_size = hdrSize;
+	blockArray[0].m_flags = 0;
+	memcpy(blockArray + 1, paramBlockArray + 1, (paramBlockCount - 1) * sizeof(MemBlock));
+
+	Connection_p_addPendingNotification_l(
+		self,
+		false,
+		code,
+		0,
+		result,
+		pid,
+		tid,
+		timestamp,
+		blockArray,
+		paramBlockCount,
+		hdrSize + payloadSize
+		);
+}
+
+void
+Connection_p_notifyRing(
+	Connection* self,
+	uint16_t code,
+	uint16_t flags,
+	int result,
+	uint32_t pid,
+	uint32_t tid,
+	uint64_t timestamp,
+	MemBlock* paramBlockArray,
+	size_t paramBlockCount,
+	size_t paramSize
+	)
+{
+	NotifyRingSet* ringSet;
+	NotifyRing* ring;
+	dm_NotifyHdr* notifyHdr;
+	uint32_t nextHead;
+	ssize_t copyResult;
+
+	rcu_read_lock_sched(); // also pins us to the current CPU, i.e. we are the only producer for its ring
+
+	ringSet = rcu_dereference_sched(self->m_ringSet);
+	if (!ringSet) // capture mode is being switched
+	{
+		rcu_read_unlock_sched();
+		return;
+	}
+
+	ring = NotifyRingSet_getRingArray(ringSet)[smp_processor_id()];
 
-		if (notifyPos == notifySize)
+	if (ring->m_dropCount)
+	{
+		notifyHdr = NotifyRing_reserve(ring, sizeof(dm_NotifyHdr), &nextHead);
+		if (!notifyHdr)
 		{
-			mutex_unlock(&self->m_lock);
-			Connection_p_completePendingReadList(&readCompletionList);
+			ring->m_dropCount++;
+			rcu_read_unlock_sched();
 			return;
 		}
 
-		ASSERT(partialBlockIdx <= paramBlockCount && copySize <= paramSize);
+		notifyHdr->m_signature = dm_NotifyHdrSignature;
+		notifyHdr->m_code = dm_NotifyCode_DataDropped;
+		notifyHdr->m_flags = dm_NotifyFlag_DataDropped;
+		notifyHdr->m_result = 0;
+		notifyHdr->m_pid = pid;
+		notifyHdr->m_tid = tid;
+		notifyHdr->m_timestamp = timestamp;
+		notifyHdr->m_paramSize = 0;
 
-		paramBlockArray += partialBlockIdx;
-		paramBlockCount -= partialBlockIdx;
-		paramSize -= copySize;
-	} while (!list_empty(&self->m_pendingReadList));
+		NotifyRing_commit(ring, nextHead);
+		ring->m_dropCount = 0;
+	}
 
-	ASSERT(notifyPos >= sizeof(dm_NotifyHdr));
+	// no printk per drop -- that would only make a flood worse; the next
+	// record that fits reports the loss as dm_NotifyCode_DataDropped
 
-	printk(KERN_WARNING "adding partial pending notification: size: %zu\n", paramSize);
+	notifyHdr = NotifyRing_reserve(ring, sizeof(dm_NotifyHdr) + paramSize, &nextHead);
+	if (!notifyHdr)
+	{
+		ring->m_dropCount++;
+		rcu_read_unlock_sched();
+		return;
+	}
 
-	isPendingNotificationAdded = Connection_p_addPendingNotification_l(
-		self,
-		false,
-		code,
-		result,
-		pid,
-		tid,
-		timestamp,
-		paramBlockArray,
-		paramBlockCount,
-		paramSize
-		);
+	notifyHdr->m_signature = dm_NotifyHdrSignature;
+	notifyHdr->m_code = code;
+	notifyHdr->m_flags = flags;
+	notifyHdr->m_result = result;
+	notifyHdr->m_pid = pid;
+	notifyHdr->m_tid = tid;
+	notifyHdr->m_timestamp = timestamp;
+	notifyHdr->m_paramSize = (uint32_t)paramSize;
 
-	if (!isPendingNotificationAdded)
-		Connection_p_resetPendingReadListOnDataDropped(
-			&readCompletionList,
-			pid,
-			tid,
-			timestamp
-			);
+	// we can't sleep here, so page faults will fail the copy (unlikely, the
+	// original fop has just touched these pages); it's counted as a drop, too
+
+	pagefault_disable();
+	copyResult = copyScatterGather(notifyHdr + 1, paramBlockArray, paramBlockCount);
+	pagefault_enable();
+
+	if (copyResult < 0)
+		ring->m_dropCount++;
+	else
+		NotifyRing_commit(ring, nextHead);
+
+	rcu_read_unlock_sched();
 
-	Connection_p_completePendingReadList(&readCompletionList);
+	smp_mb(); // pairs with set_current_state in wait_event_interruptible
+
+	if (waitqueue_active(&self->m_notificationWaitQueue))
+		wake_up_interruptible(&self->m_notificationWaitQueue);
 }
 
 void
@@ -976,6 +2636,13 @@ Connection_p_markDataDropped_l(
 {
 	PendingNotify* notify;
 	dm_NotifyHdr* notifyHdr;
+	uint8_t sizeClass;
+
+	if (self->m_notifyFormat == dm_NotifyFormat_Compact)
+	{
+		Connection_p_markCompactDataDropped_l(self, pid, tid, timestamp);
+		return;
+	}
 
 	if (!list_empty(&self->m_pendingNotifyList))
 	{
@@ -989,7 +2656,7 @@ Connection_p_markDataDropped_l(
 		}
 	}
 
-	notify = kmalloc(sizeof(PendingNotify) + sizeof(dm_NotifyHdr), GFP_KERNEL);
+	notify = MemCache_allocNotify(sizeof(PendingNotify) + sizeof(dm_NotifyHdr), GFP_KERNEL, &sizeClass);
 	if (!notify) // there's nothing else we can do
 	{
 		mutex_unlock(&self->m_lock);
@@ -999,6 +2666,7 @@ Connection_p_markDataDropped_l(
 	notify->m_size = sizeof(dm_NotifyHdr);
 	notify->m_streamPos = 0;
 	notify->m_hasNotifyHdr = true;
+	notify->m_sizeClass = sizeClass;
 
 	notifyHdr = (dm_NotifyHdr*)(notify + 1);
 	notifyHdr->m_signature = dm_NotifyHdrSignature;
@@ -1017,6 +2685,83 @@ Connection_p_markDataDropped_l(
 	mutex_unlock(&self->m_lock);
 }
 
+// unlike the default format, the drop can't be flagged in the last queued
+// record, so it's a separate dm_NotifyCode_DataDropped record (unless the last
+// one is such a record already); either way, the next record will be a sync one
+
+void
+Connection_p_markCompactDataDropped_l(
+	Connection* self,
+	uint32_t pid,
+	uint32_t tid,
+	uint64_t timestamp
+	)
+{
+	struct list_head readCompletionList;
+	PendingNotify* notify;
+	uint8_t hdr[CompactEncoderConst_MaxHdrSize];
+	size_t hdrSize;
+	uint8_t sizeClass;
+
+	CompactEncoder_requestSync(&self->m_compactEncoder);
+
+	if (!list_empty(&self->m_pendingNotifyList))
+	{
+		notify = container_of(self->m_pendingNotifyList.prev, PendingNotify, m_link);
+		if (!notify->m_streamPos &&
+			(*(const uint8_t*)(notify + 1) & dm_CompactHdrFlag_CodeMask) == dm_NotifyCode_DataDropped)
+		{
+			mutex_unlock(&self->m_lock);
+			return;
+		}
+	}
+
+	hdrSize = CompactEncoder_encodeHdr(
+		&self->m_compactEncoder,
+		hdr,
+		dm_NotifyCode_DataDropped,
+		dm_NotifyFlag_DataDropped,
+		0,
+		pid,
+		tid,
+		timestamp,
+		0,
+		NULL,
+		0
+		);
+
+	notify = MemCache_allocNotify(sizeof(PendingNotify) + hdrSize, GFP_KERNEL, &sizeClass);
+	if (!notify) // there's nothing else we can do
+	{
+		CompactEncoder_requestSync(&self->m_compactEncoder);
+		mutex_unlock(&self->m_lock);
+		return;
+	}
+
+	notify->m_size = hdrSize;
+	notify->m_streamPos = 0;
+	notify->m_hasNotifyHdr = false;
+	notify->m_sizeClass = sizeClass;
+	memcpy(notify + 1, hdr, hdrSize);
+
+	list_add_tail(&notify->m_link, &self->m_pendingNotifyList);
+	self->m_pendingNotifyCount++;
+	self->m_pendingNotifySize += notify->m_size;
+
+	if (list_empty(&self->m_pendingReadList))
+	{
+		wake_up_interruptible(&self->m_notificationWaitQueue);
+		mutex_unlock(&self->m_lock);
+		return;
+	}
+
+	INIT_LIST_HEAD(&readCompletionList);
+	Connection_p_transferPendingNotifyList(self, &readCompletionList);
+	mutex_unlock(&self->m_lock);
+
+	Connection_p_completePendingReadList(self, &readCompletionList);
+}
+
 void
 Connection_p_resetPendingReadListOnDataDropped(
 	struct list_head* list,
@@ -1052,8 +2797,60 @@ Connection_p_resetPendingReadListOnDataDropped(
 	}
 }
 
+// stream-reads queued notifications into blocked reads; the completed reads
+// are moved to readCompletionList
+
+void
+Connection_p_transferPendingNotifyList(
+	Connection* self,
+	struct list_head* readCompletionList
+	)
+{
+	struct list_head* link;
+	PendingRead* read;
+	PendingNotify* notify;
+	size_t copySize;
+
+	while (!list_empty(&self->m_pendingReadList) && !list_empty(&self->m_pendingNotifyList))
+	{
+		link = self->m_pendingReadList.next;
+		list_del(link);
+		read = container_of(link, PendingRead, m_link);
+		read->m_isQueued = false;
+		read->m_result = 0;
+		self->m_pendingReadCount--;
+
+		do
+		{
+			notify = container_of(self->m_pendingNotifyList.next, PendingNotify, m_link);
+
+			copySize = notify->m_size - notify->m_streamPos;
+			if (copySize > read->m_size - read->m_result)
+				copySize = read->m_size - read->m_result;
+
+			memcpy((char*)read->m_buffer + read->m_result, (char*)(notify + 1) + notify->m_streamPos, copySize);
+			read->m_result += copySize;
+			notify->m_streamPos += copySize;
+
+			if (notify->m_streamPos < notify->m_size) // the read is full
+				break;
+
+			list_del(&notify->m_link);
+			self->m_pendingNotifySize -= notify->m_size;
+			self->m_pendingNotifyCount--;
+			MemCache_freeNotify(notify, notify->m_sizeClass);
+		}
+		while ((size_t)read->m_result < read->m_size && !list_empty(&self->m_pendingNotifyList));
+
+		list_add_tail(&read->m_link, readCompletionList);
+	}
+}
+
 void
-Connection_p_completePendingReadList(struct list_head* list)
+Connection_p_completePendingReadList(
+	Connection* self,
+	struct list_head* list
+	)
 {
 	struct list_head* link;
 	PendingRead* read;
@@ -1063,10 +2860,278 @@ Connection_p_completePendingReadList(struct list_head* list)
 		link = list->next;
 		list_del(link);
 		read = container_of(link, PendingRead, m_link);
-		read->m_isCompleted = true;
-		wake_up_interruptible(&read->m_waitQueue);
-		kfree(read);
+		smp_store_release(&read->m_isCompleted, true); // the reader may be gone right after this
+	}
+
+	wake_up(&self->m_notificationWaitQueue); // interruptible and uninterruptible (see addPendingRead_l)
+}
+
+void
+Connection_p_freePendingRead(PendingRead* read)
+{
+	if (read->m_pinnedBuffer)
+		PinnedBuffer_release(read->m_pinnedBuffer);
+	else
+		kfree(read->m_buffer);
+}
+
+size_t
+Connection_p_getRingSize(Connection* self)
+{
+	size_t ringSize;
+
+	if (self->m_ringSize)
+		return self->m_ringSize;
+
+	ringSize = self->m_pendingNotifySizeLimit / num_possible_cpus();
+	if (ringSize <= NotifyRingConst_MinSize)
+		return NotifyRingConst_MinSize;
+
+	ringSize = rounddown_pow_of_two(ringSize);
+	return ringSize < NotifyRingConst_MaxSize ? ringSize : NotifyRingConst_MaxSize;
+}
+
+// must be called with m_lock held; on success, the caller should wait for
+// producers to leave the previous ring set before releasing it
+
+int
+Connection_p_replaceRingSet(
+	Connection* self,
+	NotifyRingSet* ringSet,
+	NotifyRingSet** prevRingSet
+	)
+{
+	NotifyRingSet* prev;
+
+	spin_lock(&self->m_ringLock);
+	prev = rcu_dereference_protected(self->m_ringSet, lockdep_is_held(&self->m_ringLock));
+	if (prev && NotifyRingSet_isMapped(prev))
+	{
+		spin_unlock(&self->m_ringLock);
+		return -EBUSY; // user mode still has it mapped
+	}
+
+	rcu_assign_pointer(self->m_ringSet, ringSet);
+	spin_unlock(&self->m_ringLock);
+
+	self->m_readRing = NULL;
+	self->m_readRingPos = 0;
+	*prevRingSet = prev;
+	return 0;
+}
+
+// may be called without holding m_lock (e.g. from wait_event)
+
+bool
+Connection_p_hasRingData(Connection* self)
+{
+	NotifyRingSet* ringSet;
+	NotifyRing** ringArray;
+	bool result = false;
+	size_t i;
+
+	rcu_read_lock_sched();
+
+	ringSet = rcu_dereference_sched(self->m_ringSet);
+	if (ringSet)
+	{
+		ringArray = NotifyRingSet_getRingArray(ringSet);
+		for (i = 0; i < ringSet->m_ringCount && !result; i++)
+			result = NotifyRing_getDataSize(ringArray[i]) != 0;
+	}
+
+	rcu_read_unlock_sched();
+	return result;
+}
+
+// merges per-CPU rings by timestamps; must be called with m_lock held
+
+const dm_NotifyHdr*
+Connection_p_findOldestRing(
+	Connection* self,
+	NotifyRing** resultRing,
+	size_t* resultNotifySize
+	)
+{
+	NotifyRingSet* ringSet;
+	NotifyRing** ringArray;
+	const dm_NotifyHdr* notifyHdr;
+	const dm_NotifyHdr* oldestNotifyHdr = NULL;
+	size_t notifySize;
+	size_t i;
+
+	ringSet = rcu_dereference_protected(self->m_ringSet, lockdep_is_held(&self->m_lock));
+	if (!ringSet)
+		return NULL;
+
+	ringArray = NotifyRingSet_getRingArray(ringSet);
+	for (i = 0; i < ringSet->m_ringCount; i++)
+	{
+		notifyHdr = NotifyRing_peek(ringArray[i], &notifySize);
+		if (notifyHdr && (!oldestNotifyHdr || notifyHdr->m_timestamp < oldestNotifyHdr->m_timestamp))
+		{
+			oldestNotifyHdr = notifyHdr;
+			*resultRing = ringArray[i];
+			*resultNotifySize = notifySize;
+		}
+	}
+
+	return oldestNotifyHdr;
+}
+
+// the param block array is shared by all connections of the hook, so we make
+// a local copy of it (and of the payload iov_iter -- copy_from_iter advances
+// it); then the payload block (if any) is cut down to the snap length
+
+size_t
+Connection_p_prepareParamBlocks(
+	Connection* self,
+	uint16_t code,
+	MemBlock* blockArray,
+	struct iov_iter* iterArray,
+	const MemBlock* paramBlockArray,
+	size_t paramBlockCount
+	)
+{
+	MemBlock* payloadBlock;
+	MemBlock* tailBlock;
+	size_t headSize = self->m_snapHeadSize;
+	size_t tailSize = self->m_snapTailSize;
+
+	ASSERT(paramBlockCount <= 2);
+
+	memcpy(blockArray, paramBlockArray, paramBlockCount * sizeof(MemBlock));
+	if (paramBlockCount < 2)
+		return paramBlockCount;
+
+	payloadBlock = &blockArray[1];
+	if (payloadBlock->m_flags & MemBlockFlag_IovIter)
+	{
+		iterArray[0] = *(const struct iov_iter*)payloadBlock->m_p;
+		payloadBlock->m_p = &iterArray[0];
+	}
+
+	switch (code)
+	{
+	case dm_NotifyCode_Read:
+	case dm_NotifyCode_Write:
+	case dm_NotifyCode_ReadIter:
+	case dm_NotifyCode_WriteIter:
+	case dm_NotifyCode_UnlockedIoctl:
+	case dm_NotifyCode_CompatIoctl:
+		break;
+
+	default: // e.g. the file name of open
+		return paramBlockCount;
+	}
+
+	if (!headSize && !tailSize || payloadBlock->m_size <= headSize + tailSize)
+		return paramBlockCount;
+
+	if (!tailSize)
+	{
+		payloadBlock->m_size = headSize;
+		return 2;
+	}
+
+	tailBlock = &blockArray[2];
+	tailBlock->m_size = tailSize;
+	tailBlock->m_flags = payloadBlock->m_flags;
+
+	if (payloadBlock->m_flags & MemBlockFlag_IovIter)
+	{
+		iterArray[1] = iterArray[0];
+		iov_iter_advance(&iterArray[1], payloadBlock->m_size - tailSize);
+		tailBlock->m_p = &iterArray[1];
+	}
+	else
+	{
+		tailBlock->m_p = (const char*)payloadBlock->m_p + payloadBlock->m_size - tailSize;
+	}
+
+	payloadBlock->m_size = headSize;
+	return 3;
+}
+
+// runs before anything is allocated or copied (except for the first few bytes
+// the program looks at); returns false if the notification should be dropped,
+// otherwise may truncate the payload
+
+bool
+Connection_p_runBpfFilter(
+	Connection* self,
+	uint16_t code,
+	int result,
+	uint32_t pid,
+	uint32_t tid,
+	uint64_t timestamp,
+	MemBlock* paramBlockArray,
+	size_t* paramBlockCount,
+	size_t* paramSize
+	)
+{
+	char context[dm_BpfContextSizeLimit];
+	dm_NotifyHdr* notifyHdr = (dm_NotifyHdr*)context;
+	BpfFilter* filter;
+	size_t notifySize;
+	size_t contextSize;
+	ssize_t copySize;
+	uint32_t keepSize;
+
+	notifySize = sizeof(dm_NotifyHdr) + *paramSize;
+
+	rcu_read_lock();
+	filter = rcu_dereference(self->m_bpfFilter);
+	contextSize = filter ? filter->m_contextSize : 0;
+	rcu_read_unlock();
+
+	if (!contextSize) // removed in the meantime
+		return true;
+
+	notifyHdr->m_signature = dm_NotifyHdrSignature;
+	notifyHdr->m_code = code;
+	notifyHdr->m_flags = 0;
+	notifyHdr->m_result = result;
+	notifyHdr->m_pid = pid;
+	notifyHdr->m_tid = tid;
+	notifyHdr->m_timestamp = timestamp;
+	notifyHdr->m_paramSize = (uint32_t)*paramSize;
+
+	// copying may fault (and sleep), so it's done outside of the RCU read section
+
+	if (contextSize > notifySize)
+		contextSize = notifySize;
+
+	copySize = copyScatterGatherHead(
+		notifyHdr + 1,
+		contextSize - sizeof(dm_NotifyHdr),
+		paramBlockArray,
+		*paramBlockCount
+		);
+
+	if (copySize < 0) // let the capture path deal with it
+		return true;
+
+	contextSize = sizeof(dm_NotifyHdr) + copySize;
+
+	rcu_read_lock();
+	filter = rcu_dereference(self->m_bpfFilter);
+	keepSize = filter ? BpfFilter_run(filter, context, contextSize, notifySize) : (uint32_t)notifySize;
+	rcu_read_unlock();
+
+	if (!keepSize)
+		return false;
+
+	if (keepSize < notifySize)
+	{
+		if (keepSize < sizeof(dm_NotifyHdr) + paramBlockArray[0].m_size) // params are never truncated
+			keepSize = sizeof(dm_NotifyHdr) + paramBlockArray[0].m_size;
+
+		*paramSize = keepSize - sizeof(dm_NotifyHdr);
+		*paramBlockCount = truncateScatterGather(paramBlockArray, *paramBlockCount, *paramSize);
 	}
+
+	return true;
 }
 
 bool
@@ -1078,28 +3143,41 @@ Connection_p_preIoctlNotify(
 {
 	dm_IoctlNotifyParams* notifyParams;
 	const dm_IoctlDesc* ioctlDesc;
+	HookIoctlContext* context;
+	uint64_t dynamicArgSize;
 	size_t argSize;
 
 	ASSERT(paramBlockCount == 1);
 
 	notifyParams = (dm_IoctlNotifyParams*)paramBlockArray[0].m_p; // const cast
 
-	ioctlDesc = HashTable_findValue(
+	ioctlDesc = PtrMap_findValue(
 		&self->m_ioctlDescMap,
 		(const void*) (uintptr_t)notifyParams->m_code
 		);
 
-	if (!ioctlDesc)
+	if (ioctlDesc) // explicit table entries always win
+	{
+		argSize = ioctlDesc->m_argFixedSize;
+	}
+	else if (
+		self->m_ioctlArgMode == dm_IoctlArgMode_Auto &&
+		(_IOC_DIR(notifyParams->m_code) & (_IOC_READ | _IOC_WRITE)) &&
+		_IOC_SIZE(notifyParams->m_code))
+	{
+		argSize = _IOC_SIZE(notifyParams->m_code);
+	}
+	else
 	{
 		notifyParams->m_argSize = 0;
 		return false;
 	}
 
-	argSize = ioctlDesc->m_argFixedSize;
-
-	if (ioctlDesc->m_flags & dm_IoctlFlag_HasArgSizeField)
+	if (ioctlDesc && (ioctlDesc->m_flags & dm_IoctlFlag_HasArgSizeField))
 	{
-		// TODO: copy_from_user and add dynamic size from field
+		context = container_of(notifyParams, HookIoctlContext, m_params);
+		dynamicArgSize = (uint64_t)argSize + HookIoctlContext_getArgSizeField(context, ioctlDesc);
+		argSize = dynamicArgSize < dm_IoctlArgSizeLimit ? (size_t)dynamicArgSize : dm_IoctlArgSizeLimit;
 	}
 
 	notifyParams->m_argSize = argSize;
@@ -1135,7 +3213,7 @@ Connection_p_setIoctlDescTableImpl(
 	size_t size;
 	dm_IoctlDesc* table;
 	dm_IoctlDesc* p;
-	HashTableEntry* entry;
+	PtrMapSlot* slot;
 	size_t i;
 
 	ASSERT(sizeof(dm_IoctlDesc) == sizeof(dm_IoctlDesc_v0302xx));
@@ -1152,7 +3230,7 @@ Connection_p_setIoctlDescTableImpl(
 		return -EFAULT;
 	}
 
-	HashTable_clear(&self->m_ioctlDescMap);
+	PtrMap_clear(&self->m_ioctlDescMap);
 
 	printk(KERN_INFO "tdevmon: setting %zu IOCTL descriptors on connection %p to %s (inode: %p):\n", count, self, self->m_hook->m_originalPath, self->m_inode);
 
@@ -1163,19 +3241,19 @@ Connection_p_setIoctlDescTableImpl(
 
 		printk(KERN_INFO "tdevmon: ... [%zu] 0x%x -> %d B\n", i, p->m_code, p->m_argFixedSize);
 
-		entry = HashTable_visit(
+		slot = PtrMap_visit(
 			&self->m_ioctlDescMap,
 			(const void*) (uintptr_t)p->m_code
 			);
 
-		if (!entry)
+		if (!slot)
 		{
-			HashTable_clear(&self->m_ioctlDescMap);
+			PtrMap_clear(&self->m_ioctlDescMap);
 			kfree(table);
 			return -ENOMEM;
 		}
 
-		entry->m_value = &table[i];
+		slot->m_value = &table[i];
 	}
 
 	kfree(self->m_ioctlDescTable);
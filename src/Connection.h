@@ -2,6 +2,15 @@
 
 #include "dm_lnx_Protocol.h"
 #include "FileNameFilter.h"
+#include "PidFilter.h"
+#include "BpfFilter.h"
+#include "CounterMap.h"
+#include "PtrMap.h"
+#include "Sampler.h"
+#include "CompactEncoder.h"
+#include "Compressor.h"
+#include "NotifyRing.h"
+#include "PinnedBuffer.h"
 #include "lkmUtils.h"
 #include "typedefs.h"
 
@@ -11,13 +20,17 @@ typedef enum ConnectionFlag  ConnectionFlag;
 
 //..............................................................................
 
+// lives on the stack of the reader; once m_isCompleted is set, the reader may
+// return at any moment, so completers must not touch it afterwards
+
 struct PendingRead
 {
 	struct list_head m_link;
-	wait_queue_head_t m_waitQueue;
-	void* m_buffer; // kernel memory
+	void* m_buffer; // kernel memory (a bounce buffer or a part of m_pinnedBuffer)
+	PinnedBuffer* m_pinnedBuffer;
 	size_t m_size;
 	ssize_t m_result;
+	bool m_isQueued; // still on m_pendingReadList
 	bool m_isCompleted;
 };
 
@@ -29,6 +42,7 @@ struct PendingNotify
 	size_t m_size;
 	size_t m_streamPos;
 	bool m_hasNotifyHdr;
+	uint8_t m_sizeClass; // MemCache
 
 	// followed by notification-specific data (m_size bytes)
 };
@@ -39,23 +53,49 @@ struct Connection
 {
 	Hook* m_hook;
 	struct list_head m_hookLink;
+	uint m_hookSlot; // bit in Hook::m_fileMap masks
 	struct inode* m_inode;
 	const char* m_path;
 	uint m_fileFlags;
 
 	struct mutex m_lock;
 	struct file* m_originalFilp;
-	FileNameFilter* m_fileNameFilter;
+	FileNameFilter __rcu* m_fileNameFilter; // replaced under m_lock, read under RCU
+	PidFilter __rcu* m_pidFilter; // ditto
+	BpfFilter __rcu* m_bpfFilter; // ditto
 	const dm_IoctlDesc* m_ioctlDescTable;
-	HashTable m_ioctlDescMap;
+	PtrMap m_ioctlDescMap; // code -> dm_IoctlDesc*
 	dm_ReadMode m_readMode;
-	wait_queue_head_t m_notificationWaitQueue;
+	dm_CaptureMode m_captureMode;
+	dm_NotifyFormat m_notifyFormat;
+	dm_Compression m_compression;
+	dm_PathMode m_pathMode; // can't change while enabled
+	dm_IoctlArgMode m_ioctlArgMode; // ditto
+	wait_queue_head_t m_notificationWaitQueue; // also used by blocked readers
 	struct list_head m_pendingReadList;
 	struct list_head m_pendingNotifyList;
 	size_t m_pendingReadCount;
 	size_t m_pendingNotifyCount;
 	size_t m_pendingNotifySize;
 	size_t m_pendingNotifySizeLimit;
+	size_t m_readCancelCount;
+	PinnedBuffer* m_readBuffer;
+	uint32_t m_snapHeadSize; // both 0 -- no snap length
+	uint32_t m_snapTailSize;
+	uint m_notifyCodeMask; // can't change while enabled, so notify reads it without m_lock
+
+	spinlock_t m_ringLock; // guards m_ringSet against mmap (which can't take m_lock)
+	NotifyRingSet __rcu* m_ringSet; // dm_CaptureMode_PerCpuRing
+	size_t m_ringSize; // 0 -- derive from m_pendingNotifySizeLimit
+	uint m_ringFlags;
+	NotifyRing* m_readRing; // the ring of a partially read notification (dm_ReadMode_Stream)
+	size_t m_readRingPos;
+
+	spinlock_t m_counterLock; // guards m_counterMap (notify shouldn't wait for m_lock holders)
+	CounterMap m_counterMap; // dm_CaptureMode_Counters
+	Sampler m_sampler;
+	CompactEncoder m_compactEncoder; // dm_NotifyFormat_Compact
+	Compressor m_compressor; // dm_Compression_Lz4
 
 	volatile long m_refCount;
 	volatile long m_enableCount;
@@ -112,6 +152,138 @@ Connection_setReadMode(
 	dm_ReadMode mode
 	);
 
+int
+Connection_getCaptureMode(
+	Connection* self,
+	int __user* mode_u
+	);
+
+int
+Connection_setCaptureMode(
+	Connection* self,
+	dm_CaptureMode mode
+	);
+
+int
+Connection_getNotifyFormat(
+	Connection* self,
+	int __user* format_u
+	);
+
+int
+Connection_setNotifyFormat(
+	Connection* self,
+	dm_NotifyFormat format
+	);
+
+int
+Connection_getCompression(
+	Connection* self,
+	int __user* compression_u
+	);
+
+int
+Connection_setCompression(
+	Connection* self,
+	dm_Compression compression
+	);
+
+int
+Connection_getPathMode(
+	Connection* self,
+	int __user* mode_u
+	);
+
+int
+Connection_setPathMode(
+	Connection* self,
+	dm_PathMode mode
+	);
+
+int
+Connection_getIoctlArgMode(
+	Connection* self,
+	int __user* mode_u
+	);
+
+int
+Connection_setIoctlArgMode(
+	Connection* self,
+	dm_IoctlArgMode mode
+	);
+
+int
+Connection_getFilePath(
+	Connection* self,
+	dm_FilePath __user* filePath_u
+	);
+
+int
+Connection_getRingParams(
+	Connection* self,
+	dm_RingParams __user* params_u
+	);
+
+int
+Connection_setRingParams(
+	Connection* self,
+	const dm_RingParams __user* params_u
+	);
+
+int
+Connection_mmap(
+	Connection* self,
+	struct vm_area_struct* vma
+	);
+
+int
+Connection_setReadBuffer(
+	Connection* self,
+	const dm_ReadBuffer __user* buffer_u
+	);
+
+int
+Connection_getSnapLength(
+	Connection* self,
+	dm_SnapLength __user* snapLength_u
+	);
+
+int
+Connection_setSnapLength(
+	Connection* self,
+	const dm_SnapLength __user* snapLength_u
+	);
+
+int
+Connection_getNotifyCodeMask(
+	Connection* self,
+	uint32_t __user* mask_u
+	);
+
+int
+Connection_setNotifyCodeMask(
+	Connection* self,
+	uint32_t mask
+	);
+
+int
+Connection_getSamplingParams(
+	Connection* self,
+	dm_SamplingParams __user* params_u
+	);
+
+int
+Connection_setSamplingParams(
+	Connection* self,
+	const dm_SamplingParams __user* params_u
+	);
+
+int
+Connection_getCounters(
+	Connection* self,
+	dm_List __user* list_u
+	);
+
 int
 Connection_getFileNameFilter(
 	Connection* self,
@@ -124,6 +296,18 @@ Connection_setFileNameFilter(
 	const dm_String __user* filter_u
 	);
 
+int
+Connection_setPidFilter(
+	Connection* self,
+	const dm_PidFilter __user* filter_u
+	);
+
+int
+Connection_setBpfFilter(
+	Connection* self,
+	const dm_BpfProgram __user* program_u
+	);
+
 int
 Connection_getIoctlDescTable(
 	Connection* self,
@@ -155,20 +339,70 @@ Connection_setPendingNotifySizeLimit(
 	uint32_t limit
 	);
 
+// connections with a file name filter or in dm_PathMode_Deferred track the
+// files they matched on open in Hook::m_fileMap; neither can change while
+// enabled
+
+static
+inline
 bool
-Connection_checkFile(
+Connection_isTrackingFiles(Connection* self)
+{
+	return rcu_access_pointer(self->m_fileNameFilter) || self->m_pathMode == dm_PathMode_Deferred;
+}
+
+bool
+Connection_checkOpenFile(
 	Connection* self,
-	FileNameFilterReq filterReq,
 	struct file* filp,
 	const char* fileName
 	);
 
+// any op but open; fileMask is from Hook::m_fileMap
+
+static
+inline
+bool
+Connection_checkFile(
+	Connection* self,
+	struct file* filp,
+	uint fileMask
+	)
+{
+	if (self->m_enableCount <= 0)
+		return false;
+
+	return Connection_isTrackingFiles(self) ?
+		(fileMask & (1 << self->m_hookSlot)) != 0 :
+		self->m_inode == filp->f_inode;
+}
+
+bool
+Connection_checkProcess(Connection* self);
+
+bool
+Connection_checkSample(
+	Connection* self,
+	uint16_t code,
+	uint64_t timestamp,
+	uint32_t* sampleWeight
+	);
+
+int
+Connection_getNextNotifySize(
+	Connection* self,
+	uint32_t __user* size_u
+	);
+
 int
 Connection_getIncomingDataSize(
 	Connection* self,
 	int __user* size_u
 	);
 
+bool
+Connection_hasIncomingData(Connection* self);
+
 ssize_t
 Connection_read(
 	Connection* self,
@@ -185,6 +419,7 @@ Connection_notify(
 	uint32_t pid,
 	uint32_t tid,
 	uint64_t timestamp,
+	uint32_t sampleWeight, // 0 -- not sampled
 	MemBlock* paramBlockArray,
 	size_t paramBlockCount
 	);
@@ -212,11 +447,19 @@ Connection_p_readStream_l(
 	size_t size
 	);
 
+ssize_t
+Connection_p_readBatch_l(
+	Connection* self,
+	void __user* buffer_u,
+	size_t size
+	);
+
 bool
 Connection_p_addPendingNotification_l(
 	Connection* self,
 	bool hasNotifyHdr,
 	uint16_t code,
+	uint16_t flags,
 	int result,
 	uint32_t pid,
 	uint32_t tid,
@@ -230,6 +473,7 @@ void
 Connection_p_notifyMessage_l(
 	Connection* self,
 	uint16_t code,
+	uint16_t flags,
 	int result,
 	uint32_t pid,
 	uint32_t tid,
@@ -243,6 +487,47 @@ void
 Connection_p_notifyStream_l(
 	Connection* self,
 	uint16_t code,
+	uint16_t flags,
+	int result,
+	uint32_t pid,
+	uint32_t tid,
+	uint64_t timestamp,
+	MemBlock* paramBlockArray,
+	size_t paramBlockCount,
+	size_t paramSize
+	);
+
+size_t
+Connection_p_compressPayload_l(
+	Connection* self,
+	MemBlock* blockArray,
+	size_t blockCount,
+	size_t payloadIdx,
+	dm_CompressedHdr* compressedHdr,
+	size_t* paramSize,
+	uint16_t* flags
+	);
+
+void
+Connection_p_notifyCompact_l(
+	Connection* self,
+	uint16_t code,
+	uint16_t flags,
+	int result,
+	uint32_t pid,
+	uint32_t tid,
+	uint64_t timestamp,
+	uint32_t sampleWeight,
+	MemBlock* paramBlockArray,
+	size_t paramBlockCount,
+	size_t paramSize
+	);
+
+void
+Connection_p_notifyRing(
+	Connection* self,
+	uint16_t code,
+	uint16_t flags,
 	int result,
 	uint32_t pid,
 	uint32_t tid,
@@ -260,6 +545,14 @@ Connection_p_markDataDropped_l(
 	uint64_t timestamp
 	);
 
+void
+Connection_p_markCompactDataDropped_l(
+	Connection* self,
+	uint32_t pid,
+	uint32_t tid,
+	uint64_t timestamp
+	);
+
 void
 Connection_p_resetPendingReadListOnDataDropped(
 	struct list_head* list,
@@ -269,7 +562,90 @@ Connection_p_resetPendingReadListOnDataDropped(
 	);
 
 void
-Connection_p_completePendingReadList(struct list_head* list);
+Connection_p_transferPendingNotifyList(
+	Connection* self,
+	struct list_head* readCompletionList
+	);
+
+void
+Connection_p_completePendingReadList(
+	Connection* self,
+	struct list_head* list
+	);
+
+void
+Connection_p_freePendingRead(PendingRead* read);
+
+size_t
+Connection_p_getRingSize(Connection* self);
+
+int
+Connection_p_replaceRingSet(
+	Connection* self,
+	NotifyRingSet* ringSet,
+	NotifyRingSet** prevRingSet
+	);
+
+bool
+Connection_p_hasRingData(Connection* self);
+
+const dm_NotifyHdr*
+Connection_p_findOldestRing(
+	Connection* self,
+	NotifyRing** ring,
+	size_t* notifySize
+	);
+
+ssize_t
+Connection_p_readRing_l(
+	Connection* self,
+	void __user* buffer_u,
+	size_t size
+	);
+
+ssize_t
+Connection_p_readRingMessage(
+	Connection* self,
+	void __user* buffer_u,
+	size_t size
+	);
+
+ssize_t
+Connection_p_readRingStream(
+	Connection* self,
+	void __user* buffer_u,
+	size_t size
+	);
+
+ssize_t
+Connection_p_readRingBatch(
+	Connection* self,
+	void __user* buffer_u,
+	size_t size
+	);
+
+size_t
+Connection_p_prepareParamBlocks(
+	Connection* self,
+	uint16_t code,
+	MemBlock* blockArray, // [3]
+	struct iov_iter* iterArray, // [2]
+	const MemBlock* paramBlockArray,
+	size_t paramBlockCount
+	);
+
+bool
+Connection_p_runBpfFilter(
+	Connection* self,
+	uint16_t code,
+	int result,
+	uint32_t pid,
+	uint32_t tid,
+	uint64_t timestamp,
+	MemBlock* paramBlockArray,
+	size_t* paramBlockCount,
+	size_t* paramSize
+	);
 
 bool
 Connection_p_preIoctlNotify(
@@ -0,0 +1,245 @@
+#include "pch.h"
+#include "CounterMap.h"
+#include "ScatterGather.h"
+
+//..............................................................................
+
+static
+void
+CounterMap_p_deleteChain(CounterEntry* entry)
+{
+	CounterEntry* next;
+
+	for (; entry; entry = next)
+	{
+		next = entry->m_next;
+		kfree(entry);
+	}
+}
+
+static
+CounterEntry*
+CounterMap_p_findEntry(
+	CounterMap* self,
+	HashTableEntry* hashEntry,
+	struct file* filp,
+	uint32_t tgid
+	)
+{
+	CounterEntry* entry;
+
+	for (entry = hashEntry->m_value; entry; entry = entry->m_next)
+		if (entry->m_counters.m_tgid == tgid)
+			return entry;
+
+	if (self->m_entryCount >= dm_CounterEntryCountLimit)
+		return NULL;
+
+	entry = kzalloc(sizeof(CounterEntry), GFP_ATOMIC);
+	if (!entry)
+		return NULL;
+
+	entry->m_counters.m_fileId = (uintptr_t)filp;
+	entry->m_counters.m_tgid = tgid;
+	entry->m_next = hashEntry->m_value;
+	hashEntry->m_value = entry;
+	self->m_entryCount++;
+	return entry;
+}
+
+static
+void
+CounterMap_p_retireChain(
+	CounterMap* self,
+	HashTableEntry* hashEntry
+	)
+{
+	CounterEntry* entry = hashEntry->m_value;
+
+	while (entry->m_next)
+		entry = entry->m_next;
+
+	entry->m_next = self->m_retiredList;
+	self->m_retiredList = hashEntry->m_value;
+	hashEntry->m_value = NULL;
+}
+
+// . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . .
+
+void
+CounterMap_construct(CounterMap* self)
+{
+	HashTable_construct(&self->m_fileMap, HashTableKeyType_Pointer, GFP_ATOMIC); // updated under a spinlock
+	self->m_retiredList = NULL;
+	self->m_entryCount = 0;
+}
+
+void
+CounterMap_destruct(CounterMap* self)
+{
+	CounterMap_clear(self);
+	HashTable_destruct(&self->m_fileMap);
+}
+
+void
+CounterMap_clear(CounterMap* self)
+{
+	struct list_head* link;
+	HashTableEntry* hashEntry;
+
+	for (link = self->m_fileMap.m_entryList.next; link != &self->m_fileMap.m_entryList; link = link->next)
+	{
+		hashEntry = container_of(link, HashTableEntry, m_hashTableLink);
+		CounterMap_p_deleteChain(hashEntry->m_value);
+	}
+
+	HashTable_clear(&self->m_fileMap);
+	CounterMap_p_deleteChain(self->m_retiredList);
+	self->m_retiredList = NULL;
+	self->m_entryCount = 0;
+}
+
+void
+CounterMap_update(
+	CounterMap* self,
+	struct file* filp,
+	uint32_t tgid,
+	uint16_t code,
+	int result,
+	uint64_t timestamp,
+	const MemBlock* paramBlockArray
+	)
+{
+	HashTableEntry* hashEntry;
+	CounterEntry* entry;
+	dm_Counters* counters;
+	const dm_ReadWriteNotifyParams* notifyParams;
+	uint64_t* opCountTable;
+	uint32_t dataSize;
+
+	hashEntry = HashTable_visit(&self->m_fileMap, filp);
+	if (!hashEntry)
+		return;
+
+	entry = hashEntry->m_value;
+	if (entry && (entry->m_counters.m_flags & dm_CountersFlag_Closed)) // the filp address was reused
+		CounterMap_p_retireChain(self, hashEntry);
+
+	entry = CounterMap_p_findEntry(self, hashEntry, filp, tgid);
+	if (!entry)
+		return;
+
+	counters = &entry->m_counters;
+	opCountTable = counters->m_opCountTable;
+
+	switch (code)
+	{
+	case dm_NotifyCode_Read:
+	case dm_NotifyCode_Write:
+	case dm_NotifyCode_ReadIter:
+	case dm_NotifyCode_WriteIter:
+		notifyParams = paramBlockArray[0].m_p;
+		dataSize = notifyParams->m_dataSize;
+
+		if (code == dm_NotifyCode_Read || code == dm_NotifyCode_ReadIter)
+			counters->m_readByteCount += dataSize;
+		else
+			counters->m_writeByteCount += dataSize;
+
+		if (result < 0) // failed transfers report 0 bytes; they only go to m_errorCount
+			break;
+
+		if (!(counters->m_flags & dm_CountersFlag_HasTransfers)) // the first successful transfer
+		{
+			counters->m_flags |= dm_CountersFlag_HasTransfers;
+			counters->m_minTransferSize = dataSize;
+			counters->m_maxTransferSize = dataSize;
+		}
+		else if (dataSize < counters->m_minTransferSize)
+		{
+			counters->m_minTransferSize = dataSize;
+		}
+		else if (dataSize > counters->m_maxTransferSize)
+		{
+			counters->m_maxTransferSize = dataSize;
+		}
+
+		break;
+
+	case dm_NotifyCode_Close: // the file is gone for all the processes sharing it
+		for (entry = hashEntry->m_value; entry; entry = entry->m_next)
+			entry->m_counters.m_flags |= dm_CountersFlag_Closed;
+
+		break;
+	}
+
+	opCountTable[code]++;
+
+	if (result < 0)
+		counters->m_errorCount++;
+
+	counters->m_lastTimestamp = timestamp;
+}
+
+size_t
+CounterMap_snapshot(
+	CounterMap* self,
+	dm_Counters* counterArray,
+	size_t count
+	)
+{
+	struct list_head* link;
+	HashTableEntry* hashEntry;
+	CounterEntry* entry;
+	size_t i = 0;
+
+	for (link = self->m_fileMap.m_entryList.next; link != &self->m_fileMap.m_entryList; link = link->next)
+	{
+		hashEntry = container_of(link, HashTableEntry, m_hashTableLink);
+		for (entry = hashEntry->m_value; entry && i < count; entry = entry->m_next)
+			counterArray[i++] = entry->m_counters;
+	}
+
+	for (entry = self->m_retiredList; entry && i < count; entry = entry->m_next)
+		counterArray[i++] = entry->m_counters;
+
+	return i;
+}
+
+// closed files stay around until they make it to a snapshot at least once
+
+void
+CounterMap_removeClosed(CounterMap* self)
+{
+	struct list_head* link;
+	struct list_head* next;
+	HashTableEntry* hashEntry;
+	CounterEntry* entry;
+	size_t count;
+
+	for (link = self->m_fileMap.m_entryList.next; link != &self->m_fileMap.m_entryList; link = next)
+	{
+		next = link->next;
+		hashEntry = container_of(link, HashTableEntry, m_hashTableLink);
+		entry = hashEntry->m_value;
+
+		if (entry && !(entry->m_counters.m_flags & dm_CountersFlag_Closed))
+			continue;
+
+		for (count = 0; entry; entry = entry->m_next)
+			count++;
+
+		CounterMap_p_deleteChain(hashEntry->m_value);
+		HashTable_remove(&self->m_fileMap, hashEntry);
+		self->m_entryCount -= count;
+	}
+
+	for (count = 0, entry = self->m_retiredList; entry; entry = entry->m_next)
+		count++;
+
+	CounterMap_p_deleteChain(self->m_retiredList);
+	self->m_retiredList = NULL;
+	self->m_entryCount -= count;
+}
+
+//..............................................................................
@@ -0,0 +1,66 @@
+#pragma once
+
+#include "dm_lnx_Protocol.h"
+#include "HashTable.h"
+#include "typedefs.h"
+
+typedef struct CounterEntry CounterEntry;
+typedef struct CounterMap   CounterMap;
+
+//..............................................................................
+
+struct CounterEntry
+{
+	CounterEntry* m_next; // same file, other processes
+	dm_Counters m_counters;
+};
+
+// . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . .
+
+// per-file per-process aggregates for dm_CaptureMode_Counters (the owner
+// serializes access with a spinlock, so allocations are atomic); files are
+// looked up in the hash table, processes sharing a file are chained (there
+// are rarely more than a few of them). a closed file's chain is retired as
+// soon as its filp address gets reused, so the new file starts from scratch
+// while the old counts still make it to the next snapshot
+
+struct CounterMap
+{
+	HashTable m_fileMap; // filp -> CounterEntry*
+	CounterEntry* m_retiredList; // closed chains, linked via m_next
+	size_t m_entryCount;
+};
+
+// . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . .
+
+void
+CounterMap_construct(CounterMap* self);
+
+void
+CounterMap_destruct(CounterMap* self);
+
+void
+CounterMap_clear(CounterMap* self);
+
+void
+CounterMap_update(
+	CounterMap* self,
+	struct file* filp,
+	uint32_t tgid,
+	uint16_t code,
+	int result,
+	uint64_t timestamp,
+	const MemBlock* paramBlockArray
+	);
+
+size_t
+CounterMap_snapshot(
+	CounterMap* self,
+	dm_Counters* counterArray,
+	size_t count
+	);
+
+void
+CounterMap_removeClosed(CounterMap* self);
+
+//..............................................................................
@@ -5,12 +5,48 @@
 #include "version.h"
 #include "lkmUtils.h"
 
+#include <linux/sort.h>
+
 DeviceClass g_deviceClass = { 0 };
 Device g_device = { 0 };
 umode_t g_devicePermissions = S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP;
 
 //..............................................................................
 
+HookArrayEntry*
+HookArray_find(
+	HookArray* self,
+	const struct file_operations* fops
+	)
+{
+	HookArrayEntry* entryArray;
+	size_t begin = 0;
+	size_t end;
+	size_t mid;
+
+	if (!self)
+		return NULL;
+
+	entryArray = HookArray_getEntryArray(self);
+	end = self->m_count;
+
+	while (begin < end)
+	{
+		mid = (begin + end) / 2;
+		if (entryArray[mid].m_fops == fops)
+			return &entryArray[mid];
+
+		if ((uintptr_t)entryArray[mid].m_fops < (uintptr_t)fops)
+			begin = mid + 1;
+		else
+			end = mid;
+	}
+
+	return NULL;
+}
+
+//..............................................................................
+
 int
 DeviceClass_register(DeviceClass* self)
 {
@@ -19,6 +55,7 @@ DeviceClass_register(DeviceClass* self)
 	self->m_fops.release = Device_fop_release;
 	self->m_fops.read = Device_fop_read;
 	self->m_fops.poll = Device_fop_poll;
+	self->m_fops.mmap = Device_fop_mmap;
 	self->m_fops.unlocked_ioctl = Device_fop_ioctl;
 	self->m_fops.compat_ioctl = Device_fop_ioctl;
 
@@ -74,9 +111,11 @@ Device_construct(Device* self)
 		return PTR_ERR(self->m_device);
 
 	mutex_init(&self->m_lock);
+	spin_lock_init(&self->m_connectionLock);
 	INIT_LIST_HEAD(&self->m_hookList);
 	self->m_hookCount = 0;
-	HashTable_construct(&self->m_hookMap, HashTableKeyType_Pointer, GFP_KERNEL);
+	PtrMap_construct(&self->m_hookMap, GFP_KERNEL);
+	RCU_INIT_POINTER(self->m_hookArray, NULL);
 
 	return 0;
 }
@@ -84,7 +123,8 @@ Device_construct(Device* self)
 void
 Device_destruct(Device* self)
 {
-	HashTable_destruct(&self->m_hookMap);
+	PtrMap_destruct(&self->m_hookMap);
+	kfree(rcu_dereference_protected(self->m_hookArray, true));
 	device_destroy(g_deviceClass.m_class, self->m_devId);
 	mutex_destroy(&self->m_lock);
 }
@@ -96,7 +136,8 @@ Device_addHook(
 	Hook** prevHook
 	)
 {
-	HashTableEntry* entry;
+	int result;
+	PtrMapSlot* slot;
 
 	mutex_lock(&self->m_lock);
 	if (self->m_state != DeviceState_Normal)
@@ -105,15 +146,15 @@ Device_addHook(
 		return -EBADFD;
 	}
 
-	entry = HashTable_visit(&self->m_hookMap, hook->m_fops);
-	if (!entry)
+	slot = PtrMap_visit(&self->m_hookMap, hook->m_fops);
+	if (!slot)
 	{
 		mutex_unlock(&self->m_lock);
 		return -ENOMEM;
 	}
-	else if (entry->m_value)
+	else if (slot->m_value)
 	{
-		hook = entry->m_value;
+		hook = slot->m_value;
 		Hook_addRef(hook);
 		mutex_unlock(&self->m_lock);
 
@@ -121,11 +162,21 @@ Device_addHook(
 		return EEXIST; // positive errno, not an error
 	}
 
-	hook->m_mapEntry = entry;
-	entry->m_value = hook;
-	Hook_addRef(hook);
+	slot->m_value = hook;
 	list_add_tail(&hook->m_link, &self->m_hookList);
 	self->m_hookCount++;
+
+	result = Device_p_rebuildHookArray(self);
+	if (result != 0)
+	{
+		PtrMap_remove(&self->m_hookMap, hook->m_fops);
+		list_del(&hook->m_link);
+		self->m_hookCount--;
+		mutex_unlock(&self->m_lock);
+		return result;
+	}
+
+	Hook_addRef(hook);
 	mutex_unlock(&self->m_lock);
 
 	*prevHook = NULL;
@@ -138,8 +189,14 @@ Device_removeHook(
 	Hook* hook
 	)
 {
+	HookArrayEntry* entry;
+
 	mutex_lock(&self->m_lock);
-	HashTable_remove(&self->m_hookMap, hook->m_mapEntry);
+	entry = HookArray_find(rcu_dereference_protected(self->m_hookArray, lockdep_is_held(&self->m_lock)), hook->m_fops);
+	ASSERT(entry && entry->m_hook == hook);
+	WRITE_ONCE(entry->m_hook, NULL); // the array will be compacted on the next rebuild
+
+	PtrMap_remove(&self->m_hookMap, hook->m_fops);
 	list_del(&hook->m_link);
 	self->m_hookCount--;
 	mutex_unlock(&self->m_lock);
@@ -153,15 +210,71 @@ Device_findHookAddRef(
 	const struct file_operations* fops
 	)
 {
+	HookArray* array;
+	HookArrayEntry* entry;
+	Hook* hook = NULL;
+
+	rcu_read_lock();
+	array = rcu_dereference(self->m_hookArray);
+	entry = HookArray_find(array, fops);
+	if (entry)
+	{
+		hook = READ_ONCE(entry->m_hook);
+		if (hook && !Hook_addRefNotZero(hook)) // removed and being destroyed
+			hook = NULL;
+	}
+
+	rcu_read_unlock();
+	return hook;
+}
+
+static
+int
+HookArrayEntry_cmp(
+	const void* p1,
+	const void* p2
+	)
+{
+	uintptr_t fops1 = (uintptr_t)((const HookArrayEntry*)p1)->m_fops;
+	uintptr_t fops2 = (uintptr_t)((const HookArrayEntry*)p2)->m_fops;
+	return fops1 < fops2 ? -1 : fops1 > fops2 ? 1 : 0;
+}
+
+int
+Device_p_rebuildHookArray(Device* self)
+{
+	HookArray* array;
+	HookArray* prevArray;
+	HookArrayEntry* entryArray;
+	struct list_head* link;
 	Hook* hook;
+	size_t i = 0;
 
-	mutex_lock(&self->m_lock);
-	hook = HashTable_findValue(&self->m_hookMap, fops);
-	if (hook)
-		Hook_addRef(hook);
+	array = kmalloc(sizeof(HookArray) + self->m_hookCount * sizeof(HookArrayEntry), GFP_KERNEL);
+	if (!array)
+		return -ENOMEM;
 
-	mutex_unlock(&self->m_lock);
-	return hook;
+	entryArray = HookArray_getEntryArray(array);
+
+	link = self->m_hookList.next;
+	for (; link != &self->m_hookList; link = link->next)
+	{
+		hook = container_of(link, Hook, m_link);
+		entryArray[i].m_fops = hook->m_fops;
+		entryArray[i].m_hook = hook;
+		i++;
+	}
+
+	array->m_count = i;
+	sort(entryArray, i, sizeof(HookArrayEntry), HookArrayEntry_cmp, NULL);
+
+	prevArray = rcu_dereference_protected(self->m_hookArray, lockdep_is_held(&self->m_lock));
+	rcu_assign_pointer(self->m_hookArray, array);
+
+	if (prevArray)
+		kfree_rcu(prevArray, m_rcu);
+
+	return 0;
 }
 
 // . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . .
@@ -259,12 +372,37 @@ Device_fop_poll(
 
 	poll_wait(filp, &connection->m_notificationWaitQueue, table);
 
-	mutex_lock(&connection->m_lock);
-
-	if (connection->m_pendingNotifyCount)
+	if (Connection_hasIncomingData(connection))
 		result = POLLIN | POLLRDNORM;
 
-	mutex_unlock(&connection->m_lock);
+	Connection_release(connection);
+	return result;
+}
+
+int
+Device_fop_mmap(
+	struct file* filp,
+	struct vm_area_struct* vma
+	)
+{
+	Device* self = &g_device;
+	int result;
+	Connection* connection;
+
+	// mmap_lock is held here, while m_lock is held when copying to user mode
+	// (which may fault and take mmap_lock), so we can't take m_lock
+
+	spin_lock(&self->m_connectionLock);
+	connection = filp->private_data;
+	if (connection)
+		Connection_addRef(connection);
+
+	spin_unlock(&self->m_connectionLock);
+
+	if (!connection) // not connected
+		return -ENOTCONN;
+
+	result = Connection_mmap(connection, vma);
 
 	Connection_release(connection);
 	return result;
@@ -326,6 +464,30 @@ Device_fop_ioctl(
 	case DM_IOCTL_SET_PENDING_NOTIFY_SIZE_LIMIT:
 	case DM_IOCTL_GET_READ_MODE:
 	case DM_IOCTL_SET_READ_MODE:
+	case DM_IOCTL_GET_CAPTURE_MODE:
+	case DM_IOCTL_SET_CAPTURE_MODE:
+	case DM_IOCTL_GET_NOTIFY_FORMAT:
+	case DM_IOCTL_SET_NOTIFY_FORMAT:
+	case DM_IOCTL_GET_COMPRESSION:
+	case DM_IOCTL_SET_COMPRESSION:
+	case DM_IOCTL_GET_PATH_MODE:
+	case DM_IOCTL_SET_PATH_MODE:
+	case DM_IOCTL_GET_FILE_PATH:
+	case DM_IOCTL_GET_IOCTL_ARG_MODE:
+	case DM_IOCTL_SET_IOCTL_ARG_MODE:
+	case DM_IOCTL_GET_RING_PARAMS:
+	case DM_IOCTL_SET_RING_PARAMS:
+	case DM_IOCTL_SET_READ_BUFFER:
+	case DM_IOCTL_GET_NEXT_NOTIFY_SIZE:
+	case DM_IOCTL_GET_SNAP_LENGTH:
+	case DM_IOCTL_SET_SNAP_LENGTH:
+	case DM_IOCTL_GET_NOTIFY_CODE_MASK:
+	case DM_IOCTL_SET_NOTIFY_CODE_MASK:
+	case DM_IOCTL_SET_PID_FILTER:
+	case DM_IOCTL_SET_BPF_FILTER:
+	case DM_IOCTL_GET_COUNTERS:
+	case DM_IOCTL_GET_SAMPLING_PARAMS:
+	case DM_IOCTL_SET_SAMPLING_PARAMS:
 	case DM_IOCTL_GET_FILE_NAME_FILTER:
 	case DM_IOCTL_SET_FILE_NAME_FILTER:
 	case DM_IOCTL_GET_IOCTL_DESC_TABLE:
@@ -700,7 +862,7 @@ Device_p_connectImpl(
 		return -EALREADY;
 	}
 
-	hook = HashTable_findValue(&self->m_hookMap, fops);
+	hook = PtrMap_findValue(&self->m_hookMap, fops);
 	if (hook)
 	{
 		Hook_addRef(hook);
@@ -749,7 +911,9 @@ Device_p_connectImpl(
 		return -EBUSY;
 	}
 
+	spin_lock(&self->m_connectionLock);
 	filp->private_data = connection;
+	spin_unlock(&self->m_connectionLock);
 	self->m_connectionCount++;
 
 	if (resultConnection)
@@ -811,6 +975,102 @@ Device_p_connectionIoctl(
 		result = Connection_setReadMode(connection, (dm_ReadMode)arg);
 		break;
 
+	case DM_IOCTL_GET_CAPTURE_MODE:
+		result = Connection_getCaptureMode(connection, (int __user*) arg);
+		break;
+
+	case DM_IOCTL_SET_CAPTURE_MODE:
+		result = Connection_setCaptureMode(connection, (dm_CaptureMode)arg);
+		break;
+
+	case DM_IOCTL_GET_NOTIFY_FORMAT:
+		result = Connection_getNotifyFormat(connection, (int __user*) arg);
+		break;
+
+	case DM_IOCTL_SET_NOTIFY_FORMAT:
+		result = Connection_setNotifyFormat(connection, (dm_NotifyFormat)arg);
+		break;
+
+	case DM_IOCTL_GET_COMPRESSION:
+		result = Connection_getCompression(connection, (int __user*) arg);
+		break;
+
+	case DM_IOCTL_SET_COMPRESSION:
+		result = Connection_setCompression(connection, (dm_Compression)arg);
+		break;
+
+	case DM_IOCTL_GET_PATH_MODE:
+		result = Connection_getPathMode(connection, (int __user*) arg);
+		break;
+
+	case DM_IOCTL_SET_PATH_MODE:
+		result = Connection_setPathMode(connection, (dm_PathMode)arg);
+		break;
+
+	case DM_IOCTL_GET_FILE_PATH:
+		result = Connection_getFilePath(connection, (dm_FilePath __user*) arg);
+		break;
+
+	case DM_IOCTL_GET_IOCTL_ARG_MODE:
+		result = Connection_getIoctlArgMode(connection, (int __user*) arg);
+		break;
+
+	case DM_IOCTL_SET_IOCTL_ARG_MODE:
+		result = Connection_setIoctlArgMode(connection, (dm_IoctlArgMode)arg);
+		break;
+
+	case DM_IOCTL_GET_RING_PARAMS:
+		result = Connection_getRingParams(connection, (dm_RingParams __user*) arg);
+		break;
+
+	case DM_IOCTL_SET_RING_PARAMS:
+		result = Connection_setRingParams(connection, (const dm_RingParams __user*) arg);
+		break;
+
+	case DM_IOCTL_SET_READ_BUFFER:
+		result = Connection_setReadBuffer(connection, (const dm_ReadBuffer __user*) arg);
+		break;
+
+	case DM_IOCTL_GET_NEXT_NOTIFY_SIZE:
+		result = Connection_getNextNotifySize(connection, (uint32_t __user*) arg);
+		break;
+
+	case DM_IOCTL_GET_SNAP_LENGTH:
+		result = Connection_getSnapLength(connection, (dm_SnapLength __user*) arg);
+		break;
+
+	case DM_IOCTL_SET_SNAP_LENGTH:
+		result = Connection_setSnapLength(connection, (const dm_SnapLength __user*) arg);
+		break;
+
+	case DM_IOCTL_GET_NOTIFY_CODE_MASK:
+		result = Connection_getNotifyCodeMask(connection, (uint32_t __user*) arg);
+		break;
+
+	case DM_IOCTL_SET_NOTIFY_CODE_MASK:
+		result = Connection_setNotifyCodeMask(connection, (uint32_t)arg);
+		break;
+
+	case DM_IOCTL_SET_PID_FILTER:
+		result = Connection_setPidFilter(connection, (const dm_PidFilter __user*) arg);
+		break;
+
+	case DM_IOCTL_SET_BPF_FILTER:
+		result = Connection_setBpfFilter(connection, (const dm_BpfProgram __user*) arg);
+		break;
+
+	case DM_IOCTL_GET_COUNTERS:
+		result = Connection_getCounters(connection, (dm_List __user*) arg);
+		break;
+
+	case DM_IOCTL_GET_SAMPLING_PARAMS:
+		result = Connection_getSamplingParams(connection, (dm_SamplingParams __user*) arg);
+		break;
+
+	case DM_IOCTL_SET_SAMPLING_PARAMS:
+		result = Connection_setSamplingParams(connection, (const dm_SamplingParams __user*) arg);
+		break;
+
 	case DM_IOCTL_GET_FILE_NAME_FILTER:
 		result = Connection_getFileNameFilter(connection, (dm_String __user*) arg);
 		break;
@@ -856,7 +1116,9 @@ Device_p_disconnect(
 	}
 
 	connection = filp->private_data;
+	spin_lock(&self->m_connectionLock);
 	filp->private_data = NULL;
+	spin_unlock(&self->m_connectionLock);
 	self->m_connectionCount--;
 	mutex_unlock(&self->m_lock);
 
@@ -893,7 +1155,7 @@ Device_p_unhook(
 		return -EBADFD;
 	}
 
-	hook = HashTable_findValue(&self->m_hookMap, targetFilp->f_op);
+	hook = PtrMap_findValue(&self->m_hookMap, targetFilp->f_op);
 	if (!hook)
 	{
 		mutex_unlock(&self->m_lock);
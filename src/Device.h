@@ -1,12 +1,14 @@
 #pragma once
 
-#include "HashTable.h"
+#include "PtrMap.h"
 #include "Hook.h"
 #include "dm_lnx_Protocol.h"
 
-typedef enum DeviceState   DeviceState;
-typedef struct DeviceClass DeviceClass;
-typedef struct Device      Device;
+typedef enum DeviceState      DeviceState;
+typedef struct DeviceClass    DeviceClass;
+typedef struct HookArrayEntry HookArrayEntry;
+typedef struct HookArray      HookArray;
+typedef struct Device         Device;
 
 //..............................................................................
 
@@ -45,14 +47,50 @@ enum DeviceState
 
 // . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . .
 
+struct HookArrayEntry
+{
+	const struct file_operations* m_fops;
+	Hook* m_hook; // NULL if removed (until the array is rebuilt)
+};
+
+// RCU-published snapshot of m_hookMap sorted by fops, so that hooked fops can
+// find their Hook without taking m_lock; it's rebuilt in Device_addHook, and
+// entries are cleared in-place in Device_removeHook
+
+struct HookArray
+{
+	struct rcu_head m_rcu;
+	size_t m_count;
+
+	// followed by HookArrayEntry [m_count]
+};
+
+static
+inline
+HookArrayEntry*
+HookArray_getEntryArray(HookArray* self)
+{
+	return (HookArrayEntry*)(self + 1);
+}
+
+HookArrayEntry*
+HookArray_find(
+	HookArray* self,
+	const struct file_operations* fops
+	);
+
+// . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . .
+
 struct Device
 {
 	struct device* m_device;
 	dev_t m_devId;
 
 	struct mutex m_lock;
+	spinlock_t m_connectionLock; // also guards filp->private_data for mmap (which can't take m_lock)
 	DeviceState m_state;
-	HashTable m_hookMap;
+	PtrMap m_hookMap;
+	HookArray __rcu* m_hookArray;
 	struct list_head m_hookList;
 	size_t m_hookCount;
 	size_t m_connectionCount;
@@ -80,6 +118,8 @@ Device_removeHook(
 	Hook* hook
 	);
 
+// lock-free (RCU)
+
 Hook*
 Device_findHookAddRef(
 	Device* self,
@@ -112,6 +152,12 @@ Device_fop_poll(
 	struct poll_table_struct* table
 	);
 
+int
+Device_fop_mmap(
+	struct file* filp,
+	struct vm_area_struct* vma
+	);
+
 long
 Device_fop_ioctl(
 	struct file* filp,
@@ -119,6 +165,9 @@ Device_fop_ioctl(
 	unsigned long arg
 	);
 
+int
+Device_p_rebuildHookArray(Device* self);
+
 int
 Device_p_getVersion(
 	Device* self,
@@ -3,6 +3,96 @@
 
 //..............................................................................
 
+static
+bool
+FileNameFilter_p_compilePattern(
+	FileNamePattern* pattern,
+	const char* wildcard
+	)
+{
+	const char* first;
+	size_t length;
+	size_t i;
+
+	pattern->m_isExclude = *wildcard == '!';
+	if (pattern->m_isExclude)
+		wildcard++;
+
+	if (!*wildcard) // empty, e.g. "a;;b"
+		return false;
+
+	length = strlen(wildcard);
+	first = strpbrk(wildcard, "*?");
+
+	pattern->m_wildcard = wildcard;
+	pattern->m_length = length;
+	pattern->m_minLength = length;
+
+	if (!first)
+	{
+		pattern->m_kind = FileNamePatternKind_Exact;
+		pattern->m_prefixLength = length;
+		pattern->m_suffixLength = length;
+		return true;
+	}
+
+	for (i = 0; i < length; i++)
+		if (wildcard[i] == '*')
+			pattern->m_minLength--;
+
+	pattern->m_prefixLength = first - wildcard;
+
+	for (i = length; i > 0 && wildcard[i - 1] != '*' && wildcard[i - 1] != '?'; i--)
+		;
+
+	pattern->m_suffixLength = length - i;
+
+	if (pattern->m_prefixLength == length - 1 && *first == '*')
+		pattern->m_kind = FileNamePatternKind_Prefix;
+	else if (pattern->m_suffixLength == length - 1 && *first == '*' && first == wildcard)
+		pattern->m_kind = FileNamePatternKind_Suffix;
+	else
+		pattern->m_kind = FileNamePatternKind_Wildcard;
+
+	return true;
+}
+
+static
+bool
+FileNameFilter_p_matchPattern(
+	const FileNamePattern* pattern,
+	const char* fileName, // lower-case
+	size_t length
+	)
+{
+	const char* suffix;
+
+	if (length < pattern->m_minLength)
+		return false;
+
+	suffix = pattern->m_wildcard + pattern->m_length - pattern->m_suffixLength;
+
+	switch (pattern->m_kind)
+	{
+	case FileNamePatternKind_Exact:
+		return length == pattern->m_length && memcmp(fileName, pattern->m_wildcard, length) == 0;
+
+	case FileNamePatternKind_Prefix:
+		return memcmp(fileName, pattern->m_wildcard, pattern->m_prefixLength) == 0;
+
+	case FileNamePatternKind_Suffix:
+		return memcmp(fileName + length - pattern->m_suffixLength, suffix, pattern->m_suffixLength) == 0;
+
+	default:
+		return
+			memcmp(fileName, pattern->m_wildcard, pattern->m_prefixLength) == 0 &&
+			memcmp(fileName + length - pattern->m_suffixLength, suffix, pattern->m_suffixLength) == 0 &&
+			wildcardCompareStringLowerCase(fileName, pattern->m_wildcard);
+	}
+}
+
+// . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . .
+
 int
 FileNameFilter_create(
 	FileNameFilter** resultFilter,
@@ -11,23 +101,77 @@ FileNameFilter_create(
 	)
 {
 	FileNameFilter* filter;
+	FileNamePattern* patternArray;
+	FileNamePattern pattern;
 	char* cachedWildcard;
+	char* patternBuffer;
+	char* p;
+	char* end;
+	const char* c;
+	size_t maxPatternCount = 1;
+	size_t patternCount = 0;
 
 	ASSERT(fileNameWildcard && *fileNameWildcard);
 
+	for (c = fileNameWildcard; *c; c++)
+		if (*c == ';')
+			maxPatternCount++;
+
+	if (maxPatternCount > dm_FileNamePatternCountLimit)
+		return -EINVAL;
+
 	cachedWildcard = createLowerCaseString(fileNameWildcard, kmallocFlags);
 	if (IS_ERR(cachedWildcard))
 		return PTR_ERR(cachedWildcard);
 
-	filter = kmalloc(sizeof(FileNameFilter), kmallocFlags);
+	patternBuffer = createDuplicateString(cachedWildcard, kmallocFlags);
+	if (IS_ERR(patternBuffer))
+	{
+		kfree(cachedWildcard);
+		return PTR_ERR(patternBuffer);
+	}
+
+	filter = kmalloc(sizeof(FileNameFilter) + maxPatternCount * sizeof(FileNamePattern), kmallocFlags);
 	if (!filter)
 	{
+		kfree(patternBuffer);
 		kfree(cachedWildcard);
 		return -ENOMEM;
 	}
 
+	patternArray = (FileNamePattern*)(filter + 1);
+	filter->m_includeCount = 0;
+
+	for (p = patternBuffer; p; p = end ? end + 1 : NULL)
+	{
+		end = strchr(p, ';');
+		if (end)
+			*end = 0;
+
+		if (!FileNameFilter_p_compilePattern(&patternArray[patternCount], p))
+			continue;
+
+		if (!patternArray[patternCount].m_isExclude) // includes go first
+		{
+			pattern = patternArray[patternCount];
+			patternArray[patternCount] = patternArray[filter->m_includeCount];
+			patternArray[filter->m_includeCount++] = pattern;
+		}
+
+		patternCount++;
+	}
+
+	if (!patternCount) // nothing but separators
+	{
+		kfree(filter);
+		kfree(patternBuffer);
+		kfree(cachedWildcard);
+		return -EINVAL;
+	}
+
 	filter->m_fileNameWildcard = cachedWildcard;
-	HashTable_construct(&filter->m_fileSet, HashTableKeyType_Pointer, kmallocFlags);
+	filter->m_patternBuffer = patternBuffer;
+	filter->m_patternCount = patternCount;
 	*resultFilter = filter;
 	return 0;
 }
@@ -37,48 +181,49 @@ FileNameFilter_delete(FileNameFilter* self)
 {
 	ASSERT(self->m_fileNameWildcard);
 
-	HashTable_destruct(&self->m_fileSet);
+	kfree(self->m_patternBuffer);
 	kfree(self->m_fileNameWildcard);
 	kfree(self);
 }
 
 bool
-FileNameFilter_checkFile(
+FileNameFilter_matchFileName(
 	FileNameFilter* self,
-	FileNameFilterReq req,
-	struct file* filp,
 	const char* fileName
 	)
 {
+	char buffer[FileNameFilterConst_NameBufferSize];
+	char* lowerCaseName;
+	const FileNamePattern* patternArray = FileNameFilter_getPatternArray(self);
 	bool isMatch;
+	size_t length;
+	size_t i;
 
-	switch (req)
+	length = strlen(fileName);
+	if (length < sizeof(buffer))
 	{
-	case FileNameFilterReq_Open:
-		ASSERT(fileName);
-		isMatch = wildcardCompareStringLowerCase(fileName, self->m_fileNameWildcard);
-		if (isMatch)
-			HashTable_visit(&self->m_fileSet, filp);
-		break;
-
-	case FileNameFilterReq_OpenError:
-		ASSERT(fileName);
-		isMatch = wildcardCompareStringLowerCase(fileName, self->m_fileNameWildcard);
-		break;
-
-	case FileNameFilterReq_Close:
-		isMatch = HashTable_removeKey(&self->m_fileSet, filp);
-		break;
-
-	case FileNameFilterReq_Other:
-		isMatch = HashTable_find(&self->m_fileSet, filp) != NULL;
-		break;
-
-	default:
-		ASSERT(false);
-		isMatch = false;
+		memcpy(buffer, fileName, length + 1);
+		convertStringToLowerCase(buffer);
+		lowerCaseName = buffer;
+	}
+	else
+	{
+		lowerCaseName = createLowerCaseString(fileName, GFP_ATOMIC);
+		if (IS_ERR(lowerCaseName))
+			return false;
 	}
 
+	isMatch = !self->m_includeCount;
+
+	for (i = 0; i < self->m_includeCount && !isMatch; i++)
+		isMatch = FileNameFilter_p_matchPattern(&patternArray[i], lowerCaseName, length);
+
+	for (i = self->m_includeCount; i < self->m_patternCount && isMatch; i++)
+		isMatch = !FileNameFilter_p_matchPattern(&patternArray[i], lowerCaseName, length);
+
+	if (lowerCaseName != buffer)
+		kfree(lowerCaseName);
+
 	return isMatch;
 }
 
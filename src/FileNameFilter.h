@@ -2,28 +2,61 @@
 
 #define _DM_NO_FSRTL
 
-#include "HashTable.h"
+#include "dm_lnx_Protocol.h"
 #include "stringUtils.h"
 
-typedef enum FileNameFilterReq FileNameFilterReq;
-typedef struct FileNameFilter  FileNameFilter;
+typedef enum FileNamePatternKind FileNamePatternKind;
+typedef struct FileNamePattern   FileNamePattern;
+typedef struct FileNameFilter    FileNameFilter;
 
 //..............................................................................
 
-enum FileNameFilterReq
+enum FileNameFilterConst
 {
-	FileNameFilterReq_Open,
-	FileNameFilterReq_OpenError,
-	FileNameFilterReq_Close,
-	FileNameFilterReq_Other,
+	FileNameFilterConst_NameBufferSize = 128, // same as in createPathString
 };
 
-//..............................................................................
+// . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . .
+
+enum FileNamePatternKind
+{
+	FileNamePatternKind_Exact,    // no wildcards at all
+	FileNamePatternKind_Prefix,   // literal*
+	FileNamePatternKind_Suffix,   // *literal
+	FileNamePatternKind_Wildcard, // anything else; prefix/suffix/length are checked first
+};
+
+// . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . .
+
+struct FileNamePattern
+{
+	const char* m_wildcard; // lower-case, points into m_patternBuffer
+	FileNamePatternKind m_kind;
+	bool m_isExclude;
+	size_t m_length;
+	size_t m_prefixLength; // literal chars before the first wildcard char
+	size_t m_suffixLength; // literal chars after the last wildcard char
+	size_t m_minLength; // chars other than '*'
+};
+
+// . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . .
+
+// ';'-separated wildcards, '!' marks an exclusion; a name matches if it
+// matches any include (or there are none) and no exclude. patterns are split
+// and classified once, on create; a check lower-cases the name once and
+// mostly gets away with a memcmp per pattern
+
+// filters are immutable, so they are published via RCU and replaced as a
+// whole; the files opened through a filter are tracked by the hook
 
 struct FileNameFilter
 {
-	char* m_fileNameWildcard;
-	HashTable m_fileSet;
+	char* m_fileNameWildcard; // the whole lower-case string (as set)
+	char* m_patternBuffer; // ditto, split on ';'
+	size_t m_includeCount;
+	size_t m_patternCount;
+
+	// followed by FileNamePattern [m_patternCount]
 };
 
 // . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . .
@@ -38,11 +71,17 @@ FileNameFilter_create(
 void
 FileNameFilter_delete(FileNameFilter* self);
 
+static
+inline
+const FileNamePattern*
+FileNameFilter_getPatternArray(const FileNameFilter* self)
+{
+	return (const FileNamePattern*)(self + 1);
+}
+
 bool
-FileNameFilter_checkFile(
+FileNameFilter_matchFileName(
 	FileNameFilter* self,
-	FileNameFilterReq req,
-	struct file* filp,
 	const char* fileName
 	);
 
@@ -1,5 +1,6 @@
 #include "pch.h"
 #include "HashTable.h"
+#include "MemCache.h"
 
 //..............................................................................
 
@@ -40,6 +41,9 @@ HashTable_construct(
 	self->m_entryCount = 0;
 	self->m_bucketArray = NULL;
 	self->m_bucketCount = 0;
+	self->m_oldBucketArray = NULL;
+	self->m_oldBucketCount = 0;
+	self->m_rehashIdx = 0;
 	self->m_keyType = keyType;
 	self->m_kmallocFlags = kmallocFlags;
 }
@@ -60,37 +64,33 @@ HashTable_getHash(
 	const void* key
 	)
 {
-	return self->m_keyType == HashTableKeyType_String ? strdjb2(key) : (size_t)key;
+	// pointers are aligned, so the low bits must be mixed in before masking
+
+	return self->m_keyType == HashTableKeyType_String ? strdjb2(key) : hash_ptr(key, 32);
 }
 
 void
 HashTable_clear(HashTable* self)
 {
-	size_t i;
-
 	while (!list_empty(&self->m_entryList))
 	{
 		struct list_head* link = self->m_entryList.next;
 		HashTableEntry* entry = container_of(link, HashTableEntry, m_hashTableLink);
 		list_del(link);
-		kfree(entry);
+		MemCache_freeHashTableEntry(entry);
 	}
 
 	self->m_entryCount = 0;
 
 	if (self->m_bucketCount)
-	{
-		for (i = 0; i < self->m_bucketCount; i++)
-		{
-			HashTableBucket* bucket = self->m_bucketArray[i];
-			if (bucket)
-			{
-				self->m_bucketArray[i] = NULL;
-				kfree(bucket);
-			}
-		}
+		memset(self->m_bucketArray, 0, self->m_bucketCount * sizeof(struct hlist_head));
 
-		memset(self->m_bucketArray, 0, self->m_bucketCount * sizeof(HashTableBucket*));
+	if (self->m_oldBucketArray)
+	{
+		kfree(self->m_oldBucketArray);
+		self->m_oldBucketArray = NULL;
+		self->m_oldBucketCount = 0;
+		self->m_rehashIdx = 0;
 	}
 }
 
@@ -101,14 +101,32 @@ HashTable_find(
 	)
 {
 	size_t hash;
-	HashTableBucket* bucket;
+	HashTableEntry* entry;
 
 	if (!self->m_bucketCount)
 		return NULL;
 
 	hash = HashTable_getHash(self, key);
-	bucket = self->m_bucketArray[hash % self->m_bucketCount];
-	return bucket ?	HashTable_p_findEntryInBucket(self, bucket, key) : NULL;
+
+	if (self->m_oldBucketArray) // already migrated buckets are empty
+	{
+		entry = HashTable_p_findEntryInBucket(
+			self,
+			&self->m_oldBucketArray[hash & (self->m_oldBucketCount - 1)],
+			key,
+			hash
+			);
+
+		if (entry)
+			return entry;
+	}
+
+	return HashTable_p_findEntryInBucket(
+		self,
+		&self->m_bucketArray[hash & (self->m_bucketCount - 1)],
+		key,
+		hash
+		);
 }
 
 void
@@ -117,22 +135,18 @@ HashTable_remove(
 	HashTableEntry* entry
 	)
 {
-	HashTableBucket* bucket = entry->m_bucket;
-	ASSERT(bucket->m_hashTable == self && self->m_bucketArray[bucket->m_bucketIdx] == bucket);
-
 	list_del(&entry->m_hashTableLink);
+	hlist_del(&entry->m_bucketLink);
 	self->m_entryCount--;
 
-	list_del(&entry->m_bucketLink);
-	bucket->m_entryCount--;
-
-	kfree(entry);
+	MemCache_freeHashTableEntry(entry);
 
-	if (!bucket->m_entryCount)
-	{
-		self->m_bucketArray[bucket->m_bucketIdx] = NULL;
-		kfree(bucket);
-	}
+	if (self->m_oldBucketArray)
+		HashTable_p_rehashStep(self);
+	else if (
+		self->m_bucketCount > HashTableConst_InitialBucketCount &&
+		self->m_entryCount * 100 < self->m_bucketCount * HashTableConst_ShrinkThreshold)
+		HashTable_p_resize(self, self->m_bucketCount / 2); // if it fails, we just stay bigger
 }
 
 HashTableEntry*
@@ -142,50 +156,38 @@ HashTable_visit(
 	)
 {
 	bool result;
-
 	size_t hash;
-	size_t i;
-	HashTableBucket* bucket;
 	HashTableEntry* entry;
 
-	result = HashTable_p_prepareBucketArray(self);
-	if (!result)
-		return NULL;
-
-	hash = HashTable_getHash(self, key);
-	i = hash % self->m_bucketCount;
-	bucket = self->m_bucketArray[i];
-	if (!bucket)
+	if (!self->m_bucketCount)
 	{
-		bucket = kmalloc(sizeof(HashTableBucket), self->m_kmallocFlags);
-		if (!bucket)
+		result = HashTable_p_resize(self, HashTableConst_InitialBucketCount);
+		if (!result)
 			return NULL;
-
-		bucket->m_hashTable = self;
-		bucket->m_bucketIdx = i;
-		bucket->m_entryCount = 0;
-		INIT_LIST_HEAD(&bucket->m_entryList);
-
-		self->m_bucketArray[i] = bucket;
 	}
 
-	entry = HashTable_p_findEntryInBucket(self, bucket, key);
+	entry = HashTable_find(self, key);
 	if (entry)
 		return entry;
 
-	entry = kmalloc(sizeof(HashTableEntry), self->m_kmallocFlags);
+	entry = MemCache_allocHashTableEntry(self->m_kmallocFlags);
 	if (!entry)
 		return NULL;
 
+	hash = HashTable_getHash(self, key);
+
 	entry->m_key = key;
-	entry->m_bucket = bucket;
+	entry->m_hash = hash;
 	entry->m_value = NULL;
 
 	list_add_tail(&entry->m_hashTableLink, &self->m_entryList);
+	hlist_add_head(&entry->m_bucketLink, &self->m_bucketArray[hash & (self->m_bucketCount - 1)]);
 	self->m_entryCount++;
 
-	list_add_tail(&entry->m_bucketLink, &bucket->m_entryList);
-	bucket->m_entryCount++;
+	if (self->m_oldBucketArray)
+		HashTable_p_rehashStep(self);
+	else if (self->m_entryCount * 100 > self->m_bucketCount * HashTableConst_GrowThreshold)
+		HashTable_p_resize(self, self->m_bucketCount * 2); // if it fails, we just get longer chains
 
 	return entry;
 }
@@ -210,67 +212,91 @@ HashTable_insert(
 }
 
 bool
-HashTable_p_prepareBucketArray(HashTable* self)
+HashTable_p_resize(
+	HashTable* self,
+	size_t bucketCount
+	)
 {
-	uint64_t loadFactor;
+	size_t size = bucketCount * sizeof(struct hlist_head);
+	struct hlist_head* bucketArray;
 
-	if (!self->m_bucketCount)
-	{
-		size_t size = HashTableConst_InitialBucketCount * sizeof(HashTableBucket*);
+	ASSERT(!self->m_oldBucketArray && is_power_of_2(bucketCount));
 
-		ASSERT(!self->m_bucketArray);
-		self->m_bucketArray = kmalloc(size, self->m_kmallocFlags);
-		if (!self->m_bucketArray)
-			return false;
+	bucketArray = kmalloc(size, self->m_kmallocFlags);
+	if (!bucketArray)
+		return false;
 
-		memset(self->m_bucketArray, 0, size);
-		self->m_bucketCount = HashTableConst_InitialBucketCount;
+	memset(bucketArray, 0, size); // all-zero is an empty hlist_head
+
+	if (self->m_bucketCount) // the current array becomes the old one
+	{
+		self->m_oldBucketArray = self->m_bucketArray;
+		self->m_oldBucketCount = self->m_bucketCount;
+		self->m_rehashIdx = 0;
 	}
 
-	loadFactor = (uint64_t)self->m_entryCount * 100;
-	do_div(loadFactor, self->m_bucketCount);
+	self->m_bucketArray = bucketArray;
+	self->m_bucketCount = bucketCount;
+
+	if (self->m_oldBucketArray)
+		HashTable_p_rehashStep(self);
+
+	return true;
+}
+
+void
+HashTable_p_rehashStep(HashTable* self)
+{
+	struct hlist_head* bucket;
+	HashTableEntry* entry;
+	size_t i;
+
+	ASSERT(self->m_oldBucketArray);
 
-	if (loadFactor > HashTableConst_ResizeThreshold)
+	for (i = 0; i < HashTableConst_RehashStep && self->m_rehashIdx < self->m_oldBucketCount; i++)
 	{
-		size_t count = self->m_bucketCount * 2;
-		size_t size = count * sizeof(HashTableBucket*);
-		size_t oldSize = self->m_bucketCount * sizeof(HashTableBucket*);
-		HashTableBucket** bucketArray = kmalloc(size, self->m_kmallocFlags);
-		if (!bucketArray)
-			return false;
-
-		memset(bucketArray, 0, size);
-		memcpy(bucketArray, self->m_bucketArray, oldSize);
-		self->m_bucketArray = bucketArray;
-		self->m_bucketCount = count;
+		bucket = &self->m_oldBucketArray[self->m_rehashIdx++];
+		while (!hlist_empty(bucket))
+		{
+			entry = hlist_entry(bucket->first, HashTableEntry, m_bucketLink);
+			hlist_del(&entry->m_bucketLink);
+			hlist_add_head(&entry->m_bucketLink, &self->m_bucketArray[entry->m_hash & (self->m_bucketCount - 1)]);
+		}
 	}
 
-	return true;
+	if (self->m_rehashIdx < self->m_oldBucketCount)
+		return;
+
+	kfree(self->m_oldBucketArray);
+	self->m_oldBucketArray = NULL;
+	self->m_oldBucketCount = 0;
+	self->m_rehashIdx = 0;
 }
 
 HashTableEntry*
 HashTable_p_findEntryInBucket(
 	HashTable* self,
-	HashTableBucket* bucket,
-	const void* key
+	const struct hlist_head* bucket,
+	const void* key,
+	size_t hash
 	)
 {
-	struct list_head* link = bucket->m_entryList.next;
+	struct hlist_node* node = bucket->first;
 
 	if (self->m_keyType == HashTableKeyType_String)
 	{
-		for (; link != &bucket->m_entryList; link = link->next)
+		for (; node; node = node->next)
 		{
-			HashTableEntry* entry = container_of(link, HashTableEntry, m_bucketLink);
-			if (strcmp(entry->m_key, key) == 0)
+			HashTableEntry* entry = hlist_entry(node, HashTableEntry, m_bucketLink);
+			if (entry->m_hash == hash && strcmp(entry->m_key, key) == 0)
 				return entry;
 		}
 	}
 	else
 	{
-		for (; link != &bucket->m_entryList; link = link->next)
+		for (; node; node = node->next)
 		{
-			HashTableEntry* entry = container_of(link, HashTableEntry, m_bucketLink);
+			HashTableEntry* entry = hlist_entry(node, HashTableEntry, m_bucketLink);
 			if (entry->m_key == key)
 				return entry;
 		}
@@ -1,9 +1,8 @@
 #pragma once
 
-typedef enum HashTableKeyType  HashTableKeyType;
-typedef struct HashTableEntry  HashTableEntry;
-typedef struct HashTableBucket HashTableBucket;
-typedef struct HashTable       HashTable;
+typedef enum HashTableKeyType HashTableKeyType;
+typedef struct HashTableEntry HashTableEntry;
+typedef struct HashTable      HashTable;
 
 //..............................................................................
 
@@ -17,8 +16,10 @@ enum HashTableKeyType
 
 enum HashTableConst
 {
-	HashTableConst_InitialBucketCount      = 16,
-	HashTableConst_ResizeThreshold         = 75,
+	HashTableConst_InitialBucketCount = 16, // always a power of 2
+	HashTableConst_GrowThreshold      = 75, // load factor, %
+	HashTableConst_ShrinkThreshold    = 10,
+	HashTableConst_RehashStep         = 16, // old buckets migrated per insert/remove
 };
 
 // . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . .
@@ -26,32 +27,31 @@ enum HashTableConst
 struct HashTableEntry
 {
 	struct list_head m_hashTableLink;
-	struct list_head m_bucketLink;
+	struct hlist_node m_bucketLink;
 
-	HashTableBucket* m_bucket;
+	size_t m_hash; // so rehashing never touches the keys
 	const void* m_key;
 	void* m_value;
 };
 
 // . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . .
 
-struct HashTableBucket
-{
-	HashTable* m_hashTable;
-	struct list_head m_entryList;
-	size_t m_entryCount;
-	size_t m_bucketIdx;
-};
-
-// . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . .
+// a resize doesn't move everything at once: entries migrate from the old
+// bucket array a few buckets per insert/remove, so no single call (e.g. a
+// visit on the notify path) pays for the whole table; until then, lookups
+// check both arrays. lookups never migrate anything, so a table may be
+// searched under whatever lock guards it for reading
 
 struct HashTable
 {
 	HashTableKeyType m_keyType;
 	struct list_head m_entryList;
 	size_t m_entryCount;
-	HashTableBucket** m_bucketArray;
-	size_t m_bucketCount;
+	struct hlist_head* m_bucketArray;
+	size_t m_bucketCount; // a power of 2 (or 0 before the first visit)
+	struct hlist_head* m_oldBucketArray; // non-NULL while rehashing
+	size_t m_oldBucketCount;
+	size_t m_rehashIdx; // the next old bucket to migrate
 	int m_kmallocFlags;
 };
 
@@ -123,13 +123,20 @@ HashTable_insert(
 // . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . .
 
 bool
-HashTable_p_prepareBucketArray(HashTable* self);
+HashTable_p_resize(
+	HashTable* self,
+	size_t bucketCount
+	);
+
+void
+HashTable_p_rehashStep(HashTable* self);
 
 HashTableEntry*
 HashTable_p_findEntryInBucket(
 	HashTable* self,
-	HashTableBucket* bucket,
-	const void* key
+	const struct hlist_head* bucket,
+	const void* key,
+	size_t hash
 	);
 
 //..............................................................................
@@ -26,18 +26,34 @@ Hook_create(
 	if (!newHook)
 		return -ENOMEM;
 
+	result = init_srcu_struct(&newHook->m_connectionListSrcu);
+	if (result != 0)
+	{
+		kfree(newHook);
+		return result;
+	}
+
 	mutex_init(&newHook->m_lock);
 	INIT_LIST_HEAD(&newHook->m_connectionList);
 	newHook->m_state = HookState_Normal;
 	newHook->m_fops = fops;
 	newHook->m_originalModule = module;
 	newHook->m_connectionCount = 0;
+	newHook->m_connectionSlotMask = 0;
+	memset((void*)newHook->m_enabledConnectionCountTable, 0, sizeof(newHook->m_enabledConnectionCountTable));
 	newHook->m_refCount = 1;
+	spin_lock_init(&newHook->m_pathCacheLock);
+	memset(newHook->m_pathCache, 0, sizeof(newHook->m_pathCache));
+	newHook->m_pathCacheNextIdx = 0;
+	spin_lock_init(&newHook->m_fileMapLock);
+	PtrMap_construct(&newHook->m_fileMap, GFP_ATOMIC);
 
 	result = Device_addHook(&g_device, newHook, &prevHook);
 	if (result < 0 || prevHook) // may return +EEXIST
 	{
+		cleanup_srcu_struct(&newHook->m_connectionListSrcu);
 		mutex_destroy(&newHook->m_lock);
+		PtrMap_destruct(&newHook->m_fileMap);
 		kfree(newHook);
 		*resultHook = prevHook;
 		return result;
@@ -115,8 +131,10 @@ Hook_release(Hook* self)
 
 	mutex_unlock(&self->m_lock);
 	mutex_destroy(&self->m_lock);
+	cleanup_srcu_struct(&self->m_connectionListSrcu);
+	PtrMap_destruct(&self->m_fileMap);
 	kfree(self->m_originalPath);
-	kfree(self);
+	kfree_rcu(self, m_rcu); // Device_findHookAddRef may still be looking at us
 	return 0;
 }
 
@@ -203,6 +221,39 @@ Hook_remove(Hook* self)
 	return true;
 }
 
+// open and close are always enabled -- file name filters rely on them to
+// maintain their file sets (see Hook_p_notify)
+
+void
+Hook_enableNotifyCodes(
+	Hook* self,
+	uint notifyCodeMask
+	)
+{
+	uint16_t code;
+
+	notifyCodeMask |= (1 << dm_NotifyCode_Open) | (1 << dm_NotifyCode_Close);
+
+	for (code = 0; code < dm_NotifyCode__Count; code++)
+		if (notifyCodeMask & (1 << code))
+			atomicInc(&self->m_enabledConnectionCountTable[code]);
+}
+
+void
+Hook_disableNotifyCodes(
+	Hook* self,
+	uint notifyCodeMask
+	)
+{
+	uint16_t code;
+
+	notifyCodeMask |= (1 << dm_NotifyCode_Open) | (1 << dm_NotifyCode_Close);
+
+	for (code = 0; code < dm_NotifyCode__Count; code++)
+		if (notifyCodeMask & (1 << code))
+			atomicDec(&self->m_enabledConnectionCountTable[code]);
+}
+
 int
 Hook_addConnection(
 	Hook* self,
@@ -224,8 +275,13 @@ Hook_addConnection(
 
 	printk(KERN_INFO "tdevmon: adding connection %p to %s (inodep: %p)\n", connection, self->m_originalPath, connection->m_inode);
 
-	Connection_addRef(connection);
-	list_add_tail(&connection->m_hookLink, &self->m_connectionList);
+	for (connection->m_hookSlot = 0; self->m_connectionSlotMask & (1 << connection->m_hookSlot); connection->m_hookSlot++)
+		; // there is always a free one -- dm_ConnectionCountLimit
+
+	self->m_connectionSlotMask |= 1 << connection->m_hookSlot;
+
+	Connection_addRef(connection); // this reference protects notify-path readers
+	list_add_tail_rcu(&connection->m_hookLink, &self->m_connectionList);
 	self->m_connectionCount++;
 	mutex_unlock(&self->m_lock);
 
@@ -239,15 +295,75 @@ Hook_removeConnection(
 	)
 {
 	mutex_lock(&self->m_lock);
-	list_del(&connection->m_hookLink);
+	list_del_rcu(&connection->m_hookLink);
 	self->m_connectionCount--;
 	mutex_unlock(&self->m_lock);
 
 	printk(KERN_INFO "tdevmon: removing connection %p from %s (inodep: %p)\n", connection, self->m_originalPath, connection->m_inode);
 
+	synchronize_srcu(&self->m_connectionListSrcu); // wait for Hook_p_notify-s still looking at it
+	Hook_clearConnectionFiles(self, connection); // only now the slot can't get new files
+
+	mutex_lock(&self->m_lock);
+	self->m_connectionSlotMask &= ~(1 << connection->m_hookSlot);
+	mutex_unlock(&self->m_lock);
+
 	Connection_release(connection);
 }
 
+void
+Hook_clearConnectionFiles(
+	Hook* self,
+	Connection* connection
+	)
+{
+	PtrMapSlot* slot;
+	uint mask = 1 << connection->m_hookSlot;
+	size_t i;
+
+	// entries left with an empty mask are removed on close (even if nobody
+	// is subscribed to it) or on the next open of the same filp
+
+	spin_lock(&self->m_fileMapLock);
+
+	for (i = 0; i < self->m_fileMap.m_slotCount; i++)
+	{
+		slot = &self->m_fileMap.m_slotArray[i];
+		if (slot->m_key)
+			slot->m_value = (void*)((uintptr_t)slot->m_value & ~mask);
+	}
+
+	spin_unlock(&self->m_fileMapLock);
+}
+
+bool
+Hook_getConnectionFilePath(
+	Hook* self,
+	Connection* connection,
+	struct file* filp,
+	struct path* path
+	)
+{
+	uint mask;
+
+	// the filp is only dereferenced while it's in the map, i.e. still open
+	// (it's removed on close under the same lock)
+
+	spin_lock(&self->m_fileMapLock);
+
+	mask = (uint)(uintptr_t)PtrMap_findValue(&self->m_fileMap, filp);
+	if (!(mask & (1 << connection->m_hookSlot)))
+	{
+		spin_unlock(&self->m_fileMapLock);
+		return false;
+	}
+
+	*path = filp->f_path;
+	path_get(path);
+	spin_unlock(&self->m_fileMapLock);
+	return true;
+}
+
 // . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . .
 
 int
@@ -259,8 +375,11 @@ Hook_fop_open(
 	int result;
 	Hook* self;
 	dm_OpenNotifyParams notifyParams;
-	MemBlock paramBlockArray[2];
-	char* path;
+	dm_FileKey fileKey;
+	MemBlock paramBlockArray[3];
+	char pathBuffer[HookConst_MaxPathLength];
+	const char* path;
+	bool isFileNameNeeded;
 
 	self = Device_findHookAddRef(&g_device, filp->f_op);
 	if (!self)
@@ -275,25 +394,35 @@ Hook_fop_open(
 	printk(KERN_INFO "tdevmon: open (inodep: %p, filp: %p) => %d\n", inodep, filp, result);
 #endif
 
-	if (!Hook_p_hasConnections(self, filp->f_inode)) // check before allocating path string
+	if (!Hook_isNotifyCodeEnabled(self, dm_NotifyCode_Open) || // fast path
+		!Hook_p_hasConnections(self, filp->f_inode, &isFileNameNeeded)) // check before resolving the path
 	{
 		Hook_release(self);
 		return result;
 	}
 
-	path = createPathString(&filp->f_path);
+	path = isFileNameNeeded ? Hook_p_getPathString(self, &filp->f_path, pathBuffer) : NULL;
+	if (!path)
+		path = "";
 
 	notifyParams.m_fileId = (uintptr_t)filp;
 	notifyParams.m_flags = filp->f_flags;
 	notifyParams.m_mode = filp->f_mode;
-	notifyParams.m_fileNameLength = path ? strlen(path) : 0;
+	notifyParams.m_fileNameLength = strlen(path);
+
+	fileKey.m_inode = filp->f_inode->i_ino;
+	fileKey.m_dev = new_encode_dev(filp->f_inode->i_sb->s_dev);
+	fileKey.m_rdev = new_encode_dev(filp->f_inode->i_rdev);
 
 	paramBlockArray[0].m_p = &notifyParams;
 	paramBlockArray[0].m_size = sizeof(notifyParams);
 	paramBlockArray[0].m_flags = 0;
-	paramBlockArray[1].m_p = path ? path : "";
+	paramBlockArray[1].m_p = path;
 	paramBlockArray[1].m_size = notifyParams.m_fileNameLength + 1;
 	paramBlockArray[1].m_flags = 0;
+	paramBlockArray[2].m_p = &fileKey; // only sent in dm_PathMode_Deferred
+	paramBlockArray[2].m_size = sizeof(fileKey);
+	paramBlockArray[2].m_flags = 0;
 
 	Hook_p_notify(
 		self,
@@ -301,11 +430,10 @@ Hook_fop_open(
 		dm_NotifyCode_Open,
 		result,
 		paramBlockArray,
-		2
+		3
 		);
 
 	Hook_release(self);
-	kfree(path);
 	return result;
 }
 
@@ -333,6 +461,13 @@ Hook_fop_release(
 	printk(KERN_INFO "tdevmon: release (inodep: %p, filp: %p) => %d\n", inodep, filp, result);
 #endif
 
+	if (!Hook_isNotifyCodeEnabled(self, dm_NotifyCode_Close)) // fast path
+	{
+		Hook_p_getFileMask(self, filp, true); // still forget the file -- the filp may be reused
+		Hook_release(self);
+		return result;
+	}
+
 	notifyParams.m_fileId = (uintptr_t)filp;
 
 	paramBlock.m_p = &notifyParams;
@@ -378,6 +513,12 @@ Hook_fop_read(
 	printk(KERN_INFO "tdevmon: read (filp: %p, buffer: %p, size: %zu, offset: %p) => %zu\n", filp, buffer_u, size, offset, result);
 #endif
 
+	if (!Hook_isNotifyCodeEnabled(self, dm_NotifyCode_Read)) // fast path
+	{
+		Hook_release(self);
+		return result;
+	}
+
 	notifyParams.m_fileId = (uintptr_t)filp;
 	notifyParams.m_offset = offset ? *offset : 0;
 	notifyParams.m_bufferSize = size;
@@ -429,6 +570,12 @@ Hook_fop_write(
 	printk(KERN_INFO "tdevmon: write (filp: %p, buffer: %p, size: %zu, offset: %p) => %zu\n", filp, buffer_u, size, offset, result);
 #endif
 
+	if (!Hook_isNotifyCodeEnabled(self, dm_NotifyCode_Write)) // fast path
+	{
+		Hook_release(self);
+		return result;
+	}
+
 	notifyParams.m_fileId = (uintptr_t)filp;
 	notifyParams.m_offset = offset ? *offset : 0;
 	notifyParams.m_bufferSize = size;
@@ -464,8 +611,8 @@ Hook_fop_read_iter(
 	Hook* self;
 	struct file* filp = iocb->ki_filp;
 	size_t size = iter->count;
-	struct iov_iter dupIter;
-	const void* dupIterVec;
+	struct iov_iter iterSnapshot;
+	bool hasIterSnapshot;
 	dm_ReadWriteNotifyParams notifyParams;
 	MemBlock paramBlockArray[2];
 
@@ -476,7 +623,16 @@ Hook_fop_read_iter(
 		return -ENOENT;
 	}
 
-	dupIterVec = dup_iter(&dupIter, iter, GFP_KERNEL);
+	if (!Hook_isNotifyCodeEnabled(self, dm_NotifyCode_ReadIter) || // fast path -- don't even snapshot the iterator
+		!Hook_p_hasConnections(self, filp->f_inode, NULL))
+	{
+		result = self->m_originalFops.read_iter(iocb, iter);
+		Hook_release(self);
+		return result;
+	}
+
+	hasIterSnapshot = snapshotIovIter(&iterSnapshot, iter); // no need to dup_iter
+
 	result = self->m_originalFops.read_iter(iocb, iter);
 
 #ifdef _DM_TRACE_FOPS
@@ -492,10 +648,8 @@ Hook_fop_read_iter(
 	paramBlockArray[0].m_size = sizeof(notifyParams);
 	paramBlockArray[0].m_flags = 0;
 
-	if (!dupIterVec)
+	if (!hasIterSnapshot) // e.g. a pipe (splice)
 	{
-		printk(KERN_WARNING "tdevmon: can't duplicate iov_iter for read_iter\n");
-
 		Hook_p_notify(
 			self,
 			filp,
@@ -507,7 +661,7 @@ Hook_fop_read_iter(
 	}
 	else
 	{
-		paramBlockArray[1].m_p = &dupIter;
+		paramBlockArray[1].m_p = &iterSnapshot;
 		paramBlockArray[1].m_size = notifyParams.m_dataSize;
 		paramBlockArray[1].m_flags = MemBlockFlag_IovIter;
 
@@ -519,8 +673,6 @@ Hook_fop_read_iter(
 			paramBlockArray,
 			2
 			);
-
-		kfree(dupIterVec);
 	}
 
 	Hook_release(self);
@@ -537,8 +689,8 @@ Hook_fop_write_iter(
 	Hook* self;
 	struct file* filp = iocb->ki_filp;
 	size_t size = iter->count;
-	struct iov_iter dupIter;
-	const void* dupIterVec;
+	struct iov_iter iterSnapshot;
+	bool hasIterSnapshot;
 	dm_ReadWriteNotifyParams notifyParams;
 	MemBlock paramBlockArray[2];
 
@@ -549,7 +701,16 @@ Hook_fop_write_iter(
 		return -ENOENT;
 	}
 
-	dupIterVec = dup_iter(&dupIter, iter, GFP_KERNEL);
+	if (!Hook_isNotifyCodeEnabled(self, dm_NotifyCode_WriteIter) || // fast path -- don't even snapshot the iterator
+		!Hook_p_hasConnections(self, filp->f_inode, NULL))
+	{
+		result = self->m_originalFops.write_iter(iocb, iter);
+		Hook_release(self);
+		return result;
+	}
+
+	hasIterSnapshot = snapshotIovIter(&iterSnapshot, iter); // no need to dup_iter
+
 	result = self->m_originalFops.write_iter(iocb, iter);
 
 #ifdef _DM_TRACE_FOPS
@@ -565,10 +726,8 @@ Hook_fop_write_iter(
 	paramBlockArray[0].m_size = sizeof(notifyParams);
 	paramBlockArray[0].m_flags = 0;
 
-	if (!dupIterVec)
+	if (!hasIterSnapshot) // e.g. a pipe (splice)
 	{
-		printk(KERN_WARNING "tdevmon: can't duplicate iov_iter for write_iter\n");
-
 		Hook_p_notify(
 			self,
 			filp,
@@ -580,7 +739,7 @@ Hook_fop_write_iter(
 	}
 	else
 	{
-		paramBlockArray[1].m_p = &dupIter;
+		paramBlockArray[1].m_p = &iterSnapshot;
 		paramBlockArray[1].m_size = notifyParams.m_dataSize;
 		paramBlockArray[1].m_flags = MemBlockFlag_IovIter;
 
@@ -592,8 +751,6 @@ Hook_fop_write_iter(
 			paramBlockArray,
 			2
 			);
-
-		kfree(dupIterVec);
 	}
 
 	Hook_release(self);
@@ -654,6 +811,48 @@ Hook_fop_compat_ioctl(
 
 // . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . .
 
+uint32_t
+HookIoctlContext_getArgSizeField(
+	HookIoctlContext* self,
+	const dm_IoctlDesc* ioctlDesc
+	)
+{
+	int result;
+	uint8_t buffer[4];
+	size_t size;
+	uint32_t flags;
+
+	flags = ioctlDesc->m_flags & (dm_IoctlFlag_ArgSizeField8 | dm_IoctlFlag_ArgSizeField16 | dm_IoctlFlag_ArgSizeFieldBigEndian);
+
+	if (self->m_isArgSizeFieldRead &&
+		self->m_argSizeFieldOffset == ioctlDesc->m_argSizeFieldOffset &&
+		self->m_argSizeFieldFlags == flags)
+		return self->m_argSizeFieldValue;
+
+	size =
+		(flags & dm_IoctlFlag_ArgSizeField8) ? 1 :
+		(flags & dm_IoctlFlag_ArgSizeField16) ? 2 : 4;
+
+	result = copy_from_user(buffer, (const void __user*)(uintptr_t)(self->m_params.m_arg + ioctlDesc->m_argSizeFieldOffset), size);
+	if (result != 0)
+		self->m_argSizeFieldValue = 0; // remember the failure, too
+	else if (size == 1)
+		self->m_argSizeFieldValue = buffer[0];
+	else if (size == 2)
+		self->m_argSizeFieldValue = (flags & dm_IoctlFlag_ArgSizeFieldBigEndian) ?
+			get_unaligned_be16(buffer) :
+			get_unaligned_le16(buffer);
+	else
+		self->m_argSizeFieldValue = (flags & dm_IoctlFlag_ArgSizeFieldBigEndian) ?
+			get_unaligned_be32(buffer) :
+			get_unaligned_le32(buffer);
+
+	self->m_argSizeFieldOffset = ioctlDesc->m_argSizeFieldOffset;
+	self->m_argSizeFieldFlags = flags;
+	self->m_isArgSizeFieldRead = true;
+	return self->m_argSizeFieldValue;
+}
+
 long
 Hook_p_postProcessIoctl(
 	Hook* self,
@@ -664,16 +863,23 @@ Hook_p_postProcessIoctl(
 	uint16_t notifyCode
 	)
 {
-	dm_IoctlNotifyParams notifyParams;
+	HookIoctlContext context;
 	MemBlock paramBlockArray[2]; // reserve one block for arg data
 
-	notifyParams.m_fileId = (uintptr_t)filp;
-	notifyParams.m_code = ioctlCode;
-	notifyParams.m_arg = arg;
-	notifyParams.m_argSize = 0; // may be changed per-connection
+	if (!Hook_isNotifyCodeEnabled(self, notifyCode)) // fast path
+	{
+		Hook_release(self);
+		return result;
+	}
 
-	paramBlockArray[0].m_p = &notifyParams;
-	paramBlockArray[0].m_size = sizeof(notifyParams);
+	context.m_params.m_fileId = (uintptr_t)filp;
+	context.m_params.m_code = ioctlCode;
+	context.m_params.m_arg = arg;
+	context.m_params.m_argSize = 0; // may be changed per-connection
+	context.m_isArgSizeFieldRead = false;
+
+	paramBlockArray[0].m_p = &context.m_params;
+	paramBlockArray[0].m_size = sizeof(dm_IoctlNotifyParams);
 	paramBlockArray[0].m_flags = 0;
 
 	Hook_p_notify(
@@ -692,33 +898,187 @@ Hook_p_postProcessIoctl(
 bool
 Hook_p_hasConnections(
 	Hook* self,
-	struct inode* inodep
+	struct inode* inodep,
+	bool* isFileNameNeeded
 	)
 {
-	struct list_head* link;
 	Connection* connection;
+	bool result = false;
+	int srcuIdx;
 
-	mutex_lock(&self->m_lock);
+	if (isFileNameNeeded)
+		*isFileNameNeeded = false;
 
-	for (
-		link = self->m_connectionList.next;
-		link != &self->m_connectionList;
-		link = link->next
-		)
+	srcuIdx = srcu_read_lock(&self->m_connectionListSrcu);
+
+	list_for_each_entry_rcu(connection, &self->m_connectionList, m_hookLink)
 	{
-		connection = container_of(link, Connection, m_hookLink);
+		if (connection->m_inode != inodep)
+			continue;
+
+		result = true;
+		if (!isFileNameNeeded)
+			break;
 
-		if (connection->m_inode == inodep)
+		if (connection->m_pathMode != dm_PathMode_Deferred ||
+			rcu_access_pointer(connection->m_fileNameFilter))
 		{
-			mutex_unlock(&self->m_lock);
-			return true;
+			*isFileNameNeeded = true;
+			break;
 		}
 	}
 
-	mutex_unlock(&self->m_lock);
-	return false;
+	srcu_read_unlock(&self->m_connectionListSrcu, srcuIdx);
+	return result;
 }
 
+// returns the mask of all the matching connections (whether they track files
+// or not); if the file is open, the tracking ones also get it in the file map
+
+uint
+Hook_p_matchOpenFile(
+	Hook* self,
+	struct file* filp,
+	const char* fileName,
+	bool isOpen
+	)
+{
+	Connection* connection;
+	PtrMapSlot* slot;
+	PtrMapSlot* growSlotArray;
+	size_t growSlotCount = 0;
+	uint matchMask = 0;
+	uint trackMask = 0;
+	uint mask;
+
+	list_for_each_entry_rcu(connection, &self->m_connectionList, m_hookLink) // under m_connectionListSrcu
+	{
+		if (!Connection_checkOpenFile(connection, filp, fileName))
+			continue;
+
+		mask = 1 << connection->m_hookSlot;
+		matchMask |= mask;
+
+		if (Connection_isTrackingFiles(connection))
+			trackMask |= mask;
+	}
+
+	if (!isOpen)
+		return matchMask;
+
+	if (!trackMask) // drop whatever a previous owner of this filp address might have left
+	{
+		Hook_p_getFileMask(self, filp, true);
+		return matchMask;
+	}
+
+	// open may sleep, so don't make the grow GFP_ATOMIC under the lock
+
+	growSlotArray = PtrMap_allocGrowSlotArray(&self->m_fileMap, GFP_KERNEL, &growSlotCount);
+
+	spin_lock(&self->m_fileMapLock);
+
+	slot = PtrMap_visitPrealloc(&self->m_fileMap, filp, growSlotArray, growSlotCount);
+	if (slot)
+		slot->m_value = (void*)(uintptr_t)trackMask;
+	else
+		matchMask &= ~trackMask; // out of memory; better to miss this file entirely than to see a part of it
+
+	spin_unlock(&self->m_fileMapLock);
+	return matchMask;
+}
+
+uint
+Hook_p_getFileMask(
+	Hook* self,
+	struct file* filp,
+	bool isClose
+	)
+{
+	uint mask;
+
+	if (!READ_ONCE(self->m_fileMap.m_count)) // a filp is added on open, before any other op may reach us
+		return 0;
+
+	spin_lock(&self->m_fileMapLock);
+
+	mask = (uint)(uintptr_t)PtrMap_findValue(&self->m_fileMap, filp);
+	if (isClose)
+		PtrMap_remove(&self->m_fileMap, filp);
+
+	spin_unlock(&self->m_fileMapLock);
+	return mask;
+}
+
+const char*
+Hook_p_getPathString(
+	Hook* self,
+	const struct path* path,
+	char* buffer
+	)
+{
+	HookPathCacheEntry* entry;
+	struct dentry* dentry = path->dentry;
+	const char* p;
+	size_t length;
+	size_t i;
+	uint renameSeq;
+
+	renameSeq = read_seqbegin(&rename_lock);
+
+	spin_lock(&self->m_pathCacheLock);
+
+	for (i = 0; i < HookConst_PathCacheSize; i++)
+	{
+		entry = &self->m_pathCache[i];
+		if (entry->m_dentry == dentry &&
+			entry->m_mnt == path->mnt &&
+			entry->m_parent == dentry->d_parent &&
+			entry->m_inode == dentry->d_inode &&
+			entry->m_nameHash == dentry->d_name.hash &&
+			entry->m_nameLength == dentry->d_name.len &&
+			entry->m_renameSeq == renameSeq)
+		{
+			memcpy(buffer, entry->m_path, HookConst_MaxPathLength);
+			spin_unlock(&self->m_pathCacheLock);
+			return buffer;
+		}
+	}
+
+	spin_unlock(&self->m_pathCacheLock);
+
+	p = d_path(path, buffer, HookConst_MaxPathLength - 1);
+	if (IS_ERR(p))
+		return NULL;
+
+	buffer[HookConst_MaxPathLength - 1] = 0;
+	length = strlen(p);
+	memmove(buffer, p, length + 1); // d_path builds the path at the end of the buffer
+
+	if (read_seqretry(&rename_lock, renameSeq)) // renamed while resolving, don't cache
+		return buffer;
+
+	spin_lock(&self->m_pathCacheLock);
+
+	entry = &self->m_pathCache[self->m_pathCacheNextIdx];
+	self->m_pathCacheNextIdx = (self->m_pathCacheNextIdx + 1) % HookConst_PathCacheSize;
+
+	entry->m_mnt = path->mnt;
+	entry->m_dentry = dentry;
+	entry->m_parent = dentry->d_parent;
+	entry->m_inode = dentry->d_inode;
+	entry->m_nameHash = dentry->d_name.hash;
+	entry->m_nameLength = dentry->d_name.len;
+	entry->m_renameSeq = renameSeq;
+	memcpy(entry->m_path, buffer, length + 1);
+
+	spin_unlock(&self->m_pathCacheLock);
+	return buffer;
+}
+
+// no locks and no connection refs here: connections are only released after
+// the SRCU grace period which follows their removal from m_connectionList
+
 void
 Hook_p_notify(
 	Hook* self,
@@ -729,66 +1089,49 @@ Hook_p_notify(
 	size_t paramBlockCount
 	)
 {
-	struct list_head* link;
-	size_t count;
-	size_t i;
 	uint64_t timestamp;
 	uint32_t pid;
 	uint32_t tid;
-	Connection* connectionArray[dm_ConnectionCountLimit];
 	Connection* connection;
-	FileNameFilterReq filterReq;
-	const char* fileName;
+	uint fileMask;
 	bool isMatch;
+	uint32_t sampleWeight;
+	int srcuIdx;
 
 	timestamp = getTimestamp();
 	pid = current->tgid;
 	tid = current->pid;
 
-	mutex_lock(&self->m_lock);
-
-	ASSERT(self->m_connectionCount <= dm_ConnectionCountLimit);
-
-	for (
-		link = self->m_connectionList.next, count = 0;
-		link != &self->m_connectionList;
-		link = link->next
-		)
-	{
-		connection = container_of(link, Connection, m_hookLink);
-		Connection_addRef(connection);
-		connectionArray[count++] = connection;
-	}
-
-	mutex_unlock(&self->m_lock);
+	srcuIdx = srcu_read_lock(&self->m_connectionListSrcu);
 
 	switch (code)
 	{
-	case dm_NotifyCode_Open:
-		filterReq = result == 0 ? FileNameFilterReq_Open : FileNameFilterReq_OpenError;
-		fileName = paramBlockArray[1].m_p;
+	case dm_NotifyCode_Open: // match and start tracking before anybody learns about this file
+		fileMask = Hook_p_matchOpenFile(self, filp, paramBlockArray[1].m_p, result == 0);
 		break;
 
 	case dm_NotifyCode_Close:
-		filterReq = FileNameFilterReq_Close;
-		fileName = "";
+		fileMask = Hook_p_getFileMask(self, filp, true);
 		break;
 
 	default:
-		filterReq = FileNameFilterReq_Other;
-		fileName = "";
+		fileMask = Hook_p_getFileMask(self, filp, false);
 	}
 
-	for (i = 0; i < count; i++)
+	list_for_each_entry_rcu(connection, &self->m_connectionList, m_hookLink)
 	{
-		connection = connectionArray[i];
-
-		isMatch = Connection_checkFile(connection, filterReq, filp, fileName);
-		if (isMatch)
-			Connection_notify(connection, filp, code, result, pid, tid, timestamp, paramBlockArray, paramBlockCount);
-
-		Connection_release(connection);
+		isMatch = code == dm_NotifyCode_Open ?
+			(fileMask & (1 << connection->m_hookSlot)) != 0 :
+			Connection_checkFile(connection, filp, fileMask);
+
+		if (isMatch &&
+			(connection->m_notifyCodeMask & (1 << code)) &&
+			Connection_checkProcess(connection) &&
+			Connection_checkSample(connection, code, timestamp, &sampleWeight)) // before anything gets copied
+			Connection_notify(connection, filp, code, result, pid, tid, timestamp, sampleWeight, paramBlockArray, paramBlockCount);
 	}
+
+	srcu_read_unlock(&self->m_connectionListSrcu, srcuIdx);
 }
 
 //..............................................................................
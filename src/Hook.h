@@ -1,11 +1,13 @@
 #pragma once
 
-#include "HashTable.h"
+#include "PtrMap.h"
 #include "ScatterGather.h"
 #include "lkmUtils.h"
 #include "typedefs.h"
 
-typedef enum HookState    HookState;
+typedef enum HookState             HookState;
+typedef struct HookPathCacheEntry HookPathCacheEntry;
+typedef struct HookIoctlContext   HookIoctlContext;
 
 //..............................................................................
 
@@ -19,6 +21,46 @@ enum HookState
 
 // . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . .
 
+enum HookConst
+{
+	HookConst_PathCacheSize = 8,
+	HookConst_MaxPathLength = 128, // same as in createPathString
+};
+
+// . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . .
+
+// recently opened paths; no references are held, an entry is only trusted if
+// the dentry (of a file being opened, i.e. alive) still looks the same and no
+// rename happened anywhere since (rename_lock sequence)
+
+struct HookPathCacheEntry
+{
+	const struct vfsmount* m_mnt;
+	const struct dentry* m_dentry;
+	const struct dentry* m_parent;
+	const struct inode* m_inode;
+	uint m_nameHash;
+	uint m_nameLength;
+	uint m_renameSeq;
+	char m_path[HookConst_MaxPathLength];
+};
+
+// . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . .
+
+// ioctl notify params are always embedded in this, so connections with the
+// same size field in their descriptors read it from user memory only once
+
+struct HookIoctlContext
+{
+	dm_IoctlNotifyParams m_params;
+	uint32_t m_argSizeFieldOffset; // of the field read last
+	uint32_t m_argSizeFieldFlags;
+	uint32_t m_argSizeFieldValue;
+	bool m_isArgSizeFieldRead;
+};
+
+// . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . .
+
 struct Hook
 {
 	struct list_head m_link;
@@ -26,13 +68,27 @@ struct Hook
 	struct file_operations m_originalFops;
 	struct module* m_originalModule;
 	const char* m_originalPath;
-	HashTableEntry* m_mapEntry;
+	struct rcu_head m_rcu;
 
 	struct mutex m_lock;
 	HookState m_state;
-	struct list_head m_connectionList;
+	struct srcu_struct m_connectionListSrcu; // notify may sleep, so it's SRCU rather than RCU
+	struct list_head m_connectionList; // modified under m_lock, traversed under m_connectionListSrcu
 	size_t m_connectionCount;
+	uint m_connectionSlotMask; // Connection::m_hookSlot-s in use
+	volatile long m_enabledConnectionCountTable[dm_NotifyCode__Count]; // per notify code; checked lock-free before doing any work in fops
 	volatile long m_refCount;
+
+	spinlock_t m_pathCacheLock;
+	HookPathCacheEntry m_pathCache[HookConst_PathCacheSize];
+	size_t m_pathCacheNextIdx; // round-robin
+
+	// open files matched by connections that track them (those with a file
+	// name filter or in dm_PathMode_Deferred), shared so a read/write takes a
+	// single lookup no matter how many connections are filtering
+
+	spinlock_t m_fileMapLock; // updated from fops, so no sleeping in there
+	PtrMap m_fileMap; // filp -> mask of Connection::m_hookSlot-s
 };
 
 // . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . .
@@ -53,9 +109,40 @@ Hook_addRef(Hook* self)
 	return atomicInc(&self->m_refCount);
 }
 
+static
+inline
+bool
+Hook_addRefNotZero(Hook* self)
+{
+	return atomicIncNotZero(&self->m_refCount) != 0;
+}
+
 long
 Hook_release(Hook* self);
 
+static
+inline
+bool
+Hook_isNotifyCodeEnabled(
+	Hook* self,
+	uint16_t code
+	)
+{
+	return self->m_enabledConnectionCountTable[code] != 0;
+}
+
+void
+Hook_enableNotifyCodes(
+	Hook* self,
+	uint notifyCodeMask
+	);
+
+void
+Hook_disableNotifyCodes(
+	Hook* self,
+	uint notifyCodeMask
+	);
+
 bool
 Hook_stop(Hook* self);
 
@@ -74,6 +161,25 @@ Hook_removeConnection(
 	Connection* connection
 	);
 
+// forgets the connection's open files (it's being disabled or removed)
+
+void
+Hook_clearConnectionFiles(
+	Hook* self,
+	Connection* connection
+	);
+
+// takes a reference to the path if the connection tracks this filp (so it's
+// still open); returns false otherwise
+
+bool
+Hook_getConnectionFilePath(
+	Hook* self,
+	Connection* connection,
+	struct file* filp,
+	struct path* path
+	);
+
 int
 Hook_fop_open(
 	struct inode* inodep,
@@ -131,7 +237,38 @@ Hook_fop_compat_ioctl(
 bool
 Hook_p_hasConnections(
 	Hook* self,
-	struct inode* inodep
+	struct inode* inodep,
+	bool* isFileNameNeeded // may be NULL
+	);
+
+uint
+Hook_p_matchOpenFile(
+	Hook* self,
+	struct file* filp,
+	const char* fileName,
+	bool isOpen
+	);
+
+uint
+Hook_p_getFileMask(
+	Hook* self,
+	struct file* filp,
+	bool isClose
+	);
+
+const char*
+Hook_p_getPathString(
+	Hook* self,
+	const struct path* path,
+	char* buffer // HookConst_MaxPathLength
+	);
+
+// returns 0 if the field can't be read
+
+uint32_t
+HookIoctlContext_getArgSizeField(
+	HookIoctlContext* self,
+	const dm_IoctlDesc* ioctlDesc
 	);
 
 long
@@ -0,0 +1,132 @@
+#include "pch.h"
+#include "MemCache.h"
+#include "HashTable.h"
+
+//..............................................................................
+
+#ifdef SLAB_NO_MERGE
+#	define MEM_CACHE_FLAGS SLAB_NO_MERGE // keep our caches separately accounted in slabinfo
+#else
+#	define MEM_CACHE_FLAGS 0
+#endif
+
+// a byte-at-a-time serial write is ~100 bytes with PendingNotify and headers
+
+static const size_t g_notifySizeClassTable[MemCacheConst_NotifySizeClassCount] =
+{
+	96, 128, 192, 256, 512, 1024, 2048, 4096,
+};
+
+static const char* g_notifyCacheNameTable[MemCacheConst_NotifySizeClassCount] =
+{
+	"tdevmon_notify_96",
+	"tdevmon_notify_128",
+	"tdevmon_notify_192",
+	"tdevmon_notify_256",
+	"tdevmon_notify_512",
+	"tdevmon_notify_1024",
+	"tdevmon_notify_2048",
+	"tdevmon_notify_4096",
+};
+
+static struct kmem_cache* g_notifyCacheArray[MemCacheConst_NotifySizeClassCount] = { 0 };
+static struct kmem_cache* g_hashTableEntryCache = NULL;
+
+// . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . .
+
+int
+MemCache_create(void)
+{
+	size_t i;
+
+	for (i = 0; i < MemCacheConst_NotifySizeClassCount; i++)
+	{
+		g_notifyCacheArray[i] = kmem_cache_create(
+			g_notifyCacheNameTable[i],
+			g_notifySizeClassTable[i],
+			0,
+			MEM_CACHE_FLAGS,
+			NULL
+			);
+
+		if (!g_notifyCacheArray[i])
+		{
+			MemCache_destroy();
+			return -ENOMEM;
+		}
+	}
+
+	g_hashTableEntryCache = kmem_cache_create("tdevmon_hash_entry", sizeof(HashTableEntry), 0, MEM_CACHE_FLAGS, NULL);
+	if (!g_hashTableEntryCache)
+	{
+		MemCache_destroy();
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+void
+MemCache_destroy(void)
+{
+	size_t i;
+
+	for (i = 0; i < MemCacheConst_NotifySizeClassCount; i++)
+		if (g_notifyCacheArray[i])
+		{
+			kmem_cache_destroy(g_notifyCacheArray[i]);
+			g_notifyCacheArray[i] = NULL;
+		}
+
+	if (g_hashTableEntryCache)
+	{
+		kmem_cache_destroy(g_hashTableEntryCache);
+		g_hashTableEntryCache = NULL;
+	}
+}
+
+void*
+MemCache_allocNotify(
+	size_t size,
+	gfp_t kmallocFlags,
+	uint8_t* sizeClass
+	)
+{
+	size_t i;
+
+	for (i = 0; i < MemCacheConst_NotifySizeClassCount; i++)
+		if (size <= g_notifySizeClassTable[i])
+		{
+			*sizeClass = (uint8_t)i;
+			return kmem_cache_alloc(g_notifyCacheArray[i], kmallocFlags);
+		}
+
+	*sizeClass = MemCacheConst_NotifySizeClass_Kmalloc;
+	return kmalloc(size, kmallocFlags);
+}
+
+void
+MemCache_freeNotify(
+	void* p,
+	uint8_t sizeClass
+	)
+{
+	if (sizeClass < MemCacheConst_NotifySizeClassCount)
+		kmem_cache_free(g_notifyCacheArray[sizeClass], p);
+	else
+		kfree(p);
+}
+
+void*
+MemCache_allocHashTableEntry(gfp_t kmallocFlags)
+{
+	return kmem_cache_alloc(g_hashTableEntryCache, kmallocFlags);
+}
+
+void
+MemCache_freeHashTableEntry(void* p)
+{
+	kmem_cache_free(g_hashTableEntryCache, p);
+}
+
+//..............................................................................
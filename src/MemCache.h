@@ -0,0 +1,43 @@
+#pragma once
+
+//..............................................................................
+
+// dedicated slab caches (they show up in /proc/slabinfo as tdevmon_*) for
+// the objects allocated on the notification path: pending notifications
+// are served from a set of size classes (anything bigger goes to kmalloc),
+// hash table entries and buckets have caches of their own
+
+enum MemCacheConst
+{
+	MemCacheConst_NotifySizeClassCount = 8,
+	MemCacheConst_NotifySizeClass_Kmalloc = MemCacheConst_NotifySizeClassCount,
+};
+
+// . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . .
+
+int
+MemCache_create(void);
+
+void
+MemCache_destroy(void);
+
+void*
+MemCache_allocNotify(
+	size_t size,
+	gfp_t kmallocFlags,
+	uint8_t* sizeClass
+	);
+
+void
+MemCache_freeNotify(
+	void* p,
+	uint8_t sizeClass
+	);
+
+void*
+MemCache_allocHashTableEntry(gfp_t kmallocFlags);
+
+void
+MemCache_freeHashTableEntry(void* p);
+
+//..............................................................................
@@ -0,0 +1,335 @@
+#include "pch.h"
+#include "NotifyRing.h"
+
+//..............................................................................
+
+NotifyRing*
+NotifyRing_create(
+	size_t size,
+	uint flags,
+	int node
+	)
+{
+	NotifyRing* ring;
+	struct page* page;
+	uint order;
+
+	ASSERT(is_power_of_2(size) && size >= NotifyRingConst_MinSize && size <= NotifyRingConst_MaxSize);
+
+	ring = kzalloc_node(sizeof(NotifyRing), GFP_KERNEL, node);
+	if (!ring)
+		return NULL;
+
+	// both the header and the data are zeroed -- they may end up in user mode
+
+	page = alloc_pages_node(node, GFP_KERNEL | __GFP_ZERO, 0);
+	if (!page)
+	{
+		kfree(ring);
+		return NULL;
+	}
+
+	ring->m_hdr = page_address(page);
+
+	if (flags & dm_RingFlag_HugePages)
+	{
+		order = get_order(size);
+		page = alloc_pages_node(node, GFP_KERNEL | __GFP_ZERO | __GFP_NOWARN, order);
+		if (page)
+		{
+			split_page(page, order); // so that each page can be inserted into user VMAs individually
+			ring->m_data = page_address(page);
+		}
+	}
+	else
+	{
+		ring->m_data = vzalloc_node(size, node);
+	}
+
+	if (!ring->m_data)
+	{
+		free_page((ulong)ring->m_hdr);
+		kfree(ring);
+		return NULL;
+	}
+
+	ring->m_size = size;
+	ring->m_flags = flags;
+	ring->m_hdr->m_signature = dm_RingHdrSignature;
+	ring->m_hdr->m_size = size;
+	ring->m_hdr->m_dataOffset = PAGE_SIZE;
+	return ring;
+}
+
+void
+NotifyRing_delete(NotifyRing* self)
+{
+	size_t offset;
+
+	if (self->m_flags & dm_RingFlag_HugePages)
+		for (offset = 0; offset < self->m_size; offset += PAGE_SIZE)
+			__free_page(virt_to_page(self->m_data + offset));
+	else
+		vfree(self->m_data);
+
+	free_page((ulong)self->m_hdr);
+	kfree(self);
+}
+
+int
+NotifyRing_map(
+	NotifyRing* self,
+	struct vm_area_struct* vma,
+	ulong addr
+	)
+{
+	struct page* page;
+	size_t offset;
+	int result;
+
+	result = vm_insert_page(vma, addr, virt_to_page(self->m_hdr));
+	if (result != 0)
+		return result;
+
+	addr += PAGE_SIZE;
+
+	for (offset = 0; offset < self->m_size; offset += PAGE_SIZE, addr += PAGE_SIZE)
+	{
+		page = (self->m_flags & dm_RingFlag_HugePages) ?
+			virt_to_page(self->m_data + offset) :
+			vmalloc_to_page(self->m_data + offset);
+
+		result = vm_insert_page(vma, addr, page);
+		if (result != 0)
+			return result;
+	}
+
+	return 0;
+}
+
+dm_NotifyHdr*
+NotifyRing_reserve(
+	NotifyRing* self,
+	size_t size,
+	uint32_t* nextHead
+	)
+{
+	uint32_t head;
+	uint32_t tail;
+	size_t dataSize;
+	size_t offset;
+	size_t leftover;
+	size_t padSize;
+
+	size = NotifyRing_getRecordSize(size);
+	head = self->m_head;
+	tail = smp_load_acquire(&self->m_hdr->m_tail);
+	dataSize = (uint32_t)(head - tail);
+	if (dataSize > self->m_size) // the tail is garbage; treat the ring as full
+		return NULL;
+
+	offset = head & (self->m_size - 1);
+	leftover = self->m_size - offset;
+	padSize = leftover < size ? leftover : 0;
+
+	if (dataSize + padSize + size > self->m_size)
+		return NULL;
+
+	if (padSize)
+	{
+		if (padSize >= sizeof(dm_NotifyHdr))
+			((dm_NotifyHdr*)(self->m_data + offset))->m_signature = 0; // mark the tail as padding
+
+		offset = 0;
+	}
+
+	*nextHead = head + (uint32_t)(padSize + size);
+	return (dm_NotifyHdr*)(self->m_data + offset);
+}
+
+static
+const dm_NotifyHdr*
+NotifyRing_p_dropCorrupted(
+	NotifyRing* self,
+	uint32_t head
+	)
+{
+	printk_ratelimited(KERN_WARNING "tdevmon: per-CPU ring is corrupted by user mode, dropping its contents\n"); // user mode can trigger it at will
+	smp_store_release(&self->m_hdr->m_tail, head);
+	return NULL;
+}
+
+const dm_NotifyHdr*
+NotifyRing_peek(
+	NotifyRing* self,
+	size_t* notifySize
+	)
+{
+	const dm_NotifyHdr* notifyHdr;
+	uint32_t head;
+	uint32_t tail;
+	uint32_t paramSize;
+	size_t dataSize;
+	size_t offset;
+	size_t leftover;
+
+	head = smp_load_acquire(&self->m_head);
+	tail = READ_ONCE(self->m_hdr->m_tail);
+
+	while (tail != head)
+	{
+		dataSize = (uint32_t)(head - tail);
+		if (dataSize > self->m_size || (tail & (NotifyRingConst_RecordAlign - 1)))
+			return NotifyRing_p_dropCorrupted(self, head);
+
+		offset = tail & (self->m_size - 1);
+		leftover = self->m_size - offset;
+		notifyHdr = (const dm_NotifyHdr*)(self->m_data + offset);
+
+		if (leftover < sizeof(dm_NotifyHdr) || READ_ONCE(notifyHdr->m_signature) != dm_NotifyHdrSignature)
+		{
+			if (leftover >= dataSize) // padding is always followed by a record
+				return NotifyRing_p_dropCorrupted(self, head);
+
+			tail += leftover; // skip padding
+			smp_store_release(&self->m_hdr->m_tail, tail);
+			continue;
+		}
+
+		// the record may be modified by user mode at any time, so the size
+		// we validate is the size the caller should use
+
+		paramSize = READ_ONCE(notifyHdr->m_paramSize);
+		if (paramSize > leftover - sizeof(dm_NotifyHdr) ||
+			NotifyRing_getRecordSize(sizeof(dm_NotifyHdr) + paramSize) > dataSize)
+			return NotifyRing_p_dropCorrupted(self, head);
+
+		*notifySize = sizeof(dm_NotifyHdr) + paramSize;
+		return notifyHdr;
+	}
+
+	return NULL;
+}
+
+size_t
+NotifyRing_getDataSize(NotifyRing* self)
+{
+	size_t dataSize = (uint32_t)(smp_load_acquire(&self->m_head) - READ_ONCE(self->m_hdr->m_tail));
+	return dataSize <= self->m_size ? dataSize : 0;
+}
+
+//..............................................................................
+
+static
+void
+NotifyRingSet_vmop_open(struct vm_area_struct* vma)
+{
+	NotifyRingSet_addRef((NotifyRingSet*)vma->vm_private_data);
+}
+
+static
+void
+NotifyRingSet_vmop_close(struct vm_area_struct* vma)
+{
+	NotifyRingSet_release((NotifyRingSet*)vma->vm_private_data);
+}
+
+static const struct vm_operations_struct g_notifyRingSetVmOps =
+{
+	.open  = NotifyRingSet_vmop_open,
+	.close = NotifyRingSet_vmop_close,
+};
+
+// . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . .
+
+NotifyRingSet*
+NotifyRingSet_create(
+	size_t ringSize,
+	uint flags
+	)
+{
+	NotifyRingSet* ringSet;
+	NotifyRing** ringArray;
+	size_t i;
+	int node;
+
+	ringSet = kzalloc(sizeof(NotifyRingSet) + nr_cpu_ids * sizeof(NotifyRing*), GFP_KERNEL);
+	if (!ringSet)
+		return NULL;
+
+	ringSet->m_refCount = 1;
+	ringSet->m_ringCount = nr_cpu_ids;
+	ringSet->m_ringSize = ringSize;
+	ringSet->m_flags = flags;
+
+	// we allocate rings for all CPU ids (not just possible ones) to keep the
+	// user-mode layout of the mapping trivial
+
+	ringArray = NotifyRingSet_getRingArray(ringSet);
+	for (i = 0; i < ringSet->m_ringCount; i++)
+	{
+		node = cpu_possible(i) ? cpu_to_node(i) : NUMA_NO_NODE;
+		ringArray[i] = NotifyRing_create(ringSize, flags, node);
+		if (!ringArray[i])
+		{
+			NotifyRingSet_release(ringSet);
+			return NULL;
+		}
+	}
+
+	return ringSet;
+}
+
+long
+NotifyRingSet_release(NotifyRingSet* self)
+{
+	NotifyRing** ringArray;
+	long refCount;
+	size_t i;
+
+	refCount = atomicDec(&self->m_refCount);
+	if (refCount)
+		return refCount;
+
+	ringArray = NotifyRingSet_getRingArray(self);
+	for (i = 0; i < self->m_ringCount; i++)
+		if (ringArray[i])
+			NotifyRing_delete(ringArray[i]);
+
+	kfree(self);
+	return 0;
+}
+
+int
+NotifyRingSet_mmap(
+	NotifyRingSet* self,
+	struct vm_area_struct* vma
+	)
+{
+	NotifyRing** ringArray = NotifyRingSet_getRingArray(self);
+	size_t stride = PAGE_SIZE + self->m_ringSize;
+	ulong addr = vma->vm_start;
+	size_t i;
+	int result;
+
+	if (vma->vm_pgoff != 0 || vma->vm_end - vma->vm_start != self->m_ringCount * stride)
+		return -EINVAL;
+
+	if (!(vma->vm_flags & VM_SHARED)) // the consumer must be able to publish its tail
+		return -EINVAL;
+
+	vm_flags_set(vma, VM_DONTEXPAND | VM_DONTDUMP);
+
+	for (i = 0; i < self->m_ringCount; i++, addr += stride)
+	{
+		result = NotifyRing_map(ringArray[i], vma, addr);
+		if (result != 0)
+			return result;
+	}
+
+	vma->vm_private_data = self;
+	vma->vm_ops = &g_notifyRingSetVmOps;
+	return 0;
+}
+
+//..............................................................................
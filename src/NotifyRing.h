@@ -0,0 +1,176 @@
+#pragma once
+
+#include "dm_lnx_Protocol.h"
+#include "lkmUtils.h"
+
+typedef struct NotifyRing    NotifyRing;
+typedef struct NotifyRingSet NotifyRingSet;
+
+//..............................................................................
+
+enum NotifyRingConst
+{
+	NotifyRingConst_MinSize     = 16 * 1024,
+	NotifyRingConst_MaxSize     = 256 * 1024 * 1024,
+	NotifyRingConst_RecordAlign = 8,
+};
+
+// . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . .
+
+// single-producer single-consumer ring of dm_NotifyHdr records; records are
+// never split, so a record which doesn't fit at the end of the ring is placed
+// at the beginning and the tail of the ring is marked with a zero signature
+// (or left as is, if it's too small to hold a dm_NotifyHdr)
+
+// the header page and the data may be mapped to user mode, so everything in
+// there (including m_tail and the records themselves) is untrusted; we keep
+// private copies of the size and the head and validate the rest on every use
+
+struct NotifyRing
+{
+	dm_RingHdr* m_hdr; // a dedicated page
+	char* m_data;
+	uint32_t m_size; // power of 2
+	uint32_t m_head; // written by producer only
+	size_t m_dropCount; // producer only
+	uint m_flags; // dm_RingFlag
+};
+
+// . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . .
+
+NotifyRing*
+NotifyRing_create(
+	size_t size,
+	uint flags,
+	int node
+	);
+
+void
+NotifyRing_delete(NotifyRing* self);
+
+static
+inline
+size_t
+NotifyRing_getRecordSize(size_t size)
+{
+	return ALIGN(size, NotifyRingConst_RecordAlign);
+}
+
+int
+NotifyRing_map(
+	NotifyRing* self,
+	struct vm_area_struct* vma,
+	ulong addr
+	);
+
+// producer side (preemption must be disabled)
+
+dm_NotifyHdr*
+NotifyRing_reserve(
+	NotifyRing* self,
+	size_t size,
+	uint32_t* nextHead
+	);
+
+static
+inline
+void
+NotifyRing_commit(
+	NotifyRing* self,
+	uint32_t nextHead
+	)
+{
+	// both pair with acquires: m_head for kernel-side readers, m_hdr->m_head
+	// for mmap consumers
+
+	smp_store_release(&self->m_head, nextHead);
+	smp_store_release(&self->m_hdr->m_head, nextHead);
+}
+
+// consumer side
+
+const dm_NotifyHdr*
+NotifyRing_peek(
+	NotifyRing* self,
+	size_t* notifySize
+	);
+
+static
+inline
+void
+NotifyRing_pop(
+	NotifyRing* self,
+	size_t notifySize
+	)
+{
+	uint32_t tail = READ_ONCE(self->m_hdr->m_tail);
+	smp_store_release(&self->m_hdr->m_tail, tail + (uint32_t)NotifyRing_getRecordSize(notifySize));
+}
+
+size_t
+NotifyRing_getDataSize(NotifyRing* self);
+
+static
+inline
+void
+NotifyRing_drain(NotifyRing* self)
+{
+	smp_store_release(&self->m_hdr->m_tail, smp_load_acquire(&self->m_head));
+}
+
+//..............................................................................
+
+// one ring per CPU id; shared by the connection and all the user mappings
+
+struct NotifyRingSet
+{
+	volatile long m_refCount;
+	size_t m_ringCount;
+	size_t m_ringSize;
+	uint m_flags;
+
+	// followed by NotifyRing* [m_ringCount]
+};
+
+// . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . .
+
+NotifyRingSet*
+NotifyRingSet_create(
+	size_t ringSize,
+	uint flags
+	);
+
+static
+inline
+void
+NotifyRingSet_addRef(NotifyRingSet* self)
+{
+	atomicInc(&self->m_refCount);
+}
+
+long
+NotifyRingSet_release(NotifyRingSet* self);
+
+static
+inline
+NotifyRing**
+NotifyRingSet_getRingArray(NotifyRingSet* self)
+{
+	return (NotifyRing**)(self + 1);
+}
+
+static
+inline
+bool
+NotifyRingSet_isMapped(NotifyRingSet* self)
+{
+	return self->m_refCount > 1; // only mappings add references
+}
+
+int
+NotifyRingSet_mmap(
+	NotifyRingSet* self,
+	struct vm_area_struct* vma
+	);
+
+//..............................................................................
@@ -0,0 +1,121 @@
+#include "pch.h"
+#include "PidFilter.h"
+
+//..............................................................................
+
+static
+inline
+uint32_t*
+PidFilter_p_getTable(PidFilter* self)
+{
+	return (uint32_t*)(self + 1);
+}
+
+static
+bool
+PidFilter_p_find(
+	PidFilter* self,
+	uint32_t tgid
+	)
+{
+	uint32_t* table = PidFilter_p_getTable(self);
+	uint32_t mask = (1 << self->m_hashBits) - 1;
+	uint32_t i = hash_32(tgid, self->m_hashBits);
+
+	if (!tgid)
+		return false;
+
+	while (table[i]) // the table is never full, so this terminates
+	{
+		if (table[i] == tgid)
+			return true;
+
+		i = (i + 1) & mask;
+	}
+
+	return false;
+}
+
+// . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . .
+
+int
+PidFilter_create(
+	PidFilter** resultFilter,
+	uint flags,
+	const uint32_t* tgidArray,
+	size_t count
+	)
+{
+	PidFilter* filter;
+	uint32_t* table;
+	uint32_t mask;
+	uint32_t i;
+	uint hashBits;
+	size_t j;
+
+	ASSERT(count && count <= dm_PidFilterCountLimit);
+
+	hashBits = ilog2(roundup_pow_of_two(count * 2)); // keep the load factor <= 0.5
+
+	filter = kzalloc(sizeof(PidFilter) + (sizeof(uint32_t) << hashBits), GFP_KERNEL);
+	if (!filter)
+		return -ENOMEM;
+
+	filter->m_flags = flags;
+	filter->m_hashBits = hashBits;
+
+	table = PidFilter_p_getTable(filter);
+	mask = (1 << hashBits) - 1;
+
+	for (j = 0; j < count; j++)
+	{
+		if (!tgidArray[j])
+		{
+			kfree(filter);
+			return -EINVAL;
+		}
+
+		i = hash_32(tgidArray[j], hashBits);
+		while (table[i] && table[i] != tgidArray[j])
+			i = (i + 1) & mask;
+
+		table[i] = tgidArray[j];
+	}
+
+	*resultFilter = filter;
+	return 0;
+}
+
+// children are followed by walking up the parent chain, so a process matches
+// for as long as any of its (current) ancestors is in the set
+
+bool
+PidFilter_checkProcess(
+	PidFilter* self,
+	struct task_struct* task
+	)
+{
+	struct task_struct* parent;
+	bool isMatch;
+
+	isMatch = PidFilter_p_find(self, task->tgid);
+
+	if (!isMatch && (self->m_flags & dm_PidFilterFlag_FollowChildren))
+	{
+		rcu_read_lock();
+
+		parent = rcu_dereference(task->real_parent);
+		while (parent != task && !isMatch) // init_task is its own parent
+		{
+			task = parent;
+			isMatch = PidFilter_p_find(self, task->tgid);
+			parent = rcu_dereference(task->real_parent);
+		}
+
+		rcu_read_unlock();
+	}
+
+	return (self->m_flags & dm_PidFilterFlag_Exclude) ? !isMatch : isMatch;
+}
+
+//..............................................................................
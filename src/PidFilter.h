@@ -0,0 +1,44 @@
+#pragma once
+
+#include "dm_lnx_Protocol.h"
+
+typedef struct PidFilter PidFilter;
+
+//..............................................................................
+
+// an immutable open-addressing set of TGIDs (0 marks an empty slot); like
+// file name filters, published via RCU and replaced as a whole
+
+struct PidFilter
+{
+	uint m_flags; // dm_PidFilterFlag
+	uint m_hashBits;
+
+	// followed by uint32_t [1 << m_hashBits]
+};
+
+// . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . .
+
+int
+PidFilter_create(
+	PidFilter** filter,
+	uint flags,
+	const uint32_t* tgidArray,
+	size_t count
+	);
+
+static
+inline
+void
+PidFilter_delete(PidFilter* self)
+{
+	kfree(self);
+}
+
+bool
+PidFilter_checkProcess(
+	PidFilter* self,
+	struct task_struct* task
+	);
+
+//..............................................................................
@@ -0,0 +1,99 @@
+#include "pch.h"
+#include "PinnedBuffer.h"
+
+//..............................................................................
+
+int
+PinnedBuffer_create(
+	PinnedBuffer** resultBuffer,
+	ulong address,
+	size_t size
+	)
+{
+	PinnedBuffer* buffer;
+	struct page** pageArray;
+	ulong pageAddress;
+	size_t pageCount;
+	void* p;
+	long result;
+
+	if (!size || address + size < address)
+		return -EINVAL;
+
+	pageAddress = address & PAGE_MASK;
+	pageCount = (PAGE_ALIGN(address + size) - pageAddress) >> PAGE_SHIFT;
+
+	buffer = kzalloc(sizeof(PinnedBuffer), GFP_KERNEL);
+	if (!buffer)
+		return -ENOMEM;
+
+	pageArray = vzalloc(pageCount * sizeof(struct page*));
+	if (!pageArray)
+	{
+		kfree(buffer);
+		return -ENOMEM;
+	}
+
+	result = chargePinnedPages(current->mm, pageCount);
+	if (result != 0)
+	{
+		vfree(pageArray);
+		kfree(buffer);
+		return (int)result;
+	}
+
+	result = pinUserPages(pageAddress, pageCount, pageArray);
+	if (result != (long)pageCount)
+	{
+		if (result > 0)
+			unpinUserPages(pageArray, result);
+
+		unchargePinnedPages(current->mm, pageCount);
+		vfree(pageArray);
+		kfree(buffer);
+		return result < 0 ? (int)result : -EFAULT;
+	}
+
+	p = vmap(pageArray, pageCount, VM_MAP, PAGE_KERNEL);
+	if (!p)
+	{
+		unpinUserPages(pageArray, pageCount);
+		unchargePinnedPages(current->mm, pageCount);
+		vfree(pageArray);
+		kfree(buffer);
+		return -ENOMEM;
+	}
+
+	mmgrab(current->mm);
+
+	buffer->m_refCount = 1;
+	buffer->m_mm = current->mm;
+	buffer->m_address = address;
+	buffer->m_size = size;
+	buffer->m_p = (char*)p + offset_in_page(address);
+	buffer->m_pageArray = pageArray;
+	buffer->m_pageCount = pageCount;
+
+	*resultBuffer = buffer;
+	return 0;
+}
+
+long
+PinnedBuffer_release(PinnedBuffer* self)
+{
+	long refCount;
+
+	refCount = atomicDec(&self->m_refCount);
+	if (refCount)
+		return refCount;
+
+	vunmap((void*)((ulong)self->m_p & PAGE_MASK));
+	unpinUserPages(self->m_pageArray, self->m_pageCount);
+	unchargePinnedPages(self->m_mm, self->m_pageCount);
+	mmdrop(self->m_mm);
+	vfree(self->m_pageArray);
+	kfree(self);
+	return 0;
+}
+
+//..............................................................................
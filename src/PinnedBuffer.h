@@ -0,0 +1,81 @@
+#pragma once
+
+#include "lkmUtils.h"
+
+typedef struct PinnedBuffer PinnedBuffer;
+
+//..............................................................................
+
+// a user buffer pinned in memory and mapped to the kernel address space, so
+// that notifications can be written straight into it (no bounce buffer, no
+// copy_to_user after wake-up); reference-counted because blocking reads keep
+// using it after the connection has dropped it
+
+// only reads from the registering process (m_mm) may use it -- the same
+// addresses mean nothing in another mm; the pins are charged to that mm. if
+// the process itself remaps the range, it keeps reading into the old pages
+// (so it's up to the owner to re-register after that)
+
+struct PinnedBuffer
+{
+	volatile long m_refCount;
+	struct mm_struct* m_mm; // mmgrab-ed
+	ulong m_address; // user
+	size_t m_size;
+	char* m_p; // kernel mapping of m_address
+	struct page** m_pageArray;
+	size_t m_pageCount;
+};
+
+// . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . .
+
+int
+PinnedBuffer_create(
+	PinnedBuffer** buffer,
+	ulong address,
+	size_t size
+	);
+
+static
+inline
+void
+PinnedBuffer_addRef(PinnedBuffer* self)
+{
+	atomicInc(&self->m_refCount);
+}
+
+long
+PinnedBuffer_release(PinnedBuffer* self);
+
+// call in the context of the reader
+
+static
+inline
+bool
+PinnedBuffer_contains(
+	PinnedBuffer* self,
+	const void __user* p,
+	size_t size
+	)
+{
+	ulong address = (ulong)p;
+
+	return
+		current->mm == self->m_mm &&
+		address >= self->m_address &&
+		size <= self->m_size &&
+		address - self->m_address <= self->m_size - size;
+}
+
+static
+inline
+void*
+PinnedBuffer_getKernelPtr(
+	PinnedBuffer* self,
+	const void __user* p
+	)
+{
+	return self->m_p + ((ulong)p - self->m_address);
+}
+
+//..............................................................................
@@ -0,0 +1,243 @@
+#include "pch.h"
+#include "PtrMap.h"
+
+//..............................................................................
+
+static
+inline
+size_t
+PtrMap_p_getHomeIdx(
+	PtrMap* self,
+	const void* key
+	)
+{
+	return hash_ptr(key, self->m_slotBits); // aligned pointers need mixing before masking
+}
+
+static
+PtrMapSlot*
+PtrMap_p_addKey(
+	PtrMap* self,
+	const void* key
+	)
+{
+	size_t mask = self->m_slotCount - 1;
+	size_t i;
+
+	for (i = PtrMap_p_getHomeIdx(self, key); self->m_slotArray[i].m_key; i = (i + 1) & mask)
+		;
+
+	self->m_slotArray[i].m_key = key;
+	self->m_slotArray[i].m_value = NULL;
+	self->m_count++;
+	return &self->m_slotArray[i];
+}
+
+// . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . .
+
+void
+PtrMap_construct(
+	PtrMap* self,
+	gfp_t kmallocFlags
+	)
+{
+	self->m_slotArray = NULL;
+	self->m_slotCount = 0;
+	self->m_slotBits = 0;
+	self->m_count = 0;
+	self->m_nullKeySlot.m_key = NULL;
+	self->m_nullKeySlot.m_value = NULL;
+	self->m_hasNullKey = false;
+	self->m_kmallocFlags = kmallocFlags;
+}
+
+void
+PtrMap_clear(PtrMap* self)
+{
+	if (self->m_slotCount)
+		memset(self->m_slotArray, 0, self->m_slotCount * sizeof(PtrMapSlot));
+
+	self->m_count = 0;
+	self->m_nullKeySlot.m_value = NULL;
+	self->m_hasNullKey = false;
+}
+
+PtrMapSlot*
+PtrMap_find(
+	PtrMap* self,
+	const void* key
+	)
+{
+	size_t mask;
+	size_t i;
+	PtrMapSlot* slot;
+
+	if (!key)
+		return self->m_hasNullKey ? &self->m_nullKeySlot : NULL;
+
+	if (!self->m_count)
+		return NULL;
+
+	mask = self->m_slotCount - 1;
+
+	for (i = PtrMap_p_getHomeIdx(self, key);; i = (i + 1) & mask) // there is always an empty slot
+	{
+		slot = &self->m_slotArray[i];
+		if (slot->m_key == key)
+			return slot;
+
+		if (!slot->m_key)
+			return NULL;
+	}
+}
+
+PtrMapSlot*
+PtrMap_allocGrowSlotArray(
+	PtrMap* self,
+	gfp_t kmallocFlags,
+	size_t* slotCount
+	)
+{
+	size_t count = READ_ONCE(self->m_count);
+	size_t oldSlotCount = READ_ONCE(self->m_slotCount);
+
+	if ((count + 1) * 100 <= oldSlotCount * PtrMapConst_GrowThreshold)
+		return NULL;
+
+	*slotCount = oldSlotCount ? oldSlotCount * 2 : PtrMapConst_InitialSlotCount;
+	return kzalloc(*slotCount * sizeof(PtrMapSlot), kmallocFlags);
+}
+
+PtrMapSlot*
+PtrMap_visitPrealloc(
+	PtrMap* self,
+	const void* key,
+	PtrMapSlot* slotArray,
+	size_t slotCount
+	)
+{
+	PtrMapSlot* slot;
+
+	if (!key)
+	{
+		kfree(slotArray);
+
+		if (!self->m_hasNullKey)
+		{
+			self->m_hasNullKey = true;
+			self->m_nullKeySlot.m_value = NULL;
+		}
+
+		return &self->m_nullKeySlot;
+	}
+
+	slot = PtrMap_find(self, key);
+	if (slot)
+	{
+		kfree(slotArray);
+		return slot;
+	}
+
+	if (!PtrMap_p_isGrowNeeded(self))
+	{
+		kfree(slotArray);
+		return PtrMap_p_addKey(self, key);
+	}
+
+	if (slotArray && slotCount <= self->m_slotCount) // the map grew meanwhile
+	{
+		kfree(slotArray);
+		slotArray = NULL;
+	}
+
+	if (!slotArray)
+	{
+		slotCount = self->m_slotCount ? self->m_slotCount * 2 : PtrMapConst_InitialSlotCount;
+		slotArray = kzalloc(slotCount * sizeof(PtrMapSlot), self->m_kmallocFlags);
+	}
+
+	if (slotArray)
+		PtrMap_p_rehash(self, slotArray, slotCount);
+	else if (self->m_count + 1 >= self->m_slotCount) // otherwise, just go on with longer runs
+		return NULL;
+
+	return PtrMap_p_addKey(self, key);
+}
+
+bool
+PtrMap_remove(
+	PtrMap* self,
+	const void* key
+	)
+{
+	PtrMapSlot* slot;
+	size_t mask;
+	size_t homeIdx;
+	size_t i;
+	size_t j;
+
+	if (!key)
+	{
+		if (!self->m_hasNullKey)
+			return false;
+
+		self->m_nullKeySlot.m_value = NULL;
+		self->m_hasNullKey = false;
+		return true;
+	}
+
+	slot = PtrMap_find(self, key);
+	if (!slot)
+		return false;
+
+	// shift back whatever follows in the run and would be unreachable otherwise
+
+	mask = self->m_slotCount - 1;
+	i = slot - self->m_slotArray;
+
+	for (j = (i + 1) & mask; self->m_slotArray[j].m_key; j = (j + 1) & mask)
+	{
+		homeIdx = PtrMap_p_getHomeIdx(self, self->m_slotArray[j].m_key);
+		if (((j - homeIdx) & mask) >= ((j - i) & mask)) // the hole is between home and j
+		{
+			self->m_slotArray[i] = self->m_slotArray[j];
+			i = j;
+		}
+	}
+
+	self->m_slotArray[i].m_key = NULL;
+	self->m_slotArray[i].m_value = NULL;
+	self->m_count--;
+	return true;
+}
+
+void
+PtrMap_p_rehash(
+	PtrMap* self,
+	PtrMapSlot* slotArray,
+	size_t slotCount
+	)
+{
+	PtrMapSlot* oldSlotArray = self->m_slotArray;
+	size_t oldSlotCount = self->m_slotCount;
+	PtrMapSlot* slot;
+	size_t i;
+
+	ASSERT(is_power_of_2(slotCount) && self->m_count < slotCount);
+
+	self->m_slotArray = slotArray;
+	self->m_slotCount = slotCount;
+	self->m_slotBits = ilog2(slotCount);
+	self->m_count = 0;
+
+	for (i = 0; i < oldSlotCount; i++)
+		if (oldSlotArray[i].m_key)
+		{
+			slot = PtrMap_p_addKey(self, oldSlotArray[i].m_key);
+			slot->m_value = oldSlotArray[i].m_value;
+		}
+
+	kfree(oldSlotArray);
+}
+
+//..............................................................................
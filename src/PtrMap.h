@@ -0,0 +1,147 @@
+#pragma once
+
+typedef struct PtrMapSlot PtrMapSlot;
+typedef struct PtrMap     PtrMap;
+
+//..............................................................................
+
+enum PtrMapConst
+{
+	PtrMapConst_InitialSlotCount = 16, // always a power of 2
+	PtrMapConst_GrowThreshold    = 75, // load factor, %
+};
+
+// . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . .
+
+struct PtrMapSlot
+{
+	const void* m_key; // NULL -- empty
+	void* m_value;
+};
+
+// . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . .
+
+// a flat open-addressing map for pointer keys (filps, fops, ioctl codes): keys
+// and values live right in the slot array, collisions are resolved with linear
+// probing, removals shift the following run back (no tombstones), so a lookup
+// is normally a single cache line. slots move on insert/remove, so a returned
+// slot is only valid until the next modification. NULL can't mark both an
+// empty slot and a key, so the NULL key (e.g. ioctl code 0) has a slot of its
+// own. the map never shrinks on remove -- a set that churns around a resize
+// boundary would otherwise keep rehashing; only clear/destruct give memory back
+
+struct PtrMap
+{
+	PtrMapSlot* m_slotArray;
+	size_t m_slotCount; // a power of 2 (or 0 before the first visit)
+	size_t m_slotBits;
+	size_t m_count; // not counting the NULL key
+	PtrMapSlot m_nullKeySlot;
+	bool m_hasNullKey;
+	gfp_t m_kmallocFlags;
+};
+
+// . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . .
+
+void
+PtrMap_construct(
+	PtrMap* self,
+	gfp_t kmallocFlags // = GFP_KERNEL
+	);
+
+static
+inline
+void
+PtrMap_destruct(PtrMap* self)
+{
+	kfree(self->m_slotArray);
+}
+
+void
+PtrMap_clear(PtrMap* self);
+
+static
+inline
+size_t
+PtrMap_getCount(PtrMap* self)
+{
+	return self->m_count + self->m_hasNullKey;
+}
+
+PtrMapSlot*
+PtrMap_find(
+	PtrMap* self,
+	const void* key
+	);
+
+static
+inline
+void*
+PtrMap_findValue(
+	PtrMap* self,
+	const void* key
+	)
+{
+	PtrMapSlot* slot = PtrMap_find(self, key);
+	return slot ? slot->m_value : NULL;
+}
+
+// for maps modified under a spinlock: call before taking the lock to allocate
+// the slot array the next insertion would need (NULL if no grow seems due --
+// the peek is unlocked, so PtrMap_visitPrealloc re-checks under the lock)
+
+PtrMapSlot*
+PtrMap_allocGrowSlotArray(
+	PtrMap* self,
+	gfp_t kmallocFlags,
+	size_t* slotCount
+	);
+
+// same as PtrMap_visit, but grows into slotArray (if given and still big
+// enough) rather than allocating; frees slotArray if it's not used
+
+PtrMapSlot*
+PtrMap_visitPrealloc(
+	PtrMap* self,
+	const void* key,
+	PtrMapSlot* slotArray,
+	size_t slotCount
+	);
+
+// finds or adds (with a NULL value); returns NULL if out of memory
+
+static
+inline
+PtrMapSlot*
+PtrMap_visit(
+	PtrMap* self,
+	const void* key
+	)
+{
+	return PtrMap_visitPrealloc(self, key, NULL, 0);
+}
+
+bool
+PtrMap_remove(
+	PtrMap* self,
+	const void* key
+	);
+
+// . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . .
+
+static
+inline
+bool
+PtrMap_p_isGrowNeeded(PtrMap* self)
+{
+	return (self->m_count + 1) * 100 > self->m_slotCount * PtrMapConst_GrowThreshold;
+}
+
+void
+PtrMap_p_rehash(
+	PtrMap* self,
+	PtrMapSlot* slotArray, // zeroed
+	size_t slotCount
+	);
+
+//..............................................................................
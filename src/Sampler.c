@@ -0,0 +1,118 @@
+#include "pch.h"
+#include "Sampler.h"
+#include "lkmUtils.h"
+
+//..............................................................................
+
+static
+void
+Sampler_p_adjustInterval(
+	Sampler* self,
+	uint64_t timestamp
+	)
+{
+	uint64_t elapsed;
+	uint64_t allowedCount;
+	ulong count;
+	ulong interval;
+
+	if (!spin_trylock(&self->m_lock)) // somebody else is adjusting it right now
+		return;
+
+	elapsed = timestamp - self->m_windowStart; // the wall clock may go back, too -- then it's huge
+	if (elapsed < SamplerConst_AdaptiveWindow) // already adjusted
+	{
+		spin_unlock(&self->m_lock);
+		return;
+	}
+
+	count = __sync_fetch_and_and(&self->m_windowEventCount, 0);
+
+	if (elapsed >= SamplerConst_AdaptiveIdleTime)
+	{
+		interval = 1;
+	}
+	else
+	{
+		allowedCount = div_u64((uint64_t)self->m_rate * elapsed, 10000000);
+		if (!allowedCount)
+			allowedCount = 1;
+
+		interval = count <= allowedCount ? 1 : (count + (ulong)allowedCount - 1) / (ulong)allowedCount;
+		if (interval > UINT_MAX)
+			interval = UINT_MAX;
+	}
+
+	WRITE_ONCE(self->m_interval, (uint32_t)interval);
+	WRITE_ONCE(self->m_windowStart, timestamp);
+	spin_unlock(&self->m_lock);
+}
+
+// . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . .
+
+void
+Sampler_construct(Sampler* self)
+{
+	self->m_mode = dm_SamplingMode_None;
+	self->m_rate = 0;
+	spin_lock_init(&self->m_lock);
+	self->m_windowStart = 0;
+	self->m_windowEventCount = 0;
+	self->m_eventCount = 0;
+	self->m_interval = 1;
+}
+
+int
+Sampler_setParams(
+	Sampler* self,
+	const dm_SamplingParams* params
+	)
+{
+	switch (params->m_mode)
+	{
+	case dm_SamplingMode_None:
+		break;
+
+	case dm_SamplingMode_Fixed:
+	case dm_SamplingMode_Adaptive:
+		if (!params->m_rate)
+			return -EINVAL;
+
+		break;
+
+	default:
+		return -EINVAL;
+	}
+
+	self->m_mode = params->m_mode;
+	self->m_rate = params->m_rate;
+	self->m_windowStart = 0; // the first notification starts a new window
+	self->m_windowEventCount = 0;
+	self->m_eventCount = 0;
+	self->m_interval = params->m_mode == dm_SamplingMode_Fixed ? params->m_rate : 1;
+	return 0;
+}
+
+uint32_t
+Sampler_sample(
+	Sampler* self,
+	uint64_t timestamp
+	)
+{
+	uint32_t interval;
+	ulong count;
+
+	if (self->m_mode == dm_SamplingMode_Adaptive)
+	{
+		atomicInc(&self->m_windowEventCount);
+
+		if (timestamp - READ_ONCE(self->m_windowStart) >= SamplerConst_AdaptiveWindow)
+			Sampler_p_adjustInterval(self, timestamp);
+	}
+
+	interval = READ_ONCE(self->m_interval);
+	count = atomicInc(&self->m_eventCount);
+	return count % interval == 0 ? interval : 0;
+}
+
+//..............................................................................
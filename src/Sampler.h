@@ -0,0 +1,53 @@
+#pragma once
+
+#include "dm_lnx_Protocol.h"
+
+typedef struct Sampler Sampler;
+
+//..............................................................................
+
+enum SamplerConst
+{
+	SamplerConst_AdaptiveWindow   = 1000000,  // 100 ms (in timestamp units, i.e. 100 ns)
+	SamplerConst_AdaptiveIdleTime = 10000000, // 1 s; a window longer than that restarts with 1 in 1
+};
+
+// . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . .
+
+// 1-in-N notification sampler; the mode and the rate can't change while the
+// connection is enabled, so the notify path only touches the counters (and,
+// once per adaptive window, the interval -- under m_lock with trylock, so
+// nobody ever waits for it)
+
+struct Sampler
+{
+	dm_SamplingMode m_mode;
+	uint32_t m_rate; // dm_SamplingMode_Fixed: N; dm_SamplingMode_Adaptive: target notifications per second
+
+	spinlock_t m_lock;
+	uint64_t m_windowStart; // dm_SamplingMode_Adaptive
+	volatile long m_windowEventCount;
+	volatile long m_eventCount;
+	uint32_t m_interval; // current N
+};
+
+// . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . .
+
+void
+Sampler_construct(Sampler* self);
+
+int
+Sampler_setParams(
+	Sampler* self,
+	const dm_SamplingParams* params
+	);
+
+// returns the weight of a delivered notification or 0 if it's skipped
+
+uint32_t
+Sampler_sample(
+	Sampler* self,
+	uint64_t timestamp
+	);
+
+//..............................................................................
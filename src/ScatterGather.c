@@ -64,6 +64,74 @@ copyScatterGather(
 	return dst - (char*)p;
 }
 
+// copies (at most) the first size bytes; unlike copyScatterGatherPartial,
+// leaves the blocks (including iov_iter-s) intact
+
+ssize_t
+copyScatterGatherHead(
+	void* p,
+	size_t size,
+	const MemBlock* blockArray,
+	size_t blockCount
+	)
+{
+	int result;
+	const MemBlock* block = blockArray;
+	const MemBlock* blockEnd = block + blockCount;
+	struct iov_iter iter;
+	char* dst = p;
+	char* dstEnd = dst + size;
+	size_t copySize;
+
+	for (; block < blockEnd && dst < dstEnd; block++)
+	{
+		size_t leftover = dstEnd - dst;
+		copySize = leftover < block->m_size ? leftover : block->m_size;
+
+		if (block->m_flags & MemBlockFlag_IovIter)
+		{
+			iter = *(const struct iov_iter*)block->m_p; // copy_from_iter advances it
+			result = copyMemBlock(dst, &iter, copySize, block->m_flags);
+		}
+		else
+		{
+			result = copyMemBlock(dst, block->m_p, copySize, block->m_flags);
+		}
+
+		if (result != 0)
+			return result;
+
+		dst += copySize;
+	}
+
+	return dst - (char*)p;
+}
+
+// cuts blocks down to the total of size bytes; returns the new block count
+
+size_t
+truncateScatterGather(
+	MemBlock* blockArray,
+	size_t blockCount,
+	size_t size
+	)
+{
+	size_t i;
+
+	for (i = 0; i < blockCount; i++)
+	{
+		if (size <= blockArray[i].m_size)
+		{
+			blockArray[i].m_size = size;
+			return size ? i + 1 : i;
+		}
+
+		size -= blockArray[i].m_size;
+	}
+
+	return blockCount;
+}
+
 ssize_t
 copyScatterGatherPartial(
 	void* p,
@@ -90,7 +158,9 @@ copyScatterGatherPartial(
 			if (result != 0)
 				return result;
 
-			block->m_p = (char*)block->m_p + leftover;
+			if (!(block->m_flags & MemBlockFlag_IovIter)) // iov_iter has already been advanced by copy_from_iter
+				block->m_p = (char*)block->m_p + leftover;
+
 			block->m_size -= leftover;
 			*partialBlockIdx = block - blockArray;
 
@@ -32,6 +32,21 @@ copyScatterGather(
 	size_t blockCount
 	);
 
+ssize_t
+copyScatterGatherHead(
+	void* p,
+	size_t size,
+	const MemBlock* blockArray,
+	size_t blockCount
+	);
+
+size_t
+truncateScatterGather(
+	MemBlock* blockArray,
+	size_t blockCount,
+	size_t size
+	);
+
 ssize_t
 copyScatterGatherPartial(
 	void* p,
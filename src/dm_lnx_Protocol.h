@@ -18,13 +18,37 @@ typedef struct dm_List                  dm_List;
 typedef struct dm_HookInfo              dm_HookInfo;
 typedef struct dm_ConnectParams_v0302xx dm_ConnectParams_v0302xx;
 typedef enum dm_ReadMode                dm_ReadMode;
+typedef enum dm_CaptureMode             dm_CaptureMode;
+typedef enum dm_NotifyFormat            dm_NotifyFormat;
+typedef enum dm_Compression             dm_Compression;
+typedef enum dm_PathMode                dm_PathMode;
+typedef enum dm_IoctlArgMode            dm_IoctlArgMode;
+typedef struct dm_FilePath              dm_FilePath;
+typedef enum dm_RingFlag                dm_RingFlag;
+typedef struct dm_RingParams            dm_RingParams;
+typedef struct dm_RingHdr               dm_RingHdr;
+typedef struct dm_ReadBuffer            dm_ReadBuffer;
+typedef struct dm_SnapLength            dm_SnapLength;
+typedef enum dm_PidFilterFlag           dm_PidFilterFlag;
+typedef struct dm_PidFilter             dm_PidFilter;
+typedef struct dm_BpfInsn               dm_BpfInsn;
+typedef struct dm_BpfProgram            dm_BpfProgram;
+typedef enum dm_BpfAncillary            dm_BpfAncillary;
+typedef enum dm_CountersFlag            dm_CountersFlag;
+typedef enum dm_SamplingMode            dm_SamplingMode;
+typedef struct dm_SamplingParams        dm_SamplingParams;
+typedef struct dm_SampleInfo            dm_SampleInfo;
+typedef struct dm_Counters              dm_Counters;
 typedef enum dm_IoctlFlag               dm_IoctlFlag;
 typedef struct dm_IoctlDesc             dm_IoctlDesc;
 typedef struct dm_IoctlDesc_v0302xx     dm_IoctlDesc_v0302xx;
 
 typedef enum dm_NotifyCode              dm_NotifyCode;
 typedef struct dm_NotifyHdr             dm_NotifyHdr;
+typedef enum dm_CompactHdrFlag          dm_CompactHdrFlag;
+typedef struct dm_CompressedHdr         dm_CompressedHdr;
 typedef struct dm_OpenNotifyParams      dm_OpenNotifyParams;
+typedef struct dm_FileKey               dm_FileKey;
 typedef struct dm_CloseNotifyParams     dm_CloseNotifyParams;
 typedef struct dm_ReadWriteNotifyParams dm_ReadWriteNotifyParams;
 typedef struct dm_IoctlNotifyParams     dm_IoctlNotifyParams;
@@ -38,7 +62,15 @@ enum
 {
 	dm_ConnectionCountLimit      = 16,              // no more than 16 connections to a device
 	dm_DefPendingNotifySizeLimit = 1 * 1024 * 1024, // drop notifications if application is not fast enough to pick'em up
+	dm_ReadBufferSizeLimit       = 64 * 1024 * 1024, // max size of a registered read buffer
+	dm_PidFilterCountLimit       = 4096,             // max number of TGIDs in a PID filter
+	dm_BpfInsnCountLimit         = 4096,             // max number of instructions in a BPF filter program
+	dm_BpfContextSizeLimit       = 256,              // max number of notification bytes visible to a BPF filter program
+	dm_CounterEntryCountLimit    = 4096,             // max number of (file, process) pairs tracked in dm_CaptureMode_Counters
+	dm_FileNamePatternCountLimit = 64,               // max number of ';'-separated wildcards in a file name filter ('!' excludes)
+	dm_IoctlArgSizeLimit         = 64 * 1024,        // max captured size of a ioctl argument (fixed + size field)
 	dm_NotifyHdrSignature        = 't' | 'm' << 8 | 'o' << 16 | 'n' << 24, // tmon
+	dm_RingHdrSignature          = 't' | 'm' << 8 | 'r' << 16 | 'g' << 24, // tmrg
 };
 
 // . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . .
@@ -81,6 +113,30 @@ enum
 #define DM_IOCTL_SET_IOCTL_DESC_TABLE _IOW  (DM_IOCTL_MAGIC, 20, dm_List)
 #define DM_IOCTL_GET_PENDING_NOTIFY_SIZE_LIMIT _IOR(DM_IOCTL_MAGIC, 21, uint32_t)
 #define DM_IOCTL_SET_PENDING_NOTIFY_SIZE_LIMIT _IO  (DM_IOCTL_MAGIC, 22)
+#define DM_IOCTL_GET_CAPTURE_MODE     _IOR  (DM_IOCTL_MAGIC, 23, int)
+#define DM_IOCTL_SET_CAPTURE_MODE     _IO   (DM_IOCTL_MAGIC, 24)
+#define DM_IOCTL_GET_RING_PARAMS      _IOR  (DM_IOCTL_MAGIC, 25, dm_RingParams)
+#define DM_IOCTL_SET_RING_PARAMS      _IOW  (DM_IOCTL_MAGIC, 26, dm_RingParams)
+#define DM_IOCTL_SET_READ_BUFFER      _IOW  (DM_IOCTL_MAGIC, 27, dm_ReadBuffer)
+#define DM_IOCTL_GET_NEXT_NOTIFY_SIZE _IOR  (DM_IOCTL_MAGIC, 28, uint32_t)
+#define DM_IOCTL_GET_SNAP_LENGTH      _IOR  (DM_IOCTL_MAGIC, 29, dm_SnapLength)
+#define DM_IOCTL_SET_SNAP_LENGTH      _IOW  (DM_IOCTL_MAGIC, 30, dm_SnapLength)
+#define DM_IOCTL_GET_NOTIFY_CODE_MASK _IOR  (DM_IOCTL_MAGIC, 31, uint32_t)
+#define DM_IOCTL_SET_NOTIFY_CODE_MASK _IO   (DM_IOCTL_MAGIC, 32)
+#define DM_IOCTL_SET_PID_FILTER       _IOW  (DM_IOCTL_MAGIC, 33, dm_PidFilter)
+#define DM_IOCTL_SET_BPF_FILTER       _IOW  (DM_IOCTL_MAGIC, 34, dm_BpfProgram)
+#define DM_IOCTL_GET_COUNTERS         _IOWR (DM_IOCTL_MAGIC, 35, dm_List)
+#define DM_IOCTL_GET_SAMPLING_PARAMS  _IOR  (DM_IOCTL_MAGIC, 36, dm_SamplingParams)
+#define DM_IOCTL_SET_SAMPLING_PARAMS  _IOW  (DM_IOCTL_MAGIC, 37, dm_SamplingParams)
+#define DM_IOCTL_GET_NOTIFY_FORMAT    _IOR  (DM_IOCTL_MAGIC, 38, int)
+#define DM_IOCTL_SET_NOTIFY_FORMAT    _IO   (DM_IOCTL_MAGIC, 39)
+#define DM_IOCTL_GET_COMPRESSION      _IOR  (DM_IOCTL_MAGIC, 40, int)
+#define DM_IOCTL_SET_COMPRESSION      _IO   (DM_IOCTL_MAGIC, 41)
+#define DM_IOCTL_GET_PATH_MODE        _IOR  (DM_IOCTL_MAGIC, 42, int)
+#define DM_IOCTL_SET_PATH_MODE        _IO   (DM_IOCTL_MAGIC, 43)
+#define DM_IOCTL_GET_FILE_PATH        _IOWR (DM_IOCTL_MAGIC, 44, dm_FilePath)
+#define DM_IOCTL_GET_IOCTL_ARG_MODE   _IOR  (DM_IOCTL_MAGIC, 45, int)
+#define DM_IOCTL_SET_IOCTL_ARG_MODE   _IO   (DM_IOCTL_MAGIC, 46)
 
 //..............................................................................
 
@@ -143,10 +199,220 @@ enum dm_ReadMode
 	dm_ReadMode_Undefined = 0,
 	dm_ReadMode_Stream,
 	dm_ReadMode_Message,
+	dm_ReadMode_Batch,   // as many whole notifications as fit into the buffer
 };
 
 // . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . .
 
+enum dm_CaptureMode
+{
+	dm_CaptureMode_Undefined = 0,
+	dm_CaptureMode_Queue,      // default: a single notification queue per connection
+	dm_CaptureMode_PerCpuRing, // lock-free per-CPU rings, merged on read or consumed directly via mmap
+	dm_CaptureMode_Counters,   // no notifications, only per-file per-process aggregates (DM_IOCTL_GET_COUNTERS)
+};
+
+// . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . .
+
+enum dm_NotifyFormat
+{
+	dm_NotifyFormat_Default = 0, // dm_NotifyHdr followed by dm_NotifyParams
+	dm_NotifyFormat_Compact,     // dm_CompactHdrFlag; dm_CaptureMode_Queue and dm_ReadMode_Stream only
+};
+
+// . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . .
+
+enum dm_Compression
+{
+	dm_Compression_None = 0,
+	dm_Compression_Lz4,      // dm_CaptureMode_Queue and dm_NotifyFormat_Default only; requires CONFIG_LZ4_COMPRESS
+};
+
+// . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . .
+
+enum dm_PathMode
+{
+	dm_PathMode_Immediate = 0, // default: open notifications carry the file name
+	dm_PathMode_Deferred,      // dm_FileKey instead; the name is queried with DM_IOCTL_GET_FILE_PATH while the file is open
+};
+
+// . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . .
+
+enum dm_IoctlArgMode
+{
+	dm_IoctlArgMode_Table = 0, // default: only ioctls in the dm_IoctlDesc table have their args captured
+	dm_IoctlArgMode_Auto,      // also _IOR/_IOW/_IOWR ones not in the table (_IOC_SIZE bytes); table entries still win
+};
+
+// . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . .
+
+// DM_IOCTL_GET_FILE_PATH: m_fileId (as in notification params) is in, m_path is
+// in/out as in other string ioctls; -ENOENT if the file is closed already
+
+struct dm_FilePath
+{
+	uint64_t m_fileId;
+	dm_String m_path;
+
+	// followed by m_path chars
+};
+
+// . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . .
+
+enum dm_RingFlag
+{
+	dm_RingFlag_HugePages = 0x01, // back ring data with physically contiguous high-order pages
+};
+
+// . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . .
+
+struct dm_RingParams
+{
+	uint32_t m_ringSize;   // data size of each per-CPU ring (power of 2); 0 -- derive from the pending notify size limit
+	uint32_t m_flags;      // dm_RingFlag
+	uint32_t m_ringCount;  // out: number of rings in the mapping (one per CPU id)
+	uint32_t m_ringStride; // out: distance between two adjacent rings in the mapping
+};
+
+// . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . .
+
+// mmap of a connection in dm_CaptureMode_PerCpuRing yields m_ringCount rings
+// m_ringStride bytes apart; each ring starts with a page-sized dm_RingHdr and is
+// followed by m_size bytes of dm_NotifyHdr records (8-byte aligned). records
+// never wrap: if a record doesn't fit at the end of the ring, the consumer
+// should skip to the beginning (the tail is either too small to hold a
+// dm_NotifyHdr or holds one with zero m_signature). indexes are free-running;
+// the consumer advances m_tail after processing records. records are dropped
+// when the ring is full or when the parameters can't be copied without
+// faulting in user pages (rings are filled with page faults disabled); either
+// way, the next record that fits is preceded by dm_NotifyCode_DataDropped
+
+struct dm_RingHdr
+{
+	uint32_t m_signature;  // dm_RingHdrSignature
+	uint32_t m_size;       // ring data size (power of 2)
+	uint32_t m_dataOffset; // ring data offset relative to this header
+	uint32_t _m_padding1[13];
+
+	uint32_t m_head;       // written by the driver
+	uint32_t _m_padding2[15];
+
+	uint32_t m_tail;       // written by the consumer
+	uint32_t _m_padding3[15];
+};
+
+// . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . .
+
+// a registered read buffer is pinned once; blocking reads into any range of it
+// get notifications written in place instead of being double-buffered.
+// m_size == 0 unregisters the current buffer
+
+struct dm_ReadBuffer
+{
+	uint64_t m_address;
+	uint64_t m_size;
+};
+
+// . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . .
+
+// limits the captured read/write/ioctl payload to the first m_headSize and the
+// last m_tailSize bytes (both 0 -- capture everything). m_dataSize/m_argSize
+// in notification params still hold the true size; the payload is truncated
+// if it's shorter than that
+
+struct dm_SnapLength
+{
+	uint32_t m_headSize;
+	uint32_t m_tailSize;
+};
+
+// . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . .
+
+enum dm_SamplingMode
+{
+	dm_SamplingMode_None = 0, // default: every notification is delivered
+	dm_SamplingMode_Fixed,    // 1 in m_rate
+	dm_SamplingMode_Adaptive, // 1 in N, N is adjusted to keep around m_rate notifications per second
+};
+
+// . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . .
+
+// only read/write/ioctl notifications are sampled (open/close are always
+// delivered); each delivered one is marked with dm_NotifyFlag_Sampled and
+// carries its weight, i.e. the number of notifications it stands for
+
+struct dm_SamplingParams
+{
+	uint32_t m_mode; // dm_SamplingMode
+	uint32_t m_rate;
+};
+
+// . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . .
+
+enum dm_PidFilterFlag
+{
+	dm_PidFilterFlag_Exclude        = 0x01, // capture everything except the listed processes
+	dm_PidFilterFlag_FollowChildren = 0x02, // descendants of the listed processes match, too
+};
+
+// . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . .
+
+// m_count == 0 removes the filter
+
+struct dm_PidFilter
+{
+	uint32_t m_flags; // dm_PidFilterFlag
+	uint32_t m_count;
+
+	// followed by TGIDs: uint32_t [m_count]
+};
+
+// . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . .
+
+// same layout as struct sock_filter, so the usual classic BPF macros and
+// assemblers can be used to build programs
+
+struct dm_BpfInsn
+{
+	uint16_t m_code;
+	uint8_t m_jt;
+	uint8_t m_jf;
+	uint32_t m_k;
+};
+
+// . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . .
+
+// a classic BPF program run over each notification before it's captured; the
+// context is the notification as it would be delivered (dm_NotifyHdr, params,
+// payload) limited to dm_BpfContextSizeLimit bytes, loads are in host byte
+// order, BPF_LEN is the full notification size. the return value is 0 to drop
+// the notification, or the number of bytes to keep (the notification params
+// are never truncated). m_insnCount == 0 removes the program
+
+struct dm_BpfProgram
+{
+	uint32_t m_insnCount;
+	uint32_t _m_padding;
+
+	// followed by dm_BpfInsn [m_insnCount]
+};
+
+// . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . .
+
+// BPF_LD | BPF_W | BPF_ABS offsets for values which are not in the context
+
+enum dm_BpfAncillary
+{
+	dm_BpfAncillary_Uid = -0x1000,
+	dm_BpfAncillary_Gid = -0x1000 + 4,
+};
+
+// . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . .
+
+// with dm_IoctlFlag_HasArgSizeField, the captured size is m_argFixedSize plus
+// the value of the field at m_argSizeFieldOffset in the argument (clamped to
+// dm_IoctlArgSizeLimit; if the field can't be read, just m_argFixedSize)
+
 enum dm_IoctlFlag
 {
 	dm_IoctlFlag_HasArgSizeField       = 0x01,
@@ -192,10 +458,23 @@ enum dm_NotifyCode
 
 // . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . .
 
+// a connection only receives notifications with (1 << code) set in its notify
+// code mask; data-dropped notifications are always delivered
+
+enum
+{
+	dm_NotifyCodeMask_All = (1 << dm_NotifyCode__Count) - 1,
+};
+
+// . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . .
+
 enum dm_NotifyFlag
 {
-	dm_NotifyFlag_InsufficientBuffer = 0x01, // buffer is not big enough, resize and try again (dm_ReadMode_Message)
+	dm_NotifyFlag_InsufficientBuffer = 0x01, // buffer is not big enough, resize and try again (dm_ReadMode_Message, dm_ReadMode_Batch)
 	dm_NotifyFlag_DataDropped        = 0x02, // one or more notifications after this one were dropped
+	dm_NotifyFlag_Sampled            = 0x04, // params are preceded by dm_SampleInfo (included in m_paramSize)
+	dm_NotifyFlag_Compressed         = 0x08, // params are followed by dm_CompressedHdr and an LZ4 block instead of data
+	dm_NotifyFlag_DeferredPath       = 0x10, // open params are followed by dm_FileKey instead of the file name
 };
 
 // . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . .
@@ -216,6 +495,57 @@ struct dm_NotifyHdr
 
 // . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . .
 
+// dm_NotifyFormat_Compact is a stream of variable-size records; numbers are
+// unsigned LEB128 varints (signed ones are zigzag-encoded first):
+//
+//   uint8_t   dm_NotifyCode | dm_CompactHdrFlag
+//   varint    size of the rest of the record
+//   varint    timestamp (delta to the previous record; absolute in sync records)
+//   [varint]  dm_NotifyFlag, if dm_CompactHdrFlag_Flags
+//   [varint]  pid, tid, if dm_CompactHdrFlag_Pid (otherwise same as before)
+//   [zigzag]  result, if dm_CompactHdrFlag_Result (otherwise 0)
+//   [varint]  sample weight, if dm_NotifyFlag_Sampled
+//   params:
+//     open:       file id, flags, mode, file name (null-terminated)
+//     close:      file id
+//     read/write: file id, offset, buffer size, data size, data
+//     ioctl:      file id, code, arg size, arg, argument data
+//
+// file ids are small per-connection numbers assigned at open (or on the first
+// use of a file opened earlier) and released at close; 0 -- a failed open.
+// a sync record (the very first one and the one after lost notifications, e.g.
+// dm_NotifyCode_DataDropped) resets the delta state
+
+enum dm_CompactHdrFlag
+{
+	dm_CompactHdrFlag_CodeMask = 0x0f,
+	dm_CompactHdrFlag_Flags    = 0x10,
+	dm_CompactHdrFlag_Pid      = 0x20,
+	dm_CompactHdrFlag_Result   = 0x40,
+	dm_CompactHdrFlag_Sync     = 0x80, // implies dm_CompactHdrFlag_Pid
+};
+
+// . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . .
+
+// only payloads (read/write data, ioctl arguments) are compressed, and only
+// when it pays off; params are left as is
+
+struct dm_CompressedHdr
+{
+	uint32_t m_size; // decompressed, i.e. the captured data size
+	uint32_t m_compressedSize;
+};
+
+// . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . .
+
+struct dm_SampleInfo
+{
+	uint32_t m_weight;
+	uint32_t _m_padding;
+};
+
+// . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . .
+
 struct dm_OpenNotifyParams
 {
 	uint64_t m_fileId;
@@ -227,6 +557,15 @@ struct dm_OpenNotifyParams
 	// followed by file name
 };
 
+// dm_PathMode_Deferred; device numbers are encoded as in stat
+
+struct dm_FileKey
+{
+	uint64_t m_inode;
+	uint32_t m_dev;  // the file system
+	uint32_t m_rdev; // the device itself
+};
+
 struct dm_CloseNotifyParams
 {
 	uint64_t m_fileId;
@@ -271,4 +610,33 @@ union dm_NotifyParamsPtr
 	dm_IoctlNotifyParams* m_ioctlParams;
 };
 
+// . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . .
+
+enum dm_CountersFlag
+{
+	dm_CountersFlag_Closed       = 0x01, // the file is closed; reported once more, then discarded
+	dm_CountersFlag_HasTransfers = 0x02, // m_min/m_maxTransferSize are valid (a read/write has succeeded)
+};
+
+// . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . . .
+
+// DM_IOCTL_GET_COUNTERS returns a dm_List of these (one per file per process);
+// counters are cumulative, rates are up to the consumer (see m_lastTimestamp).
+// updates take a short per-connection spinlock (never held across user
+// copies), so ops on different CPUs still briefly serialize on it
+
+struct dm_Counters
+{
+	uint64_t m_fileId;
+	uint32_t m_tgid;
+	uint32_t m_flags; // dm_CountersFlag
+	uint64_t m_lastTimestamp;
+	uint64_t m_opCountTable[dm_NotifyCode__Count]; // indexed by dm_NotifyCode
+	uint64_t m_errorCount; // ops which returned an error
+	uint64_t m_readByteCount;
+	uint64_t m_writeByteCount;
+	uint32_t m_minTransferSize; // successful read/write data size
+	uint32_t m_maxTransferSize;
+};
+
 //..............................................................................
@@ -317,4 +317,110 @@ getOwnerModule(struct file* filp)
 	return NULL;
 }
 
+long
+pinUserPages(
+	ulong address,
+	size_t pageCount,
+	struct page** pageArray
+	)
+{
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(5, 8, 0))
+	return pin_user_pages_fast(address, pageCount, FOLL_WRITE | FOLL_LONGTERM, pageArray);
+#elif (LINUX_VERSION_CODE >= KERNEL_VERSION(5, 2, 0))
+	return get_user_pages_fast(address, pageCount, FOLL_WRITE, pageArray);
+#else
+	return get_user_pages_fast(address, pageCount, 1, pageArray);
+#endif
+}
+
+void
+unpinUserPages(
+	struct page** pageArray,
+	size_t pageCount
+	)
+{
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(5, 8, 0))
+	unpin_user_pages_dirty_lock(pageArray, pageCount, true);
+#else
+	size_t i;
+
+	for (i = 0; i < pageCount; i++)
+	{
+		set_page_dirty_lock(pageArray[i]);
+		put_page(pageArray[i]);
+	}
+#endif
+}
+
+int
+chargePinnedPages(
+	struct mm_struct* mm,
+	size_t pageCount
+	)
+{
+	ulong limit = rlimit(RLIMIT_MEMLOCK) >> PAGE_SHIFT;
+	bool isCapable = capable(CAP_IPC_LOCK);
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(5, 0, 0))
+	if ((ulong)atomic64_add_return(pageCount, &mm->pinned_vm) > limit && !isCapable)
+	{
+		atomic64_sub(pageCount, &mm->pinned_vm);
+		return -ENOMEM;
+	}
+#else
+	down_write(&mm->mmap_sem);
+	if (mm->pinned_vm + pageCount > limit && !isCapable)
+	{
+		up_write(&mm->mmap_sem);
+		return -ENOMEM;
+	}
+
+	mm->pinned_vm += pageCount;
+	up_write(&mm->mmap_sem);
+#endif
+
+	return 0;
+}
+
+void
+unchargePinnedPages(
+	struct mm_struct* mm,
+	size_t pageCount
+	)
+{
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(5, 0, 0))
+	atomic64_sub(pageCount, &mm->pinned_vm);
+#else
+	down_write(&mm->mmap_sem);
+	mm->pinned_vm -= pageCount;
+	up_write(&mm->mmap_sem);
+#endif
+}
+
+bool
+snapshotIovIter(
+	struct iov_iter* snapshot,
+	const struct iov_iter* iter
+	)
+{
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(6, 0, 0))
+	if (!user_backed_iter(iter) && !iov_iter_is_kvec(iter) && !iov_iter_is_bvec(iter))
+		return false;
+#elif (LINUX_VERSION_CODE >= KERNEL_VERSION(4, 20, 0))
+	if (!iter_is_iovec(iter) && !iov_iter_is_kvec(iter) && !iov_iter_is_bvec(iter))
+		return false;
+#elif (LINUX_VERSION_CODE >= KERNEL_VERSION(4, 9, 0))
+	if (iter->type & ITER_PIPE)
+		return false;
+#endif
+
+	*snapshot = *iter;
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(5, 14, 0))
+	snapshot->data_source = true; // the destination of read_iter is copied from afterwards
+#endif
+
+	return true;
+}
+
 //..............................................................................
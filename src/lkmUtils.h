@@ -69,10 +69,73 @@ atomicDec(volatile long* p)
 	return __sync_sub_and_fetch(p, 1);
 }
 
+// increments unless zero (i.e. unless the object is being destroyed)
+
+static
+inline
+long
+atomicIncNotZero(volatile long* p)
+{
+	long value = *p;
+	long prevValue;
+
+	while (value)
+	{
+		prevValue = __sync_val_compare_and_swap(p, value, value + 1);
+		if (prevValue == value)
+			return value + 1;
+
+		value = prevValue;
+	}
+
+	return 0;
+}
+
 uint64_t
 getTimestamp(void);
 
 struct module*
 getOwnerModule(struct file* filp);
 
+// long-term write pins of user pages; returns the number of pages pinned
+
+long
+pinUserPages(
+	ulong address,
+	size_t pageCount,
+	struct page** pageArray
+	);
+
+void
+unpinUserPages(
+	struct page** pageArray,
+	size_t pageCount
+	);
+
+// charges long-term pins to mm->pinned_vm against RLIMIT_MEMLOCK (unless
+// CAP_IPC_LOCK), as other FOLL_LONGTERM users do
+
+int
+chargePinnedPages(
+	struct mm_struct* mm,
+	size_t pageCount
+	);
+
+void
+unchargePinnedPages(
+	struct mm_struct* mm,
+	size_t pageCount
+	);
+
+// the fop doesn't own the segment array (iovec/kvec/bvec) of the iterator --
+// it stays intact until the fop returns; so for these, a shallow copy of the
+// iterator itself is enough to re-read the data afterwards (unlike e.g. pipes);
+// returns false if the iterator can't be snapshot this way
+
+bool
+snapshotIovIter(
+	struct iov_iter* snapshot,
+	const struct iov_iter* iter
+	);
+
 //..............................................................................
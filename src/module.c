@@ -1,5 +1,6 @@
 #include "pch.h"
 #include "Device.h"
+#include "MemCache.h"
 #include "version.h"
 #include "dm_lnx_Protocol.h"
 
@@ -34,10 +35,18 @@ tdevmon_init(void)
 		g_devicePermissions = permissions;
 	}
 
+	result = MemCache_create();
+	if (result != 0)
+	{
+		printk(KERN_ERR "tdevmon: failed to create memory caches: %d\n", result);
+		return result;
+	}
+
 	result = DeviceClass_register(&g_deviceClass);
 	if (result != 0)
 	{
 		printk(KERN_ERR "tdevmon: failed to register device class " DM_DEVICE_CLASS_NAME ": %d\n", result);
+		MemCache_destroy();
 		return result;
 	}
 
@@ -46,6 +55,7 @@ tdevmon_init(void)
 	{
 		printk(KERN_ERR "tdevmon: failed to create device /dev/" DM_DEVICE_NAME ": %d\n", result);
 		DeviceClass_unregister(&g_deviceClass);
+		MemCache_destroy();
 		return result;
 	}
 
@@ -69,6 +79,7 @@ tdevmon_exit(void)
 
 	Device_destruct(&g_device);
 	DeviceClass_unregister(&g_deviceClass);
+	MemCache_destroy();
 	printk(KERN_INFO "tdevmon: uninititialized\n");
 }
 
@@ -12,9 +12,20 @@
 #include <linux/poll.h>
 #include <linux/cdev.h>
 #include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/highmem.h>
+#include <linux/rcupdate.h>
+#include <linux/srcu.h>
+#include <linux/cpumask.h>
+#include <linux/log2.h>
+#include <linux/hash.h>
+#include <linux/math64.h>
 #include <linux/wait.h>
 #include <linux/sched.h>
 #include <linux/ctype.h>
+#include <linux/cred.h>
+#include <linux/filter.h>
 #include <asm/uaccess.h>
 #include <asm/ioctls.h>
 
@@ -22,6 +33,16 @@
 #	include <asm/cacheflush.h>
 #endif
 
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(6, 12, 0))
+#	include <linux/unaligned.h>
+#else
+#	include <asm/unaligned.h>
+#endif
+
+#if IS_ENABLED(CONFIG_LZ4_COMPRESS)
+#	include <linux/lz4.h>
+#endif
+
 #define ASSERT(condition) BUG_ON(!(condition))
 
 #if (((__GNUC__ << 8) | __GNUC_MINOR__) >= 0x0409)
@@ -37,3 +58,24 @@
 #else
 #	define devnode_mode_t umode_t
 #endif
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(4, 20, 0))
+#	define synchronize_sched synchronize_rcu // RCU flavors were consolidated in 4.20
+#endif
+
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(3, 7, 0))
+#	define VM_DONTDUMP VM_RESERVED
+#endif
+
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(4, 11, 0))
+#	define mmgrab(mm) atomic_inc(&(mm)->mm_count)
+#endif
+
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(6, 3, 0))
+#	define vm_flags_set(vma, flags) ((vma)->vm_flags |= (flags)) // vm_flags are read-only since 6.3
+#endif
+
+#ifndef BPF_MOD // classic BPF got mod and xor in 3.7
+#	define BPF_MOD 0x90
+#	define BPF_XOR 0xa0
+#endif